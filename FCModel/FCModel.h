@@ -14,7 +14,9 @@
 #import "FMDatabase.h"
 #endif
 
-@class FCModelFieldInfo;
+#import "FCModelCodec.h"
+
+@class FCModelFieldInfo, FCModelRowView, FCModelChange;
 
 // These notifications use the relevant model's Class as the "object" for convenience so observers can,
 //  for instance, observe every update to any instance of the Person class:
@@ -31,7 +33,10 @@ extern NSString * const FCModelAnyChangeNotification; // Any insert, update, del
 // userInfo[FCModelInstanceSetKey] is an NSSet containing the specific FCModel instance(s) acted upon.
 // The set will always contain exactly one instance, except:
 //  - If you use begin/endNotificationBatchAndNotify, it will contain all instances that received the notification during the batch.
-//  - For dataWasUpdatedExternally/executeUpdateQuery:, it will contain all loaded instances of the class.
+//  - For dataWasUpdatedExternally, each loaded instance whose values changed gets its own notification, and then one more is
+//     sent for the class as a whole (since unloaded rows may have changed) containing all loaded instances of the class.
+//  - For rows changed by executeUpdateQuery: or inDatabaseSync: that have no loaded instance, one notification per class is sent
+//     for them with all field names and all loaded instances of the class.
 //
 extern NSString * const FCModelInstanceSetKey;
 //
@@ -41,9 +46,10 @@ extern NSString * const FCModelInstanceSetKey;
 extern NSString * const FCModelChangedFieldsKey;
 
 
-// During dataWasUpdatedExternally and executeUpdateQuery:, this is called immediately before FCModel tells all loaded
-//  instances of the affected class to reload themselves. Reloading can be time-consuming if many instances are in memory,
-//  so this is a good time to release any unnecessarily retained instances so they don't need to go through the reload.
+// During dataWasUpdatedExternally (and executeUpdateQuery:/inDatabaseSync: writes that can't be reloaded row by row), this is
+//  called immediately before FCModel tells all loaded instances of the affected class to reload themselves. Reloading can be
+//  time-consuming if many instances are in memory, so this is a good time to release any unnecessarily retained instances so
+//  they don't need to go through the reload.
 // The notification's object is the affected class.
 //
 // (You probably don't need to care about this. Until you do.)
@@ -58,6 +64,13 @@ typedef NS_ENUM(NSInteger, FCModelSaveResult) {
     FCModelSaveNoChanges
 };
 
+typedef NS_ENUM(uint8_t, FCModelChangeOperation) {
+    FCModelChangeInsert = 1,
+    FCModelChangeUpdate,
+    FCModelChangeDelete,
+    FCModelChangeUnidentifiedRows // Rows changed that FCModel can't name, e.g. by dataWasUpdatedExternally. primaryKey is nil.
+};
+
 @interface FCModel : NSObject
 
 @property (readonly) id primaryKey;
@@ -70,6 +83,12 @@ typedef NS_ENUM(NSInteger, FCModelSaveResult) {
 + (void)openDatabaseAtPath:(NSString *)path withSchemaBuilder:(void (^)(FMDatabase *db, int *schemaVersion))schemaBuilder;
 + (void)openDatabaseAtPath:(NSString *)path withDatabaseInitializer:(void (^)(FMDatabase *db))databaseInitializer schemaBuilder:(void (^)(FMDatabase *db, int *schemaVersion))schemaBuilder;
 
+// Opens the database in WAL mode with up to readerCount read-only connections, so SELECTs from multiple threads can run
+//  concurrently with each other and with writes. (Writes are still serialized.) The databaseInitializer is called on the main
+//  connection before the schemaBuilder, and again on each read-only connection when it's opened.
+// A readerCount of 0 is equivalent to the methods above: every query is serialized on one connection.
++ (void)openDatabaseAtPath:(NSString *)path withDatabaseInitializer:(void (^)(FMDatabase *db))databaseInitializer schemaBuilder:(void (^)(FMDatabase *db, int *schemaVersion))schemaBuilder maximumConcurrentReaders:(NSUInteger)readerCount;
+
 + (NSArray *)databaseFieldNames;
 + (NSString *)primaryKeyFieldName;
 
@@ -81,20 +100,25 @@ typedef NS_ENUM(NSInteger, FCModelSaveResult) {
 
 // Feel free to operate on the same database object with your own queries. They'll be
 //  executed synchronously on FCModel's private database-operation queue.
-//  (IMPORTANT: READ THE NEXT METHOD DEFINITION)
+//
+// Rows it writes are recorded with SQLite's update hook, and once they're committed, only the loaded instances of those
+//  rows are reloaded. Writes SQLite doesn't report (WITHOUT ROWID tables, or DELETE without WHERE) make the class this is
+//  called on reload everything, as with dataWasUpdatedExternally.
 + (void)inDatabaseSync:(void (^)(FMDatabase *db))block;
 
-// Call if you perform INSERT/UPDATE/DELETE on any FCModel table outside of the instance*/save
-// methods. This will cause any instances in existence to reload their data from the database.
+// Call if you perform INSERT/UPDATE/DELETE on any FCModel table outside of the instance*/save methods,
+// inDatabaseSync:, or executeUpdateQuery: (e.g. from another process). This will cause any instances in existence to
+// reload their data from the database.
 //
 //  - Call on a subclass to reload all instances of that model and any subclasses.
 //  - Call on FCModel to reload all instances of ALL models.
 //
 + (void)dataWasUpdatedExternally;
 
-// Or use one of these convenience methods, which calls dataWasUpdatedExternally automatically and offers $T/$PK parsing.
-// If you don't know which tables will be affected, or if it will affect more than one, call on FCModel, not a subclass.
-// Only call on a subclass if only that model's table will be affected.
+// Or use one of these convenience methods, which reload only the instances of the rows they change (like inDatabaseSync:)
+//  and offer $T/$PK parsing.
+// If SQLite can't report the changed rows and you don't know which tables will be affected, or if it will affect more than one,
+//  call on FCModel, not a subclass.
 + (NSError *)executeUpdateQuery:(NSString *)query, ...;
 + (NSError *)executeUpdateQuery:(NSString *)query arguments:(NSArray *)arguments;
 
@@ -106,7 +130,9 @@ typedef NS_ENUM(NSInteger, FCModelSaveResult) {
 - (void)revertUnsavedChangeToFieldName:(NSString *)fieldName;
 - (FCModelSaveResult)delete;
 - (FCModelSaveResult)save;
-+ (void)saveAll; // Resolved by class: call on FCModel to save all, on a subclass to save just those and their subclasses, etc.
+// Resolved by class: call on FCModel to save all, on a subclass to save just those and their subclasses, etc.
+// All loaded instances with unsaved changes are written in one transaction, and their notifications are batched.
++ (void)saveAll;
 
 // SELECTs
 // - "keyed" variants return dictionaries keyed by each instance's primary-key value.
@@ -134,10 +160,26 @@ typedef NS_ENUM(NSInteger, FCModelSaveResult) {
 + (NSArray *)instancesOrderedBy:(NSString *)queryAfterORDERBY, ...;
 + (NSArray *)instancesOrderedBy:(NSString *)queryAfterORDERBY arguments:(NSArray *)arguments;
 
+// Streams the matching instances in primary-key order, loading batchSize at a time (0 for the default of 1000), without
+//  holding the database between batches and draining an autorelease pool after each one. The query must be a plain WHERE
+//  condition without ORDER BY or LIMIT. Rows inserted or deleted during enumeration may or may not be included.
++ (void)enumerateInstancesWhere:(NSString *)queryAfterWHERE arguments:(NSArray *)arguments batchSize:(NSUInteger)batchSize usingBlock:(void (^)(id instance, BOOL *stop))block;
+
+// One page of the matching instances, ordered by a field name with optional "DESC" and then by primary key, starting after
+//  lastInstance (nil for the first page). Pages seek past the previous page's last sort value and primary key instead of
+//  using OFFSET, with statements kept in the statement cache, so deep pages cost the same as the first. The query must be
+//  a plain WHERE condition without ORDER BY or LIMIT, or nil for all instances.
++ (NSArray *)instancesWhere:(NSString *)queryAfterWHERE arguments:(NSArray *)arguments orderedBy:(NSString *)fieldNameAndDirection after:(FCModel *)lastInstance limit:(NSUInteger)limit;
+
 + (NSUInteger)numberOfInstances;
 + (NSUInteger)numberOfInstancesWhere:(NSString *)queryAfterWHERE, ...;
 + (NSUInteger)numberOfInstancesWhere:(NSString *)queryAfterWHERE arguments:(NSArray *)arguments;
 
+// Reads only the given fields (plus the primary key) of the matching rows into read-only FCModelRowViews, without loading
+//  or decoding whole instances. Useful for lists over wide tables or tables with large BLOB fields. The query may include
+//  ORDER BY and LIMIT, and may be nil for all rows.
++ (NSArray *)rowViewsWithFieldNames:(NSArray *)fieldNames where:(NSString *)queryAfterWHERE arguments:(NSArray *)arguments;
+
 // Fetch a set of primary keys, i.e. "WHERE key IN (...)"
 + (NSArray *)instancesWithPrimaryKeyValues:(NSArray *)primaryKeyValues;
 + (NSDictionary *)keyedInstancesWithPrimaryKeyValues:(NSArray *)primaryKeyValues;
@@ -150,11 +192,14 @@ typedef NS_ENUM(NSInteger, FCModelSaveResult) {
 + (id)firstValueFromQuery:(NSString *)query, ...;
 + (id)firstValueFromQuery:(NSString *)query arguments:(NSArray *)arguments;
 
-// These methods use a global query cache (in FCModelCachedObject). Results are cached indefinitely until their
-//  table has any writes or there's a system low-memory warning, at which point they automatically invalidate.
+// These methods use a global query cache (in FCModelCachedObject). Results are cached until their table has any writes
+//  or there's a system low-memory warning, at which point they automatically invalidate, or until they're evicted to stay
+//  within the cache's size limits, if set (see FCModelCachedObject's setMaximumEntryCount:estimatedByteCount:).
 //  You can customize whether invalidations are triggered with the optional ignoreFieldsForInvalidation: params.
 // The next subsequent request will repopulate the cached data, either by querying the DB (cachedInstancesWhere)
-//  or calling the generator block (cachedObjectWithIdentifier).
+//  or calling the generator block (cachedObjectWithIdentifier). cachedInstancesWhere results are instead updated in place
+//  from the changed instances where possible (see FCModelLiveResultArray), and only re-check rows when a field their
+//  query reads has changed, so they rarely need ignoreFieldsForInvalidation.
 //
 + (NSArray *)cachedInstancesWhere:(NSString *)queryAfterWHERE arguments:(NSArray *)arguments;
 + (NSArray *)cachedInstancesWhere:(NSString *)queryAfterWHERE arguments:(NSArray *)arguments ignoreFieldsForInvalidation:(NSSet *)ignoredFields;
@@ -175,6 +220,16 @@ typedef NS_ENUM(NSInteger, FCModelSaveResult) {
 
 + (NSSet *)ignoredFieldNames; // Fields that exist in the table but should not be read into the model. Default empty set, cannot be nil.
 
+// By default, hasUnsavedChanges, changedFieldNames, and -save find changes by decoding every field's database value and comparing it
+//  to the property's current value. Return YES to instead have FCModel wrap this class's property setters when the database is opened
+//  and record which fields have been set since the last save, so those checks only look at (and -save only writes) those fields.
+//
+//  - A field counts as changed once its setter is called, including through KVC, even if the new value is equal to the old one.
+//  - Changes that bypass the setter aren't seen, such as assigning the ivar directly or mutating a mutable object in place.
+//  - Tables with more than 64 columns, or properties with setters of non-numeric, non-object types, fall back to the default.
+//
++ (BOOL)tracksChangesWithSetters;
+
 // To create new records with supplied primary-key values, call instanceWithPrimaryKey:, then save when done
 //  setting other fields.
 //
@@ -192,6 +247,12 @@ typedef NS_ENUM(NSInteger, FCModelSaveResult) {
 // FCModel automatically handles numeric primitives, NSString, NSNumber, NSData, NSURL, NSDate, NSDictionary, and NSArray.
 // (Note that NSDate is stored as a time_t, so values before 1970 won't serialize properly.)
 //
+// NSDictionary and NSArray BLOBs are kept as NSData when a row is read and only deserialized on the property's first access.
+//  Until the property is set to something else, change checks compare the stored bytes rather than decoding them. Its ivar
+//  stays nil until that first access, so a model's own methods should read such fields through the property, not the ivar;
+//  decoding doesn't post KVO notifications. Classes that override either unserializedRepresentationOfDatabaseValue: decode
+//  every field as it's read instead.
+//
 // To override this behavior or customize it for other types, you can implement these methods.
 // You MUST call the super implementation for values that you're not handling.
 //
@@ -200,6 +261,17 @@ typedef NS_ENUM(NSInteger, FCModelSaveResult) {
 - (id)serializedDatabaseRepresentationOfValue:(id)instanceValue forPropertyNamed:(NSString *)propertyName;
 - (id)unserializedRepresentationOfDatabaseValue:(id)databaseValue forPropertyNamed:(NSString *)propertyName;
 
+// The default instance decoding above calls this, and FCModelRowViews, which have no instance, call it directly. Override this
+//  instead of the instance method when decoding doesn't depend on the instance, so row views decode the same way.
++ (id)unserializedRepresentationOfDatabaseValue:(id)databaseValue forPropertyNamed:(NSString *)propertyName;
+
+// The codec that converts an NSDictionary or NSArray field to and from its BLOB. Called once per field when the database is opened.
+//  The default is FCModelPropertyListCodec's sharedCodec. Return FCModelBinaryCodec's for a smaller format that's faster to read and
+//  write; existing plist values are still read, and are only rewritten in the new format when the field is changed and saved.
+//  (See FCModelCodec.h.)
+//
++ (id <FCModelCodec>)codecForFieldName:(NSString *)fieldName;
+
 // Called on subclasses if there's a reload conflict:
 //  - The instance changes field X but doesn't save the changes to the database.
 //  - Database updates are executed outside of FCModel that cause instances to reload their data.
@@ -243,6 +315,67 @@ typedef NS_ENUM(NSInteger, FCModelSaveResult) {
 + (void)performWithBatchedNotifications:(void (^)())block; // equivalent to performWithBatchedNotifications:deliverOnCompletion:YES
 + (BOOL)isBatchingNotificationsForCurrentThread;
 
+// Change notifications, and the reloads of changed instances that lead to them, are delivered on the main thread by default:
+//  immediately if the change was made there, or asynchronously on the main queue otherwise.
+//
+// Pass a serial queue to deliver them on it instead, or nil to deliver them synchronously on the thread that made the change,
+//  e.g. in a process whose main thread is busy with other work. Observers, including FCModelCachedObject's invalidation, then
+//  run there. Pass dispatch_get_main_queue() to restore the default.
+//
+// Even when synchronous, notifications are never delivered on the database queue. Those for changes made there, e.g. a save
+//  inside an inDatabaseSync: block, are delivered in order on another thread once the block returns. Cached objects are still
+//  invalidated before it returns.
+//
+// This can only be set while the database is closed, and raises NSInternalInconsistencyException otherwise.
+//
++ (void)setNotificationDeliveryQueue:(dispatch_queue_t)queue;
+
+// Coalesces change notifications made outside of batches, from any thread, into one batch per window: the first such change
+//  opens a window, and when it ends, one notification per class and name is delivered with every instance changed during it,
+//  as if the changes had been made in performWithBatchedNotifications:. A window ends early once maximumCount changes (saves,
+//  deletes, reloads, or class-wide updates) have been collected, 0 for no limit, and always after a whole change, so one save's
+//  notifications are never split between windows. FCModelWillSendAnyChangeNotification is never held back, so cached objects
+//  are still invalidated immediately.
+//
+// Off by default. Pass an interval of 0 to turn it off and deliver anything pending.
+//
++ (void)setNotificationCoalescingInterval:(NSTimeInterval)interval maximumCount:(NSUInteger)maximumCount;
+
+// Change subscriptions: a lighter alternative to the notifications above. Each insert, update, or delete is delivered as a compact
+//  FCModelChange record instead of a userInfo dictionary, and only to the subscriptions it matches, so watching one row doesn't
+//  mean being called for every change to its class.
+//
+// Call on a model class to subscribe to its changes, or on FCModel for every class's. Pass a primaryKey to receive only that
+//  row's changes, and fieldNames to receive only changes to any of those fields; nil for either means all. FCModelChangeUnidentifiedRows
+//  records go to every subscription for the class, since any row may be among them. While the database is open, primaryKey is
+//  converted to the column's type like instanceWithPrimaryKey:'s, so @"1" and @1 watch the same row.
+//
+// Blocks are called where notifications are delivered (see setNotificationDeliveryQueue:), after the notifications, with all of a
+//  delivery's matching records in one array: a batch or coalescing window delivers them together, in the order they happened.
+//
+// Returns a token for removeChangeSubscription:. Subscriptions are kept across closing and reopening the database.
+//
++ (id)subscribeToChangesWithPrimaryKey:(id)primaryKey fieldNames:(NSArray *)fieldNames block:(void (^)(NSArray *changes))block;
++ (void)removeChangeSubscription:(id)subscription;
+
+// The bits for these fields in FCModelChange's changedFieldMask, while the database is open. Fields past the 64th share every bit.
++ (uint64_t)changeMaskForFieldNames:(NSArray *)fieldNames;
+
+// Transactions:
+//
+// Runs the block inside one database transaction, so any number of saves, deletes, and executeUpdateQuery: calls in it are
+//  committed or rolled back together, with one disk sync instead of one per statement. Return YES from the block to commit,
+//  NO to roll back. Returns YES if the transaction was committed.
+//
+//  - Transactions can be nested. Inner transactions use SQLite savepoints, so rolling one back only undoes its own changes.
+//  - Change notifications sent from inside the block are held until the outermost transaction commits, then sent in their
+//     original order from the calling thread. If it rolls back, they're discarded, and any instances saved or deleted inside it
+//     revert to their previous database state. (Their property values are kept, so they show up as unsaved changes again.)
+//  - The block runs on FCModel's database queue and holds it until it returns. Do the transaction's work on the thread it's
+//     called from: waiting inside the block for another thread that's using FCModel will deadlock.
+//
++ (BOOL)performTransaction:(BOOL (^)(void))block;
+
 // Field info: You probably won't need this most of the time, but it's nice to have sometimes. FCModel's generating this privately
 //  anyway, so you might as well have read-only access to it if it can help you avoid some code. (I've already needed it.)
 //
@@ -277,6 +410,32 @@ typedef NS_ENUM(NSInteger, FCModelSaveResult) {
 @end
 
 
+// A snapshot of some of a row's fields, from rowViewsWithFieldNames:where:arguments:. Values are decoded by the model class's
+//  +unserializedRepresentationOfDatabaseValue:forPropertyNamed: (e.g. plist BLOBs into NSArray/NSDictionary) when first
+//  accessed, by subscript or valueForKey:.
+// Like FCModel instances, a row view shouldn't be accessed from multiple threads at once.
+@interface FCModelRowView : NSObject
+@property (nonatomic, readonly) Class modelClass;
+@property (nonatomic, readonly) id primaryKey;
+@property (nonatomic, readonly) NSArray *fieldNames;
+
+- (id)objectForKeyedSubscript:(NSString *)fieldName; // nil for NULL or for fields that weren't read
+
+// The full instance, already loaded or read from the database on first access. nil if the row has since been deleted.
+@property (nonatomic, readonly) id instance;
+@end
+
+
+// One change delivered to a change subscription. Test changedFieldMask against +changeMaskForFieldNames:. As with the
+//  notifications, it may be overly inclusive: deletes and unidentified rows have every bit set.
+@interface FCModelChange : NSObject
+@property (nonatomic, readonly) Class modelClass;
+@property (nonatomic, readonly) FCModelChangeOperation operation;
+@property (nonatomic, readonly) id primaryKey;
+@property (nonatomic, readonly) uint64_t changedFieldMask;
+@end
+
+
 typedef NS_ENUM(NSInteger, FCModelFieldType) {
     FCModelFieldTypeOther = 0,
     FCModelFieldTypeText,
@@ -14,6 +14,7 @@
 #import "FMDatabaseAdditions.h"
 #import <sqlite3.h>
 #import <Security/Security.h>
+#import <pthread.h>
 
 NSString * const FCModelInsertNotification = @"FCModelInsertNotification";
 NSString * const FCModelUpdateNotification = @"FCModelUpdateNotification";
@@ -24,68 +25,908 @@ NSString * const FCModelChangedFieldsKey = @"FCModelChangedFieldsKey";
 
 NSString * const FCModelWillReloadNotification = @"FCModelWillReloadNotification";
 NSString * const FCModelWillSendAnyChangeNotification = @"FCModelWillSendAnyChangeNotification"; // for FCModelCachedObject
+NSString * const FCModelUnidentifiedRowsChangedKey = @"FCModelUnidentifiedRowsChangedKey"; // for FCModelLiveResultArray: rows other than the instances may have changed
 
-static NSString * const FCModelReloadNotification = @"FCModelReloadNotification";
-static NSString * const FCModelSaveNotification   = @"FCModelSaveNotification";
 
 static NSString * const FCModelEnqueuedBatchNotificationsKey = @"FCModelEnqueuedBatchNotifications";
 static NSString * const FCModelEnqueuedBatchChangedFieldsKey   = @"FCModelEnqueuedBatchChangedFields";
+static NSString * const FCModelEnqueuedBatchChangesKey         = @"FCModelEnqueuedBatchChanges";
+static NSString * const FCModelTransactionStackKey = @"FCModelTransactionStack";
 
 static FCModelDatabaseQueue *g_databaseQueue = NULL;
 static NSDictionary *g_fieldInfo = NULL;
+static NSDictionary *g_fieldNamesByIndex = NULL; // class -> field names sorted by name, so each field's fieldIndex is its bit in a column mask
 static NSDictionary *g_ignoredFieldNames = NULL;
 static NSDictionary *g_primaryKeyFieldName = NULL;
 static NSSet *g_tablesUsingAutoIncrementEmulation = NULL;
-static NSMutableDictionary *g_instances = NULL;
-static dispatch_semaphore_t g_instancesReadLock;
+static NSSet *g_classesTrackingSetters = NULL;
+static NSMutableDictionary *g_setterTrackers = NULL; // class -> field name -> FCModelSetterTracker, kept across close/open
+static NSDictionary *g_fieldCodecs = NULL; // class -> NSArray/NSDictionary field name -> id <FCModelCodec>
+static NSDictionary *g_lazilyDecodedFieldNames = NULL; // class -> NSArray/NSDictionary field names whose plists are decoded on first access
+static NSMutableDictionary *g_lazyFieldAccessors = NULL; // class -> field names whose accessors are wrapped for lazy decoding, kept across close/open
+static NSDictionary *g_rowDecoders = NULL; // class -> FCModelRowDecoder
+static NSDictionary *g_identityMaps = NULL; // class -> FCModelIdentityMap
+static NSSet *g_tablesWithRowIDPrimaryKeys = NULL; // tables whose INTEGER PRIMARY KEY is an alias for the rowid
+@class FCModelRowChangeLog;
+static FCModelRowChangeLog *g_rowChangeLog = NULL;
 
 @interface FMDatabase (HackForVAListsSinceThisIsPrivate)
 - (FMResultSet *)executeQuery:(NSString *)sql withArgumentsInArray:(NSArray*)arrayArgs orDictionary:(NSDictionary *)dictionaryArgs orVAList:(va_list)args;
 - (BOOL)executeUpdate:(NSString*)sql error:(NSError**)outErr withArgumentsInArray:(NSArray*)arrayArgs orDictionary:(NSDictionary *)dictionaryArgs orVAList:(va_list)args;
+- (void)bindObject:(id)obj toColumn:(int)idx inStatement:(sqlite3_stmt*)pStmt;
 @end
 
-static inline void onMainThreadAsync(void (^block)())
+typedef NS_ENUM(NSInteger, FCModelStatementOperation) {
+    FCModelStatementInsert,
+    FCModelStatementUpdate,
+    FCModelStatementDelete,
+};
+
+// Identifies a cached write statement: one per class, operation, and set of columns written (as a mask of fieldIndex bits)
+@interface FCModelStatementKey : NSObject <NSCopying> {
+    @public
+    Class modelClass;
+    FCModelStatementOperation operation;
+    uint64_t columnMask;
+}
+@end
+
+@implementation FCModelStatementKey
+- (id)copyWithZone:(NSZone *)zone { return self; }
+- (NSUInteger)hash { return (NSUInteger) columnMask ^ ((uintptr_t) (__bridge void *) modelClass >> 4) ^ ((NSUInteger) operation << 28); }
+
+- (BOOL)isEqual:(FCModelStatementKey *)other
+{
+    return [other isKindOfClass:FCModelStatementKey.class] && other->modelClass == modelClass && other->operation == operation && other->columnMask == columnMask;
+}
+@end
+
+static dispatch_semaphore_t g_notificationQueueLock = NULL; // for the two below, which are only set while the database is closed
+static dispatch_queue_t g_notificationQueue = NULL;          // NULL: the main queue, unless delivering synchronously
+static BOOL g_notificationsDeliveredSynchronously = NO;
+static void *FCModelNotificationQueueKey = &FCModelNotificationQueueKey;
+static dispatch_queue_t g_databaseQueueNotificationQueue = NULL; // serial, for synchronous notifications of changes made on the database queue
+static NSMutableArray *g_databaseQueueNotifications = NULL;      // only used on the database queue: blocks waiting for its current operation to end
+
+static dispatch_semaphore_t g_coalescingLock = NULL;
+static NSTimeInterval g_coalescingInterval = 0;              // 0: unbatched notifications are posted individually
+static NSUInteger g_coalescingMaximumCount = 0;              // 0: no limit
+static NSMutableDictionary *g_coalescedNotifications = NULL; // same layout as a thread's batch: class -> name -> instances
+static NSMutableDictionary *g_coalescedChangedFields = NULL; // class -> changed field names
+static NSUInteger g_coalescedCount = 0;                      // changes (saves, deletes, reloads) in the pending window
+static NSMutableArray *g_coalescedChanges = NULL;            // FCModelChange records for subscriptions
+static uint64_t g_coalescingWindow = 0;                      // bumped whenever the pending window is taken, so stale timers do nothing
+
+static dispatch_semaphore_t g_changeSubscriptionsLock = NULL;
+static NSMutableDictionary *g_changeSubscriptions = NULL;    // class, or FCModel for all classes -> FCModelChangeSubscriptionList
+
+// Whether synchronous notifications would be delivered on the database queue, so they have to wait (see onNotificationQueue).
+//  FCModelWillSendAnyChangeNotification is still posted immediately then, since only cached objects observe it, and they
+//  must be invalidated before the block making the change returns.
+static inline BOOL notificationsWaitForDatabaseQueue(void)
+{
+    dispatch_semaphore_wait(g_notificationQueueLock, DISPATCH_TIME_FOREVER);
+    BOOL synchronous = g_notificationsDeliveredSynchronously;
+    dispatch_semaphore_signal(g_notificationQueueLock);
+
+    FCModelDatabaseQueue *databaseQueue = g_databaseQueue;
+    return synchronous && databaseQueue && NSOperationQueue.currentQueue == databaseQueue;
+}
+
+// Runs change notifications and the reloads that post them where setNotificationDeliveryQueue: says, immediately if already there.
+//  Synchronous delivery never runs on the database queue, e.g. for a save in an inDatabaseSync: block: an observer that waits on
+//  a thread that's waiting on the database queue would deadlock. Those are collected until the queue's current operation ends,
+//  then delivered in order on one serial queue.
+static inline void onNotificationQueue(void (^block)())
+{
+    dispatch_semaphore_wait(g_notificationQueueLock, DISPATCH_TIME_FOREVER);
+    dispatch_queue_t queue = g_notificationQueue;
+    BOOL synchronous = g_notificationsDeliveredSynchronously;
+    dispatch_semaphore_signal(g_notificationQueueLock);
+
+    if (synchronous) {
+        FCModelDatabaseQueue *databaseQueue = g_databaseQueue;
+        if (databaseQueue && NSOperationQueue.currentQueue == databaseQueue) {
+            // The database queue runs one operation at a time, so this one runs once the current one (and any queued before it) is done
+            if (g_databaseQueueNotifications.count == 0) [databaseQueue addOperationWithBlock:^{
+                NSArray *blocks = [g_databaseQueueNotifications copy];
+                [g_databaseQueueNotifications removeAllObjects];
+                dispatch_async(g_databaseQueueNotificationQueue, ^{
+                    for (void (^notificationBlock)() in blocks) notificationBlock();
+                });
+            }];
+            [g_databaseQueueNotifications addObject:[block copy]];
+        } else {
+            block();
+        }
+    } else if (! queue || queue == dispatch_get_main_queue()) {
+        if ([NSThread isMainThread]) block();
+        else dispatch_async(dispatch_get_main_queue(), block);
+    } else {
+        if (dispatch_get_specific(FCModelNotificationQueueKey) == (__bridge void *) queue) block();
+        else dispatch_async(queue, block);
+    }
+}
+
+// Adds a notification to a batch: class -> name -> instances, with NSNull standing in for class-wide changes
+static void enqueueBatchedNotification(NSMutableDictionary *notifications, NSMutableDictionary *changedFieldsByClass, NSMutableArray *changes, Class modelClass, NSString *name, NSSet *changedFields, FCModel *instance, FCModelChange *change)
 {
-    if ([NSThread isMainThread]) block();
-    else dispatch_async(dispatch_get_main_queue(), block);
+    if (change) [changes addObject:change];
+
+    id class = (id) modelClass;
+    NSMutableDictionary *notificationsForClass = notifications[class];
+    if (! notificationsForClass) {
+        notificationsForClass = [NSMutableDictionary dictionary];
+        notifications[class] = notificationsForClass;
+    }
+
+    NSMutableSet *changedFieldsForClass = changedFieldsByClass[class];
+    if (! changedFieldsForClass) {
+        changedFieldsForClass = [NSMutableSet set];
+        changedFieldsByClass[class] = changedFieldsForClass;
+    }
+    [changedFieldsForClass unionSet:changedFields];
+
+    NSMutableSet *instancesForNotification = notificationsForClass[name];
+    if (! instancesForNotification) instancesForNotification = notificationsForClass[name] = [NSMutableSet set];
+    [instancesForNotification addObject:(instance ?: NSNull.null)];
 }
 
 static inline BOOL checkForOpenDatabaseFatal(BOOL fatal)
 {
-    if (! g_databaseQueue) {
-        if (fatal) NSCAssert(0, @"[FCModel] Database is closed");
-        else NSLog(@"[FCModel] Warning: Attempting to access database while closed. Open it first.");
-        return NO;
+    if (! g_databaseQueue) {
+        if (fatal) NSCAssert(0, @"[FCModel] Database is closed");
+        else NSLog(@"[FCModel] Warning: Attempting to access database while closed. Open it first.");
+        return NO;
+    }
+    return YES;
+}
+
+@interface FCModelFieldInfo ()
+@property (nonatomic) BOOL nullAllowed;
+@property (nonatomic) FCModelFieldType type;
+@property (nonatomic) id defaultValue;
+@property (nonatomic) Class propertyClass;
+@property (nonatomic) NSString *propertyTypeEncoding;
+@property (nonatomic) NSUInteger fieldIndex;
+@end
+
+@implementation FCModelFieldInfo
+- (NSString *)description
+{
+    return [NSString stringWithFormat:@"<FCModelFieldInfo {%@ %@, default=%@}>",
+        (_type == FCModelFieldTypeText ? @"text" : (_type == FCModelFieldTypeInteger ? @"integer" : (_type == FCModelFieldTypeDouble ? @"double" : (_type == FCModelFieldTypeBool ? @"bool" : @"other")))),
+        _nullAllowed ? @"NULL" : @"NOT NULL",
+        _defaultValue ? _defaultValue : @"NULL"
+    ];
+}
+@end
+
+
+@interface FCModelChange ()
+- (instancetype)initWithModelClass:(Class)modelClass operation:(FCModelChangeOperation)operation primaryKey:(id)primaryKey changedFieldMask:(uint64_t)changedFieldMask;
+@end
+
+@implementation FCModelChange
+- (instancetype)initWithModelClass:(Class)modelClass operation:(FCModelChangeOperation)operation primaryKey:(id)primaryKey changedFieldMask:(uint64_t)changedFieldMask
+{
+    if ( (self = [super init]) ) {
+        _modelClass = modelClass;
+        _operation = operation;
+        _primaryKey = primaryKey;
+        _changedFieldMask = changedFieldMask;
+    }
+    return self;
+}
+
+- (NSString *)description
+{
+    return [NSString stringWithFormat:@"<FCModelChange %@#%@ %@ 0x%llx>", NSStringFromClass(_modelClass), _primaryKey,
+        (_operation == FCModelChangeInsert ? @"insert" : (_operation == FCModelChangeUpdate ? @"update" : (_operation == FCModelChangeDelete ? @"delete" : @"unidentified"))),
+        _changedFieldMask
+    ];
+}
+@end
+
+static uint64_t changeMaskForFieldNames(Class modelClass, id <NSFastEnumeration> fieldNames)
+{
+    NSDictionary *fieldInfo = g_fieldInfo[modelClass];
+    uint64_t mask = 0;
+    for (NSString *fieldName in fieldNames) {
+        FCModelFieldInfo *info = fieldInfo[fieldName];
+        if (! info) continue;
+        if (info.fieldIndex >= 64) return UINT64_MAX;
+        mask |= (1ULL << info.fieldIndex);
+    }
+    return mask;
+}
+
+
+// One subscribeToChangesWithPrimaryKey:fieldNames:block: call. Its field names are turned into a mask at delivery, since field
+//  indexes are assigned when the database opens.
+@interface FCModelChangeSubscription : NSObject
+@property (nonatomic) Class modelClass;
+@property (nonatomic) id primaryKey;
+@property (nonatomic) NSArray *fieldNames;
+@property (nonatomic, copy) void (^block)(NSArray *changes);
+@end
+
+@implementation FCModelChangeSubscription
+@end
+
+// A class's subscriptions, indexed so a change to one row only looks at that row's subscriptions
+@interface FCModelChangeSubscriptionList : NSObject
+@property (nonatomic) NSMutableArray *subscriptionsForAllRows;
+@property (nonatomic) NSMutableDictionary *subscriptionsByPrimaryKey; // primary key -> NSMutableArray
+@end
+
+@implementation FCModelChangeSubscriptionList
+- (instancetype)init
+{
+    if ( (self = [super init]) ) {
+        self.subscriptionsForAllRows = [NSMutableArray array];
+        self.subscriptionsByPrimaryKey = [NSMutableDictionary dictionary];
+    }
+    return self;
+}
+
+- (void)addSubscriptionsForChange:(FCModelChange *)change toList:(NSMutableArray *)matches changesBySubscription:(NSMapTable *)changesBySubscription
+{
+    void (^match)(FCModelChangeSubscription *) = ^(FCModelChangeSubscription *subscription) {
+        if (subscription.fieldNames && ! (changeMaskForFieldNames(change.modelClass, subscription.fieldNames) & change.changedFieldMask)) return;
+        NSMutableArray *changes = [changesBySubscription objectForKey:subscription];
+        if (! changes) {
+            changes = [NSMutableArray array];
+            [changesBySubscription setObject:changes forKey:subscription];
+            [matches addObject:subscription];
+        }
+        [changes addObject:change];
+    };
+
+    for (FCModelChangeSubscription *subscription in self.subscriptionsForAllRows) match(subscription);
+    if (change.primaryKey) {
+        for (FCModelChangeSubscription *subscription in self.subscriptionsByPrimaryKey[change.primaryKey]) match(subscription);
+    } else {
+        for (NSArray *subscriptions in self.subscriptionsByPrimaryKey.objectEnumerator) {
+            for (FCModelChangeSubscription *subscription in subscriptions) match(subscription);
+        }
+    }
+}
+@end
+
+
+// One per open performTransaction: level, kept in a stack in the database-queue thread's threadDictionary
+@interface FCModelTransactionFrame : NSObject
+@property (nonatomic) NSMapTable *instanceSnapshots;  // instance -> state before its first write in this frame
+@property (nonatomic) NSMutableArray *deferredActions; // blocks taking the thread to run them for, replayed on commit
+@end
+
+@implementation FCModelTransactionFrame
+- (instancetype)init
+{
+    if ( (self = [super init]) ) {
+        self.instanceSnapshots = [NSMapTable strongToStrongObjectsMapTable];
+        self.deferredActions = [NSMutableArray array];
+    }
+    return self;
+}
+@end
+
+static inline FCModelTransactionFrame *currentTransactionFrame(NSThread *thread)
+{
+    return [thread.threadDictionary[FCModelTransactionStackKey] lastObject];
+}
+
+
+// One per interposed setter. Setters stay interposed after the database closes, so each call looks up its field's current bit here.
+@interface FCModelSetterTracker : NSObject {
+    @public
+    NSInteger fieldIndex; // -1 while the field isn't in the open database
+}
+@end
+
+@implementation FCModelSetterTracker
+@end
+
+
+// The stored plist bytes of a lazily decoded field. Kept while the property still holds what they decode to, so change checks
+//  and re-encoding can use the bytes instead of a decode/re-encode round trip. Until first access, the property's ivar is nil.
+@interface FCModelSerializedFieldValue : NSObject {
+    @public
+    NSData *data;
+    id decodedValue;
+    BOOL decoded;
+}
+@end
+
+@implementation FCModelSerializedFieldValue
+@end
+
+
+@interface FCModel () {
+    BOOL existsInDatabase;
+    BOOL deleted;
+    uint64_t dirtyFieldMask;           // fieldIndex bits of fields set since the last save, for classes that track setters
+    NSUInteger setterTrackingSuppressed; // nonzero while FCModel itself is assigning database values
+    NSMutableDictionary *serializedFieldValues; // field name -> FCModelSerializedFieldValue, for lazily decoded fields
+    pthread_mutex_t serializedFieldValuesLock;  // for serializedFieldValues and lazy decoding into ivars, since resident instances are shared across threads
+}
+@property (nonatomic, copy) NSDictionary *_rowValuesInDatabase;
+@property (nonatomic, copy) NSError *_lastSQLiteError;
+- (void)decodeFieldValue:(id)value intoPropertyName:(NSString *)propertyName;
+@end
+
+
+// Maps one result set's columns to a model's fields. Built once per result set, since the columns depend on the query.
+@interface FCModelRowColumnMap : NSObject {
+    @public
+    int columnCount;
+    int primaryKeyColumn;           // -1 if the query didn't select the primary key
+    NSInteger *fieldIndexForColumn; // -1 for columns that aren't fields
+}
+@property (nonatomic) NSArray *missingFieldNames; // fields with default values that the query didn't select
+@end
+
+@implementation FCModelRowColumnMap
+- (void)dealloc { free(fieldIndexForColumn); }
+@end
+
+
+typedef struct {
+    SEL setter;
+    IMP setterIMP; // NULL if the field always goes through decodeFieldValue:intoPropertyName:
+    char valueType;
+    __unsafe_unretained Class propertyClass;
+} FCModelFieldSetter;
+
+// Compiled once per class at open. Sets each field straight from sqlite3_column_* through the property's setter, skipping
+//  FMResultSet.resultDictionary and KVC. Values that need converting (NULL primitives, NSDate, NSURL, plists, subclasses that
+//  override either unserializedRepresentationOfDatabaseValue:) still go through decodeFieldValue:intoPropertyName:.
+@interface FCModelRowDecoder : NSObject {
+    NSArray *fieldNamesByIndex;
+    NSString *primaryKeyFieldName;
+    NSDictionary *fieldInfo;
+    FCModelFieldSetter *setters;
+}
+- (instancetype)initWithModelClass:(Class)modelClass;
+- (FCModelRowColumnMap *)columnMapForStatement:(sqlite3_stmt *)statement;
+- (id)primaryKeyValueFromStatement:(sqlite3_stmt *)statement columnMap:(FCModelRowColumnMap *)columnMap;
+- (NSDictionary *)decodeRowFromStatement:(sqlite3_stmt *)statement columnMap:(FCModelRowColumnMap *)columnMap intoInstance:(FCModel *)instance; // nil instance: values only
+@end
+
+// Same values FMResultSet's objectForColumnIndex: returns
+static inline id databaseValueForColumn(sqlite3_stmt *statement, int column)
+{
+    switch (sqlite3_column_type(statement, column)) {
+        case SQLITE_INTEGER: return @(sqlite3_column_int64(statement, column));
+        case SQLITE_FLOAT:   return @(sqlite3_column_double(statement, column));
+        case SQLITE_TEXT: {
+            const unsigned char *text = sqlite3_column_text(statement, column);
+            return [[NSString alloc] initWithBytes:text length:sqlite3_column_bytes(statement, column) encoding:NSUTF8StringEncoding] ?: NSNull.null;
+        }
+        case SQLITE_BLOB: {
+            const void *bytes = sqlite3_column_blob(statement, column);
+            return [NSData dataWithBytes:bytes length:sqlite3_column_bytes(statement, column)];
+        }
+        default: return NSNull.null;
+    }
+}
+
+
+static SEL setterForFieldName(Class class, NSString *fieldName);
+static char setterArgumentType(Class class, SEL setter);
+static BOOL classOverridesValueDecoding(Class class);
+
+
+#define FCModelIdentityMapShardCount 16
+
+@interface FCModelWeakInstance : NSObject
+@property (nonatomic, weak) FCModel *instance;
+@end
+
+@implementation FCModelWeakInstance
+@end
+
+// Per-class uniquing map of primary key -> weakly held loaded instance. Keys are spread over shards with their own locks,
+//  so lookups of different keys from different threads rarely wait on each other. For INTEGER primary keys, nonzero integer
+//  values are stored unboxed in a CFDictionary, keyed and hashed by the raw int64.
+@interface FCModelIdentityMap : NSObject {
+    pthread_mutex_t locks[FCModelIdentityMapShardCount];
+    NSMapTable *objectKeyedInstances[FCModelIdentityMapShardCount];
+    CFMutableDictionaryRef integerKeyedInstances[FCModelIdentityMapShardCount]; // int64 -> FCModelWeakInstance
+}
+@property (nonatomic, readonly) BOOL integerKeys;
+- (instancetype)initWithIntegerPrimaryKeys:(BOOL)integerKeys;
+- (FCModel *)instanceForPrimaryKey:(id)primaryKeyValue;
+- (FCModel *)instanceForInt64PrimaryKey:(int64_t)primaryKeyValue;
+- (FCModel *)addInstance:(FCModel *)instance forPrimaryKey:(id)primaryKeyValue; // returns whichever instance is in the map afterward
+- (void)removeInstanceForPrimaryKey:(id)primaryKeyValue;
+- (NSArray *)allInstances;
+- (void)removeAllInstances;
+@end
+
+// Every class with a table gets a map when the database opens, so a missing one means an instance of a class without a table
+//  (or a closed database) is being uniqued, and would otherwise silently never be.
+static inline FCModelIdentityMap *identityMapForClass(Class class)
+{
+    FCModelIdentityMap *identityMap = g_identityMaps[class];
+    NSCAssert(identityMap, @"[FCModel] %@ has no identity map: it has no table, or the database isn't open", class);
+    return identityMap;
+}
+
+static inline NSUInteger identityMapShard(uint64_t hash) { return (NSUInteger) ((hash * 0x9E3779B97F4A7C15ULL) >> 60); }
+
+@implementation FCModelIdentityMap
+
+- (instancetype)initWithIntegerPrimaryKeys:(BOOL)integerKeys
+{
+    if ( (self = [super init]) ) {
+        _integerKeys = integerKeys && sizeof(void *) >= sizeof(int64_t);
+        for (int shard = 0; shard < FCModelIdentityMapShardCount; shard++) {
+            pthread_mutex_init(&locks[shard], NULL);
+            objectKeyedInstances[shard] = [NSMapTable strongToWeakObjectsMapTable];
+            if (_integerKeys) integerKeyedInstances[shard] = CFDictionaryCreateMutable(NULL, 0, NULL, &kCFTypeDictionaryValueCallBacks);
+        }
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    for (int shard = 0; shard < FCModelIdentityMapShardCount; shard++) {
+        pthread_mutex_destroy(&locks[shard]);
+        if (integerKeyedInstances[shard]) CFRelease(integerKeyedInstances[shard]);
+    }
+}
+
+// Floating-point numbers with integral values, like @1.0, use the same key as the integer so they find the same instance.
+- (BOOL)integerKey:(int64_t *)outKey forPrimaryKey:(id)primaryKeyValue
+{
+    if (! _integerKeys || ! [primaryKeyValue isKindOfClass:NSNumber.class]) return NO;
+    if (CFNumberIsFloatType((__bridge CFNumberRef) primaryKeyValue)) {
+        double value = [primaryKeyValue doubleValue];
+        if (value != trunc(value) || value < -0x1p63 || value >= 0x1p63) return NO;
+        *outKey = (int64_t) value;
+    } else {
+        *outKey = [primaryKeyValue longLongValue];
+    }
+    return *outKey != 0; // CFDictionary can't tell a NULL key from a missing one, so 0 goes in the object table
+}
+
+// Must hold the shard's lock
+- (FCModel *)instanceForIntegerKey:(int64_t)key shard:(NSUInteger)shard
+{
+    FCModelWeakInstance *box = (__bridge FCModelWeakInstance *) CFDictionaryGetValue(integerKeyedInstances[shard], (const void *) (intptr_t) key);
+    FCModel *instance = box.instance;
+    if (box && ! instance) CFDictionaryRemoveValue(integerKeyedInstances[shard], (const void *) (intptr_t) key);
+    return instance;
+}
+
+- (FCModel *)instanceForInt64PrimaryKey:(int64_t)key
+{
+    if (! _integerKeys || key == 0) return [self instanceForPrimaryKey:@(key)];
+    NSUInteger shard = identityMapShard((uint64_t) key);
+    pthread_mutex_lock(&locks[shard]);
+    FCModel *instance = [self instanceForIntegerKey:key shard:shard];
+    pthread_mutex_unlock(&locks[shard]);
+    return instance;
+}
+
+- (FCModel *)instanceForPrimaryKey:(id)primaryKeyValue
+{
+    int64_t key;
+    if ([self integerKey:&key forPrimaryKey:primaryKeyValue]) return [self instanceForInt64PrimaryKey:key];
+
+    NSUInteger shard = identityMapShard([primaryKeyValue hash]);
+    pthread_mutex_lock(&locks[shard]);
+    FCModel *instance = [objectKeyedInstances[shard] objectForKey:primaryKeyValue];
+    pthread_mutex_unlock(&locks[shard]);
+    return instance;
+}
+
+- (FCModel *)addInstance:(FCModel *)instance forPrimaryKey:(id)primaryKeyValue
+{
+    FCModel *existingInstance;
+    int64_t key;
+    if ([self integerKey:&key forPrimaryKey:primaryKeyValue]) {
+        NSUInteger shard = identityMapShard((uint64_t) key);
+        pthread_mutex_lock(&locks[shard]);
+        existingInstance = [self instanceForIntegerKey:key shard:shard];
+        if (! existingInstance) {
+            FCModelWeakInstance *box = [FCModelWeakInstance new];
+            box.instance = instance;
+            CFDictionarySetValue(integerKeyedInstances[shard], (const void *) (intptr_t) key, (__bridge const void *) box);
+        }
+        pthread_mutex_unlock(&locks[shard]);
+    } else {
+        NSUInteger shard = identityMapShard([primaryKeyValue hash]);
+        pthread_mutex_lock(&locks[shard]);
+        existingInstance = [objectKeyedInstances[shard] objectForKey:primaryKeyValue];
+        if (! existingInstance) [objectKeyedInstances[shard] setObject:instance forKey:primaryKeyValue];
+        pthread_mutex_unlock(&locks[shard]);
+    }
+    return existingInstance ?: instance;
+}
+
+- (void)removeInstanceForPrimaryKey:(id)primaryKeyValue
+{
+    int64_t key;
+    if ([self integerKey:&key forPrimaryKey:primaryKeyValue]) {
+        NSUInteger shard = identityMapShard((uint64_t) key);
+        pthread_mutex_lock(&locks[shard]);
+        CFDictionaryRemoveValue(integerKeyedInstances[shard], (const void *) (intptr_t) key);
+        pthread_mutex_unlock(&locks[shard]);
+    } else {
+        NSUInteger shard = identityMapShard([primaryKeyValue hash]);
+        pthread_mutex_lock(&locks[shard]);
+        [objectKeyedInstances[shard] removeObjectForKey:primaryKeyValue];
+        pthread_mutex_unlock(&locks[shard]);
+    }
+}
+
+- (NSArray *)allInstances
+{
+    NSMutableArray *instances = [NSMutableArray array];
+    for (int shard = 0; shard < FCModelIdentityMapShardCount; shard++) {
+        pthread_mutex_lock(&locks[shard]);
+        [instances addObjectsFromArray:objectKeyedInstances[shard].objectEnumerator.allObjects];
+        if (integerKeyedInstances[shard]) {
+            for (FCModelWeakInstance *box in ((__bridge NSDictionary *) integerKeyedInstances[shard]).objectEnumerator) {
+                FCModel *instance = box.instance;
+                if (instance) [instances addObject:instance];
+            }
+        }
+        pthread_mutex_unlock(&locks[shard]);
+    }
+    return instances;
+}
+
+- (void)removeAllInstances
+{
+    for (int shard = 0; shard < FCModelIdentityMapShardCount; shard++) {
+        pthread_mutex_lock(&locks[shard]);
+        [objectKeyedInstances[shard] removeAllObjects];
+        if (integerKeyedInstances[shard]) CFDictionaryRemoveAllValues(integerKeyedInstances[shard]);
+        pthread_mutex_unlock(&locks[shard]);
+    }
+}
+
+@end
+
+
+#define FCModelRowChangeLogMaximumRowsPerTable 10000
+
+@interface FCModelTableRowChanges : NSObject
+@property (nonatomic, readonly) NSMutableSet *rowIDs;
+@property (nonatomic) BOOL hasDeletes;
+@property (nonatomic) BOOL overflowed; // too many rows to list, so the whole table needs reloading
+@end
+
+@implementation FCModelTableRowChanges
+- (instancetype)init
+{
+    if ( (self = [super init]) ) _rowIDs = [NSMutableSet set];
+    return self;
+}
+@end
+
+// Rows written by inDatabaseSync: and executeUpdateQuery: blocks, as reported by SQLite's update hook on the read-write connection.
+//  Changes are held until their transaction has committed and dropped if it rolls back. SQLite's commit hook runs before a commit
+//  can still fail, so instead, whoever ends a write checks whether the connection is back in autocommit mode: anything still
+//  pending then was committed, since a rollback would have cleared it. Savepoints get their own level of pending changes, so
+//  performTransaction:'s ROLLBACK TO, which doesn't call the rollback hook, can drop just theirs.
+@interface FCModelRowChangeLog : NSObject {
+    @public
+    NSUInteger captureDepth;     // only touched on the read-write connection
+    NSUInteger capturedRowCount; // only touched on the read-write connection
+}
+- (void)recordOperation:(int)operation inTable:(const char *)tableName rowID:(sqlite3_int64)rowID;
+- (void)beginSavepoint;
+- (void)releaseSavepoint;
+- (void)rollbackToSavepoint;
+- (void)rollback;
+- (void)commitIfTransactionEndedInDatabase:(FMDatabase *)db;
+- (NSDictionary *)takeCommittedChanges; // table name -> FCModelTableRowChanges
+@end
+
+static void mergeTableRowChanges(NSMutableDictionary *changesByTable, NSDictionary *newChangesByTable)
+{
+    [newChangesByTable enumerateKeysAndObjectsUsingBlock:^(NSString *tableName, FCModelTableRowChanges *changes, BOOL *stop) {
+        FCModelTableRowChanges *existing = changesByTable[tableName];
+        if (! existing) {
+            changesByTable[tableName] = changes;
+            return;
+        }
+
+        existing.hasDeletes = existing.hasDeletes || changes.hasDeletes;
+        existing.overflowed = existing.overflowed || changes.overflowed || existing.rowIDs.count + changes.rowIDs.count > FCModelRowChangeLogMaximumRowsPerTable;
+        if (existing.overflowed) [existing.rowIDs removeAllObjects];
+        else [existing.rowIDs unionSet:changes.rowIDs];
+    }];
+}
+
+@implementation FCModelRowChangeLog {
+    NSMutableArray *pendingChangesBySavepoint; // the outer transaction's changes, then each open savepoint's
+    NSMutableDictionary *pendingChanges;       // the innermost level, which new changes go in
+    NSMutableDictionary *committedChanges;
+    dispatch_semaphore_t committedChangesLock;
+    NSString *lastTableName;
+    FCModelTableRowChanges *lastTableChanges;
+}
+
+- (instancetype)init
+{
+    if ( (self = [super init]) ) {
+        pendingChanges = [NSMutableDictionary dictionary];
+        pendingChangesBySavepoint = [NSMutableArray arrayWithObject:pendingChanges];
+        committedChanges = [NSMutableDictionary dictionary];
+        committedChangesLock = dispatch_semaphore_create(1);
+    }
+    return self;
+}
+
+- (void)recordOperation:(int)operation inTable:(const char *)tableName rowID:(sqlite3_int64)rowID
+{
+    capturedRowCount++;
+
+    // Bulk writes usually hit one table over and over, so skip making a string for every row
+    if (! lastTableChanges || strcmp(lastTableName.UTF8String, tableName) != 0) {
+        lastTableName = @(tableName);
+        lastTableChanges = pendingChanges[lastTableName];
+        if (! lastTableChanges) lastTableChanges = pendingChanges[lastTableName] = [FCModelTableRowChanges new];
+    }
+
+    FCModelTableRowChanges *changes = lastTableChanges;
+    if (operation == SQLITE_DELETE) changes.hasDeletes = YES;
+    if (changes.overflowed) return;
+    [changes.rowIDs addObject:@(rowID)];
+    if (changes.rowIDs.count > FCModelRowChangeLogMaximumRowsPerTable) {
+        changes.overflowed = YES;
+        [changes.rowIDs removeAllObjects];
+    }
+}
+
+- (void)setPendingLevel:(NSMutableDictionary *)changes
+{
+    pendingChanges = changes;
+    lastTableName = nil;
+    lastTableChanges = nil;
+}
+
+- (void)beginSavepoint
+{
+    [pendingChangesBySavepoint addObject:[NSMutableDictionary dictionary]];
+    [self setPendingLevel:pendingChangesBySavepoint.lastObject];
+}
+
+- (void)releaseSavepoint
+{
+    if (pendingChangesBySavepoint.count < 2) return; // the whole transaction already rolled back
+    NSDictionary *released = pendingChangesBySavepoint.lastObject;
+    [pendingChangesBySavepoint removeLastObject];
+    [self setPendingLevel:pendingChangesBySavepoint.lastObject];
+    mergeTableRowChanges(pendingChanges, released);
+}
+
+- (void)rollbackToSavepoint
+{
+    [pendingChanges removeAllObjects];
+    [self setPendingLevel:pendingChanges];
+}
+
+- (void)rollback
+{
+    [self setPendingLevel:[NSMutableDictionary dictionary]];
+    [pendingChangesBySavepoint setArray:@[ pendingChanges ]];
+}
+
+- (void)commitIfTransactionEndedInDatabase:(FMDatabase *)db
+{
+    if (! sqlite3_get_autocommit(db.sqliteHandle)) return;
+
+    for (NSDictionary *changes in pendingChangesBySavepoint) {
+        if (! changes.count) continue;
+        dispatch_semaphore_wait(committedChangesLock, DISPATCH_TIME_FOREVER);
+        mergeTableRowChanges(committedChanges, changes);
+        dispatch_semaphore_signal(committedChangesLock);
+    }
+    if (pendingChangesBySavepoint.count > 1 || pendingChanges.count) [self rollback];
+}
+
+- (NSDictionary *)takeCommittedChanges
+{
+    dispatch_semaphore_wait(committedChangesLock, DISPATCH_TIME_FOREVER);
+    NSDictionary *changes = committedChanges.count ? [committedChanges copy] : nil;
+    if (changes) [committedChanges removeAllObjects];
+    dispatch_semaphore_signal(committedChangesLock);
+    return changes;
+}
+
+@end
+
+static void rowChangeLogUpdateHook(void *context, int operation, const char *databaseName, const char *tableName, sqlite3_int64 rowID)
+{
+    FCModelRowChangeLog *log = (__bridge FCModelRowChangeLog *) context;
+    if (log->captureDepth) [log recordOperation:operation inTable:tableName rowID:rowID];
+}
+
+static void rowChangeLogRollbackHook(void *context)
+{
+    [(__bridge FCModelRowChangeLog *) context rollback];
+}
+
+@implementation FCModelRowDecoder
+
+- (instancetype)initWithModelClass:(Class)modelClass
+{
+    if ( (self = [super init]) ) {
+        fieldNamesByIndex = g_fieldNamesByIndex[modelClass];
+        primaryKeyFieldName = g_primaryKeyFieldName[modelClass];
+        fieldInfo = g_fieldInfo[modelClass];
+        NSCAssert(primaryKeyFieldName, @"%@ decoder created before its primary key is known", modelClass);
+        setters = calloc(MAX(fieldNamesByIndex.count, 1), sizeof(FCModelFieldSetter));
+
+        if (classOverridesValueDecoding(modelClass)) return self;
+
+        NSUInteger fieldIndex = 0;
+        for (NSString *fieldName in fieldNamesByIndex) {
+            FCModelFieldSetter *fieldSetter = &setters[fieldIndex++];
+            SEL setter = setterForFieldName(modelClass, fieldName);
+            char type = setterArgumentType(modelClass, setter);
+            Class propertyClass = ((FCModelFieldInfo *) fieldInfo[fieldName]).propertyClass;
+
+            // Object properties are only set directly if a database value can be assigned to them unconverted
+            if (type == '@' && ! (propertyClass == NSString.class || propertyClass == NSData.class || propertyClass == NSNumber.class || propertyClass == NSObject.class)) continue;
+            if (! type || ! strchr("@cCBsSiIlLqQfd", type)) continue;
+
+            fieldSetter->setter = setter;
+            fieldSetter->setterIMP = class_getMethodImplementation(modelClass, setter);
+            fieldSetter->valueType = type;
+            fieldSetter->propertyClass = propertyClass;
+        }
+    }
+    return self;
+}
+
+- (void)dealloc { free(setters); }
+
+- (FCModelRowColumnMap *)columnMapForStatement:(sqlite3_stmt *)statement
+{
+    FCModelRowColumnMap *columnMap = [FCModelRowColumnMap new];
+    columnMap->columnCount = sqlite3_column_count(statement);
+    columnMap->primaryKeyColumn = -1;
+    columnMap->fieldIndexForColumn = malloc(MAX(columnMap->columnCount, 1) * sizeof(NSInteger));
+
+    NSMutableDictionary *columnForFieldName = [NSMutableDictionary dictionary];
+    for (int column = 0; column < columnMap->columnCount; column++) {
+        columnMap->fieldIndexForColumn[column] = -1;
+        const char *columnName = sqlite3_column_name(statement, column);
+        NSString *fieldName = columnName ? [NSString stringWithUTF8String:columnName] : nil;
+        FCModelFieldInfo *info = fieldName ? fieldInfo[fieldName] : nil;
+        if (! info) continue;
+
+        // Like resultDictionary, the last column with a given name wins
+        NSNumber *previousColumn = columnForFieldName[fieldName];
+        if (previousColumn) columnMap->fieldIndexForColumn[previousColumn.intValue] = -1;
+        columnForFieldName[fieldName] = @(column);
+
+        columnMap->fieldIndexForColumn[column] = info.fieldIndex;
+        if ([fieldName isEqualToString:primaryKeyFieldName]) columnMap->primaryKeyColumn = column;
+    }
+
+    NSMutableArray *missingFieldNames = [NSMutableArray array];
+    [fieldInfo enumerateKeysAndObjectsUsingBlock:^(NSString *fieldName, FCModelFieldInfo *info, BOOL *stop) {
+        if (info.defaultValue && ! columnForFieldName[fieldName]) [missingFieldNames addObject:fieldName];
+    }];
+    columnMap.missingFieldNames = missingFieldNames;
+    return columnMap;
+}
+
+- (id)primaryKeyValueFromStatement:(sqlite3_stmt *)statement columnMap:(FCModelRowColumnMap *)columnMap
+{
+    return columnMap->primaryKeyColumn >= 0 ? databaseValueForColumn(statement, columnMap->primaryKeyColumn) : nil;
+}
+
+- (void)setFieldAtIndex:(NSInteger)fieldIndex value:(id)value column:(int)column statement:(sqlite3_stmt *)statement instance:(FCModel *)instance
+{
+    FCModelFieldSetter *fieldSetter = &setters[fieldIndex];
+    if (fieldSetter->setterIMP) {
+        int columnType = sqlite3_column_type(statement, column);
+        BOOL numeric = (columnType == SQLITE_INTEGER || columnType == SQLITE_FLOAT);
+        SEL setter = fieldSetter->setter;
+        IMP setterIMP = fieldSetter->setterIMP;
+
+        #define FCModelSetPrimitive(type, columnGetter) if (numeric) { ((void (*)(id, SEL, type)) setterIMP)(instance, setter, (type) columnGetter(statement, column)); return; } break
+        switch (fieldSetter->valueType) {
+            case '@':
+                if (value == NSNull.null) value = nil;
+                if (! value || [value isKindOfClass:fieldSetter->propertyClass]) { ((void (*)(id, SEL, id)) setterIMP)(instance, setter, value); return; }
+                break;
+            case 'c': FCModelSetPrimitive(char, sqlite3_column_int64);
+            case 'C': FCModelSetPrimitive(unsigned char, sqlite3_column_int64);
+            case 'B': FCModelSetPrimitive(bool, sqlite3_column_int64);
+            case 's': FCModelSetPrimitive(short, sqlite3_column_int64);
+            case 'S': FCModelSetPrimitive(unsigned short, sqlite3_column_int64);
+            case 'i': FCModelSetPrimitive(int, sqlite3_column_int64);
+            case 'I': FCModelSetPrimitive(unsigned int, sqlite3_column_int64);
+            case 'l': FCModelSetPrimitive(long, sqlite3_column_int64);
+            case 'L': FCModelSetPrimitive(unsigned long, sqlite3_column_int64);
+            case 'q': FCModelSetPrimitive(long long, sqlite3_column_int64);
+            case 'Q': FCModelSetPrimitive(unsigned long long, sqlite3_column_int64);
+            case 'f': FCModelSetPrimitive(float, sqlite3_column_double);
+            case 'd': FCModelSetPrimitive(double, sqlite3_column_double);
+        }
+        #undef FCModelSetPrimitive
+    }
+
+    [instance decodeFieldValue:value intoPropertyName:fieldNamesByIndex[fieldIndex]];
+}
+
+- (NSDictionary *)decodeRowFromStatement:(sqlite3_stmt *)statement columnMap:(FCModelRowColumnMap *)columnMap intoInstance:(FCModel *)instance
+{
+    int columnCount = columnMap->columnCount;
+    CFTypeRef *keys = malloc(MAX(columnCount, 1) * sizeof(CFTypeRef));
+    CFTypeRef *values = malloc(MAX(columnCount, 1) * sizeof(CFTypeRef));
+    CFIndex count = 0;
+
+    for (int column = 0; column < columnCount; column++) {
+        NSInteger fieldIndex = columnMap->fieldIndexForColumn[column];
+        if (fieldIndex < 0) continue;
+
+        id value = databaseValueForColumn(statement, column);
+        if (instance) [self setFieldAtIndex:fieldIndex value:value column:column statement:statement instance:instance];
+        keys[count] = (__bridge CFTypeRef) fieldNamesByIndex[fieldIndex];
+        values[count] = CFBridgingRetain(value);
+        count++;
+    }
+
+    if (instance) for (NSString *fieldName in columnMap.missingFieldNames) {
+        [instance decodeFieldValue:((FCModelFieldInfo *) fieldInfo[fieldName]).defaultValue intoPropertyName:fieldName];
+    }
+
+    NSDictionary *rowValues = CFBridgingRelease(CFDictionaryCreate(NULL, keys, values, count, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks));
+    for (CFIndex i = 0; i < count; i++) CFRelease(values[i]);
+    free(keys);
+    free(values);
+    return rowValues;
+}
+
+@end
+
+
+@interface FCModelRowView ()
+@property (nonatomic) Class modelClass;
+@property (nonatomic) id primaryKey;
+@property (nonatomic) NSArray *fieldNames;
+@property (nonatomic) NSDictionary *rowValues; // field name -> database value
+@property (nonatomic) NSMutableDictionary *decodedValues;
+@end
+
+@implementation FCModelRowView
+
+- (id)objectForKeyedSubscript:(NSString *)fieldName
+{
+    id value = self.decodedValues[fieldName];
+    if (! value) {
+        id databaseValue = self.rowValues[fieldName];
+        if (! databaseValue) return nil;
+
+        value = (databaseValue == NSNull.null ? nil : [self.modelClass unserializedRepresentationOfDatabaseValue:databaseValue forPropertyNamed:fieldName]) ?: NSNull.null;
+        if (! self.decodedValues) self.decodedValues = [NSMutableDictionary dictionary];
+        self.decodedValues[fieldName] = value;
     }
-    return YES;
+    return value == NSNull.null ? nil : value;
 }
 
-@interface FCModelFieldInfo ()
-@property (nonatomic) BOOL nullAllowed;
-@property (nonatomic) FCModelFieldType type;
-@property (nonatomic) id defaultValue;
-@property (nonatomic) Class propertyClass;
-@property (nonatomic) NSString *propertyTypeEncoding;
-@end
+- (id)valueForKey:(NSString *)key { return self.rowValues[key] ? self[key] : [super valueForKey:key]; }
+
+- (id)instance { return [self.modelClass instanceWithPrimaryKey:self.primaryKey createIfNonexistent:NO]; }
 
-@implementation FCModelFieldInfo
 - (NSString *)description
 {
-    return [NSString stringWithFormat:@"<FCModelFieldInfo {%@ %@, default=%@}>",
-        (_type == FCModelFieldTypeText ? @"text" : (_type == FCModelFieldTypeInteger ? @"integer" : (_type == FCModelFieldTypeDouble ? @"double" : (_type == FCModelFieldTypeBool ? @"bool" : @"other")))),
-        _nullAllowed ? @"NULL" : @"NOT NULL",
-        _defaultValue ? _defaultValue : @"NULL"
-    ];
+    return [NSString stringWithFormat:@"<FCModelRowView %@#%@: %@>", NSStringFromClass(self.modelClass), self.primaryKey, self.rowValues];
 }
-@end
 
-
-@interface FCModel () {
-    BOOL existsInDatabase;
-    BOOL deleted;
-}
-@property (nonatomic, copy) NSDictionary *_rowValuesInDatabase;
-@property (nonatomic, copy) NSError *_lastSQLiteError;
 @end
 
 
@@ -107,6 +948,7 @@ static inline BOOL checkForOpenDatabaseFatal(BOOL fatal)
 - (void)saveWasRefused { }
 - (void)saveDidFail { }
 + (NSSet *)ignoredFieldNames { return [NSSet set]; }
++ (BOOL)tracksChangesWithSetters { return NO; }
 
 #pragma mark - Instance tracking and uniquing
 
@@ -114,35 +956,32 @@ static inline BOOL checkForOpenDatabaseFatal(BOOL fatal)
 {
     static dispatch_once_t token;
     dispatch_once(&token, ^{
-        g_instancesReadLock = dispatch_semaphore_create(1);
-        g_instances = [NSMutableDictionary dictionary];
+        g_setterTrackers = [NSMutableDictionary dictionary];
+        g_lazyFieldAccessors = [NSMutableDictionary dictionary];
+        g_notificationQueueLock = dispatch_semaphore_create(1);
+        g_databaseQueueNotificationQueue = dispatch_queue_create("FCModelDatabaseQueueNotifications", DISPATCH_QUEUE_SERIAL);
+        g_databaseQueueNotifications = [NSMutableArray array];
+        g_coalescingLock = dispatch_semaphore_create(1);
+        g_changeSubscriptionsLock = dispatch_semaphore_create(1);
     });
 }
 
 + (NSArray *)allLoadedInstances
 {
-    dispatch_semaphore_wait(g_instancesReadLock, DISPATCH_TIME_FOREVER);
-    
-    NSArray *instances;
     if (self.class == FCModel.class) {
-        NSMutableArray *mutableInstances = [NSMutableArray array];
-        [g_instances enumerateKeysAndObjectsUsingBlock:^(Class subclass, NSArray *subclassInstances, BOOL *stop) {
-            [mutableInstances addObjectsFromArray:subclassInstances];
-        }];
-        instances = [mutableInstances copy];
+        NSMutableArray *instances = [NSMutableArray array];
+        for (FCModelIdentityMap *identityMap in g_identityMaps.objectEnumerator) [instances addObjectsFromArray:identityMap.allInstances];
+        return [instances copy];
     } else {
-        NSMapTable *classCache = g_instances[self];
-        instances = classCache ? [classCache.objectEnumerator.allObjects copy] : [NSArray array];
+        return [[g_identityMaps[self] allInstances] copy] ?: [NSArray array];
     }
-    
-    dispatch_semaphore_signal(g_instancesReadLock);
-    return instances;
 }
 
-+ (instancetype)instanceWithPrimaryKey:(id)primaryKeyValue { return [self instanceWithPrimaryKey:primaryKeyValue databaseRowValues:nil createIfNonexistent:YES]; }
-+ (instancetype)instanceWithPrimaryKey:(id)primaryKeyValue createIfNonexistent:(BOOL)create { return [self instanceWithPrimaryKey:primaryKeyValue databaseRowValues:nil createIfNonexistent:create]; }
++ (instancetype)instanceWithPrimaryKey:(id)primaryKeyValue { return [self instanceWithPrimaryKey:primaryKeyValue fromStatement:NULL columnMap:nil createIfNonexistent:YES]; }
++ (instancetype)instanceWithPrimaryKey:(id)primaryKeyValue createIfNonexistent:(BOOL)create { return [self instanceWithPrimaryKey:primaryKeyValue fromStatement:NULL columnMap:nil createIfNonexistent:create]; }
 
-+ (instancetype)instanceWithPrimaryKey:(id)primaryKeyValue databaseRowValues:(NSDictionary *)fieldValues createIfNonexistent:(BOOL)create
+// If statement is given, it's positioned on this primary key's row, which is decoded if the instance isn't already loaded.
++ (instancetype)instanceWithPrimaryKey:(id)primaryKeyValue fromStatement:(sqlite3_stmt *)statement columnMap:(FCModelRowColumnMap *)columnMap createIfNonexistent:(BOOL)create
 {
     if (! checkForOpenDatabaseFatal(NO)) return nil;
 
@@ -152,31 +991,21 @@ static inline BOOL checkForOpenDatabaseFatal(BOOL fatal)
     
     primaryKeyValue = [self normalizedPrimaryKeyValue:primaryKeyValue];
     
-    FCModel *instance = NULL;
-    dispatch_semaphore_wait(g_instancesReadLock, DISPATCH_TIME_FOREVER);
-    NSMapTable *classCache = g_instances[self];
-    if (! classCache) classCache = g_instances[(id) self] = [NSMapTable strongToWeakObjectsMapTable];
-    instance = [classCache objectForKey:primaryKeyValue];
-    dispatch_semaphore_signal(g_instancesReadLock);
-    
+    FCModelIdentityMap *identityMap = identityMapForClass(self);
+    FCModel *instance = [identityMap instanceForPrimaryKey:primaryKeyValue];
+
+    // Already loaded instances aren't decoded again, even if they've missed an external change: its reload updates them and
+    //  posts their notifications
     if (! instance) {
         // Not in memory yet. Check DB.
-        instance = fieldValues ? [[self alloc] initWithFieldValues:fieldValues existsInDatabaseAlready:YES] : [self instanceFromDatabaseWithPrimaryKey:primaryKeyValue];
+        instance = statement ? [[self alloc] initWithStatement:statement columnMap:columnMap] : [self instanceFromDatabaseWithPrimaryKey:primaryKeyValue];
         if (! instance && create) {
             // Create new with this key.
             instance = [[self alloc] initWithFieldValues:@{ g_primaryKeyFieldName[self] : primaryKeyValue } existsInDatabaseAlready:NO];
         }
         
-        if (instance) {
-            dispatch_semaphore_wait(g_instancesReadLock, DISPATCH_TIME_FOREVER);
-            FCModel *racedInstance = [classCache objectForKey:primaryKeyValue];
-            if (racedInstance) {
-                instance = racedInstance;
-            } else {
-                [classCache setObject:instance forKey:primaryKeyValue];
-            }
-            dispatch_semaphore_signal(g_instancesReadLock);
-        }
+        // If another thread loaded it first, use that one
+        if (instance) instance = [identityMap addInstance:instance forPrimaryKey:primaryKeyValue];
     }
 
     return instance;
@@ -188,50 +1017,180 @@ static inline BOOL checkForOpenDatabaseFatal(BOOL fatal)
     [g_databaseQueue readDatabase:^(FMDatabase *db) {
         FMResultSet *s = [db executeQuery:[self expandQuery:@"SELECT * FROM \"$T\" WHERE \"$PK\"=?"], key];
         if (! s) [self queryFailedInDatabase:db];
-        if ([s next]) model = [[self alloc] initWithFieldValues:s.resultDictionary existsInDatabaseAlready:YES];
+        if ([s next]) {
+            sqlite3_stmt *statement = s.statement.statement;
+            model = [[self alloc] initWithStatement:statement columnMap:[g_rowDecoders[self] columnMapForStatement:statement]];
+        }
         [s close];
     }];
     
     return model;
 }
 
+// Reloads made on the database queue wait for it (see onNotificationQueue), but cached objects can't keep serving the old rows
+//  until then, so they're invalidated for every field right away.
++ (void)invalidateCachedObjectsBeforeWaitingReload
+{
+    if (! notificationsWaitForDatabaseQueue()) return;
+    NSArray *classesToNotify = (self == FCModel.class ? g_primaryKeyFieldName.allKeys : @[ self ]);
+    for (Class class in classesToNotify) {
+        [NSNotificationCenter.defaultCenter postNotificationName:FCModelWillSendAnyChangeNotification object:class userInfo:@{
+            FCModelInstanceSetKey : [NSSet setWithArray:class.allLoadedInstances],
+            FCModelChangedFieldsKey : [NSSet setWithArray:class.databaseFieldNames],
+            FCModelUnidentifiedRowsChangedKey : @YES
+        }];
+    }
+}
+
 + (void)dataWasUpdatedExternally
 {
     NSThread *sourceThread = NSThread.currentThread;
-    onMainThreadAsync(^{
+    [self invalidateCachedObjectsBeforeWaitingReload];
+    onNotificationQueue(^{
         NSArray *classesToNotify = (self == FCModel.class ? g_primaryKeyFieldName.allKeys : @[ self ]);
         for (Class class in classesToNotify) {
             [NSNotificationCenter.defaultCenter postNotificationName:FCModelWillReloadNotification object:class userInfo:nil];
-            [NSNotificationCenter.defaultCenter postNotificationName:FCModelReloadNotification object:class userInfo:nil];
-            
+            [class reloadInstances:class.allLoadedInstances sourceThread:sourceThread];
+
+            // Rows may also have been inserted or changed without loaded instances, so the class as a whole has changed
             NSSet *changedFields = [NSSet setWithArray:class.databaseFieldNames];
-            NSArray *loadedInstances = class.allLoadedInstances;
-            if (loadedInstances.count) {
-                for (FCModel *instance in loadedInstances) {
-                    [class postChangeNotification:FCModelWillSendAnyChangeNotification changedFields:changedFields instance:instance sourceThread:sourceThread];
-                    [class postChangeNotification:FCModelAnyChangeNotification changedFields:changedFields instance:instance sourceThread:sourceThread];
-                }
+            [class postChangeNotification:FCModelWillSendAnyChangeNotification changedFields:changedFields instance:nil sourceThread:sourceThread];
+            [class postChangeNotification:FCModelAnyChangeNotification changedFields:changedFields instance:nil sourceThread:sourceThread];
+        }
+    });
+}
+
+// Runs a block on the read-write connection with the update hook recording the rows it writes. Returns NO if it changed rows that
+//  SQLite didn't report to the hook (WITHOUT ROWID tables, or DELETE's truncate optimization), which need a full reload instead.
++ (BOOL)captureRowChangesInDatabase:(FMDatabase *)db block:(void (^)(void))block
+{
+    FCModelRowChangeLog *log = g_rowChangeLog;
+    if (! log) {
+        block();
+        return NO;
+    }
+
+    int totalChangesBefore = sqlite3_total_changes(db.sqliteHandle);
+    NSUInteger capturedRowCountBefore = log->capturedRowCount;
+    log->captureDepth++;
+    @try {
+        block();
+    } @finally {
+        log->captureDepth--;
+        [log commitIfTransactionEndedInDatabase:db];
+    }
+    return (NSUInteger) (sqlite3_total_changes(db.sqliteHandle) - totalChangesBefore) <= log->capturedRowCount - capturedRowCountBefore;
+}
+
+// Reloading mid-transaction would read changes that may still be rolled back, so captured changes wait for the commit.
++ (void)reloadCapturedRowChanges:(BOOL)allChangesCaptured
+{
+    if (! allChangesCaptured) [self dataWasUpdatedExternallyAfterTransaction];
+
+    FCModelTransactionFrame *frame = currentTransactionFrame(NSThread.currentThread);
+    if (frame) {
+        [frame.deferredActions addObject:^(NSThread *thread) { [FCModel reloadCommittedRowChanges]; }];
+    } else {
+        [FCModel reloadCommittedRowChanges];
+    }
+}
+
++ (void)reloadCommittedRowChanges
+{
+    NSDictionary *changesByTable = [g_rowChangeLog takeCommittedChanges];
+    NSThread *sourceThread = NSThread.currentThread;
+    [changesByTable enumerateKeysAndObjectsUsingBlock:^(NSString *tableName, FCModelTableRowChanges *changes, BOOL *stop) {
+        Class class = NSClassFromString(tableName);
+        if (! class || ! g_primaryKeyFieldName[class]) return;
+
+        NSArray *primaryKeyValues = [class primaryKeyValuesForRowChanges:changes];
+        if (! primaryKeyValues) {
+            [class dataWasUpdatedExternally];
+            return;
+        }
+
+        FCModelIdentityMap *identityMap = g_identityMaps[class];
+        NSMutableArray *loadedInstances = [NSMutableArray array];
+        BOOL changedRowsNotLoaded = NO;
+        for (id primaryKeyValue in primaryKeyValues) {
+            FCModel *instance = [identityMap instanceForPrimaryKey:primaryKeyValue];
+            if (instance && instance->existsInDatabase) {
+                [loadedInstances addObject:instance];
             } else {
-                [class postChangeNotification:FCModelWillSendAnyChangeNotification changedFields:changedFields instance:nil sourceThread:sourceThread];
-                [class postChangeNotification:FCModelAnyChangeNotification changedFields:changedFields instance:nil sourceThread:sourceThread];
+                changedRowsNotLoaded = YES;
             }
         }
-    });
+
+        [class invalidateCachedObjectsBeforeWaitingReload];
+        onNotificationQueue(^{
+            [class reloadInstances:loadedInstances sourceThread:sourceThread];
+
+            // Rows without loaded instances may still be in cached results or queries, and nothing says which fields changed
+            if (changedRowsNotLoaded) {
+                NSSet *allFields = [NSSet setWithArray:class.databaseFieldNames];
+                [class postChangeNotification:FCModelWillSendAnyChangeNotification changedFields:allFields instance:nil sourceThread:sourceThread];
+                [class postChangeNotification:FCModelAnyChangeNotification changedFields:allFields instance:nil sourceThread:sourceThread];
+            }
+        });
+    }];
+}
+
+// Returns nil if the changed rows can't all be identified, i.e. deleted rows in tables whose primary key isn't the rowid.
++ (NSArray *)primaryKeyValuesForRowChanges:(FCModelTableRowChanges *)changes
+{
+    if (changes.overflowed) return nil;
+    if ([g_tablesWithRowIDPrimaryKeys containsObject:NSStringFromClass(self)]) return changes.rowIDs.allObjects;
+    if (changes.hasDeletes) return nil;
+
+    NSArray *rowIDs = changes.rowIDs.allObjects;
+    NSMutableArray *primaryKeyValues = [NSMutableArray arrayWithCapacity:rowIDs.count];
+    [g_databaseQueue readDatabase:^(FMDatabase *db) {
+        NSUInteger maxParameterCount = (NSUInteger) sqlite3_limit(db.sqliteHandle, SQLITE_LIMIT_VARIABLE_NUMBER, -1);
+        for (NSUInteger start = 0; start < rowIDs.count; start += maxParameterCount) {
+            NSArray *chunk = [rowIDs subarrayWithRange:NSMakeRange(start, MIN(maxParameterCount, rowIDs.count - start))];
+            NSMutableString *query = [NSMutableString stringWithString:[self expandQuery:@"SELECT \"$PK\" FROM \"$T\" WHERE rowid IN (?"]];
+            for (NSUInteger i = 1; i < chunk.count; i++) [query appendString:@",?"];
+            [query appendString:@")"];
+
+            FMResultSet *s = [db executeQuery:query withArgumentsInArray:chunk];
+            if (! s) [self queryFailedInDatabase:db];
+            while ([s next]) [primaryKeyValues addObject:[s objectForColumnIndex:0]];
+            [s close];
+        }
+    }];
+    return primaryKeyValues;
 }
 
 #pragma mark - Mapping properties to database fields
 
++ (id <FCModelCodec>)codecForFieldName:(NSString *)fieldName { return FCModelPropertyListCodec.sharedCodec; }
+
+static inline id <FCModelCodec> codecForField(Class class, NSString *fieldName)
+{
+    return g_fieldCodecs[class][fieldName] ?: [class codecForFieldName:fieldName];
+}
+
+// Whether the class decodes any database values itself, so none can be set without calling it
+static BOOL classOverridesValueDecoding(Class class)
+{
+    SEL unserializeSelector = @selector(unserializedRepresentationOfDatabaseValue:forPropertyNamed:);
+    return
+        [class instanceMethodForSelector:unserializeSelector] != [FCModel instanceMethodForSelector:unserializeSelector] ||
+        [class methodForSelector:unserializeSelector] != [FCModel methodForSelector:unserializeSelector]
+    ;
+}
+
 - (id)serializedDatabaseRepresentationOfValue:(id)instanceValue forPropertyNamed:(NSString *)propertyName
 {
     if ([instanceValue isKindOfClass:NSArray.class] || [instanceValue isKindOfClass:NSDictionary.class]) {
         NSError *error = nil;
-        NSData *bplist = [NSPropertyListSerialization dataWithPropertyList:instanceValue format:NSPropertyListBinaryFormat_v1_0 options:NSPropertyListImmutable error:&error];
-        if (error) {
+        NSData *data = [codecForField(self.class, propertyName) dataFromValue:instanceValue error:&error];
+        if (! data) {
             [[NSException exceptionWithName:NSInvalidArgumentException reason:[NSString stringWithFormat:
-                @"Cannot serialize %@ to plist for %@.%@: %@", NSStringFromClass(((NSObject *)instanceValue).class), NSStringFromClass(self.class), propertyName, error.localizedDescription
+                @"Cannot serialize %@ for %@.%@: %@", NSStringFromClass(((NSObject *)instanceValue).class), NSStringFromClass(self.class), propertyName, error.localizedDescription
             ] userInfo:nil] raise];
         }
-        return bplist;
+        return data;
     } else if ([instanceValue isKindOfClass:NSURL.class]) {
         return [(NSURL *)instanceValue absoluteString];
     } else if ([instanceValue isKindOfClass:NSDate.class]) {
@@ -243,13 +1202,21 @@ static inline BOOL checkForOpenDatabaseFatal(BOOL fatal)
 
 - (id)encodedValueForFieldName:(NSString *)fieldName
 {
+    NSData *serializedData = [self serializedDataOfUnchangedFieldName:fieldName];
+    if (serializedData) return serializedData;
+
     id value = [self serializedDatabaseRepresentationOfValue:[self valueForKey:fieldName] forPropertyNamed:fieldName];
     return value ?: NSNull.null;
 }
 
 - (id)unserializedRepresentationOfDatabaseValue:(id)databaseValue forPropertyNamed:(NSString *)propertyName
 {
-    Class propertyClass = [g_fieldInfo[self.class][propertyName] propertyClass];
+    return [self.class unserializedRepresentationOfDatabaseValue:databaseValue forPropertyNamed:propertyName];
+}
+
++ (id)unserializedRepresentationOfDatabaseValue:(id)databaseValue forPropertyNamed:(NSString *)propertyName
+{
+    Class propertyClass = [g_fieldInfo[self][propertyName] propertyClass];
     
     if (propertyClass && databaseValue) {
         if (propertyClass == NSURL.class) {
@@ -258,11 +1225,11 @@ static inline BOOL checkForOpenDatabaseFatal(BOOL fatal)
             return [databaseValue isKindOfClass:NSDate.class] ? databaseValue : [NSDate dateWithTimeIntervalSince1970:[databaseValue doubleValue]];
         } else if (propertyClass == NSDictionary.class) {
             if ([databaseValue isKindOfClass:NSDictionary.class]) return databaseValue;
-            NSDictionary *dict = [NSPropertyListSerialization propertyListWithData:databaseValue options:kCFPropertyListImmutable format:NULL error:NULL];
+            NSDictionary *dict = [databaseValue isKindOfClass:NSData.class] ? [codecForField(self, propertyName) valueFromData:databaseValue] : nil;
             return dict && [dict isKindOfClass:NSDictionary.class] ? dict : @{};
         } else if (propertyClass == NSArray.class) {
             if ([databaseValue isKindOfClass:NSArray.class]) return databaseValue;
-            NSArray *array = [NSPropertyListSerialization propertyListWithData:databaseValue options:kCFPropertyListImmutable format:NULL error:NULL];
+            NSArray *array = [databaseValue isKindOfClass:NSData.class] ? [codecForField(self, propertyName) valueFromData:databaseValue] : nil;
             return array && [array isKindOfClass:NSArray.class] ? array : @[];
         } else if (propertyClass == NSDecimalNumber.class) {
             return [databaseValue isKindOfClass:NSDecimalNumber.class] ? databaseValue : [NSDecimalNumber decimalNumberWithDecimal:[databaseValue decimalValue]];
@@ -276,8 +1243,276 @@ static inline BOOL checkForOpenDatabaseFatal(BOOL fatal)
 {
     if (value == NSNull.null) value = nil;
     if (class_getProperty(self.class, propertyName.UTF8String)) {
-        [self setValue:[self unserializedRepresentationOfDatabaseValue:value forPropertyNamed:propertyName] forKeyPath:propertyName];
+        setterTrackingSuppressed++;
+        if ([value isKindOfClass:NSData.class] && [g_lazilyDecodedFieldNames[self.class] containsObject:propertyName]) {
+            [self setValue:nil forKey:propertyName];
+            [self setSerializedData:value decodedValue:nil forFieldName:propertyName];
+        } else {
+            [self setValue:[self unserializedRepresentationOfDatabaseValue:value forPropertyNamed:propertyName] forKeyPath:propertyName];
+        }
+        setterTrackingSuppressed--;
+    }
+}
+
+#pragma mark - Lazy plist decoding
+
+static SEL getterForFieldName(Class class, NSString *fieldName)
+{
+    objc_property_t property = class_getProperty(class, fieldName.UTF8String);
+    char *customGetterName = property ? property_copyAttributeValue(property, "G") : NULL;
+    if (customGetterName) {
+        SEL getter = sel_registerName(customGetterName);
+        free(customGetterName);
+        return getter;
+    }
+    return NSSelectorFromString(fieldName);
+}
+
+static BOOL getterReturnsObject(Class class, SEL getter)
+{
+    Method method = class_getInstanceMethod(class, getter);
+    char *returnType = method ? method_copyReturnType(method) : NULL;
+    BOOL returnsObject = returnType && returnType[strspn(returnType, "rnNoORV")] == '@';
+    free(returnType);
+    return returnsObject;
+}
+
+// The strong or copy ivar backing a field's property, or NULL if it's weak, assign, or has no ivar
+static Ivar strongIvarForFieldName(Class class, NSString *fieldName)
+{
+    objc_property_t property = class_getProperty(class, fieldName.UTF8String);
+    if (! property) return NULL;
+
+    char *ivarName = property_copyAttributeValue(property, "V");
+    char *retained = property_copyAttributeValue(property, "&");
+    char *copied = property_copyAttributeValue(property, "C");
+    Ivar ivar = ivarName && (retained || copied) ? class_getInstanceVariable(class, ivarName) : NULL;
+    free(ivarName);
+    free(retained);
+    free(copied);
+
+    const char *ivarType = ivar ? ivar_getTypeEncoding(ivar) : NULL;
+    return ivarType && ivarType[0] == '@' ? ivar : NULL;
+}
+
+// Wraps the accessors of NSArray and NSDictionary fields so their BLOBs are kept as NSData when read and only deserialized by the
+//  first getter call, which stores the decoded value straight into the property's ivar so KVO observers see no change. Until
+//  then the ivar is nil. Called at open for classes that don't override unserializedRepresentationOfDatabaseValue:. Returns
+//  the names of the fields that are decoded lazily.
++ (NSSet *)interposeAccessorsForLazilyDecodedFieldNames:(NSArray *)fieldNamesByIndex
+{
+    if (classOverridesValueDecoding(self)) return nil;
+
+    NSMutableSet *wrappedFieldNames = g_lazyFieldAccessors[(id) self];
+    if (! wrappedFieldNames) wrappedFieldNames = g_lazyFieldAccessors[(id) self] = [NSMutableSet set];
+
+    NSMutableSet *lazyFieldNames = [NSMutableSet set];
+    NSDictionary *fieldInfo = g_fieldInfo[self];
+    NSString *primaryKeyFieldName = g_primaryKeyFieldName[self];
+    for (NSString *fieldName in fieldNamesByIndex) {
+        Class propertyClass = ((FCModelFieldInfo *) fieldInfo[fieldName]).propertyClass;
+        if ((propertyClass != NSArray.class && propertyClass != NSDictionary.class) || [fieldName isEqualToString:primaryKeyFieldName]) continue;
+        if ([wrappedFieldNames containsObject:fieldName]) { [lazyFieldNames addObject:fieldName]; continue; }
+
+        SEL getter = getterForFieldName(self, fieldName);
+        SEL setter = setterForFieldName(self, fieldName);
+        Ivar ivar = strongIvarForFieldName(self, fieldName);
+        if (! ivar || ! getterReturnsObject(self, getter) || setterArgumentType(self, setter) != '@') continue;
+
+        Method getterMethod = class_getInstanceMethod(self, getter);
+        Method setterMethod = class_getInstanceMethod(self, setter);
+        IMP originalGetterIMP = method_getImplementation(getterMethod);
+        IMP originalSetterIMP = method_getImplementation(setterMethod);
+
+        IMP decodingGetterIMP = imp_implementationWithBlock(^id(FCModel *instance) {
+            [instance decodeSerializedFieldValueForFieldName:fieldName intoIvar:ivar];
+            return ((id (*)(id, SEL)) originalGetterIMP)(instance, getter);
+        });
+
+        // Setting anything but the decoded value discards the stored bytes, so a pending decode can't overwrite it
+        IMP discardingSetterIMP = imp_implementationWithBlock(^(FCModel *instance, id value) {
+            ((void (*)(id, SEL, id)) originalSetterIMP)(instance, setter, value);
+            pthread_mutex_lock(&instance->serializedFieldValuesLock);
+            FCModelSerializedFieldValue *serialized = instance->serializedFieldValues[fieldName];
+            if (serialized && (! serialized->decoded || serialized->decodedValue != value)) [instance->serializedFieldValues removeObjectForKey:fieldName];
+            pthread_mutex_unlock(&instance->serializedFieldValuesLock);
+        });
+
+        class_replaceMethod(self, getter, decodingGetterIMP, method_getTypeEncoding(getterMethod));
+        class_replaceMethod(self, setter, discardingSetterIMP, method_getTypeEncoding(setterMethod));
+        [wrappedFieldNames addObject:fieldName];
+        [lazyFieldNames addObject:fieldName];
+    }
+    return lazyFieldNames;
+}
+
+- (void)setSerializedData:(NSData *)data decodedValue:(id)decodedValue forFieldName:(NSString *)fieldName
+{
+    FCModelSerializedFieldValue *serialized = [FCModelSerializedFieldValue new];
+    serialized->data = data;
+    serialized->decodedValue = decodedValue;
+    serialized->decoded = !! decodedValue;
+    pthread_mutex_lock(&serializedFieldValuesLock);
+    if (! serializedFieldValues) serializedFieldValues = [NSMutableDictionary dictionary];
+    serializedFieldValues[fieldName] = serialized;
+    pthread_mutex_unlock(&serializedFieldValuesLock);
+}
+
+// Decoding runs unlocked, since subclasses' unserializedRepresentationOfDatabaseValue: may read other lazy fields.
+// Only the first decode to finish is stored, and only if a setter hasn't discarded the bytes meanwhile.
+- (void)decodeSerializedFieldValueForFieldName:(NSString *)fieldName intoIvar:(Ivar)ivar
+{
+    pthread_mutex_lock(&serializedFieldValuesLock);
+    FCModelSerializedFieldValue *serialized = serializedFieldValues[fieldName];
+    NSData *data = serialized && ! serialized->decoded ? serialized->data : nil;
+    pthread_mutex_unlock(&serializedFieldValuesLock);
+    if (! data) return;
+
+    id decodedValue = [self unserializedRepresentationOfDatabaseValue:data forPropertyNamed:fieldName];
+
+    pthread_mutex_lock(&serializedFieldValuesLock);
+    if (serializedFieldValues[fieldName] == serialized && ! serialized->decoded) {
+        serialized->decodedValue = decodedValue;
+        serialized->decoded = YES;
+
+        // Not through the setter or KVC: the field's value hasn't changed, only its representation
+        __strong id *ivarValue = (__strong id *) ((uint8_t *) (__bridge void *) self + ivar_getOffset(ivar));
+        *ivarValue = decodedValue;
+    }
+    pthread_mutex_unlock(&serializedFieldValuesLock);
+}
+
+// The stored bytes of a lazily decoded field, if its property still holds what they decode to (without decoding them), or nil
+- (NSData *)serializedDataOfUnchangedFieldName:(NSString *)fieldName
+{
+    pthread_mutex_lock(&serializedFieldValuesLock);
+    FCModelSerializedFieldValue *serialized = serializedFieldValues[fieldName];
+    if (! serialized) {
+        pthread_mutex_unlock(&serializedFieldValuesLock);
+        return nil;
+    }
+    BOOL decoded = serialized->decoded;
+    id decodedValue = serialized->decodedValue;
+    NSData *data = serialized->data;
+    pthread_mutex_unlock(&serializedFieldValuesLock);
+
+    return (! decoded || [self valueForKey:fieldName] == decodedValue) ? data : nil;
+}
+
+#pragma mark - Setter change tracking
+
+static inline BOOL classTracksSetters(Class class) { return [g_classesTrackingSetters containsObject:class]; }
+
+static SEL setterForFieldName(Class class, NSString *fieldName)
+{
+    objc_property_t property = class_getProperty(class, fieldName.UTF8String);
+    char *customSetterName = property ? property_copyAttributeValue(property, "S") : NULL;
+    if (customSetterName) {
+        SEL setter = sel_registerName(customSetterName);
+        free(customSetterName);
+        return setter;
+    }
+    return NSSelectorFromString([NSString stringWithFormat:@"set%@%@:", [fieldName substringToIndex:1].uppercaseString, [fieldName substringFromIndex:1]]);
+}
+
+// The setter's argument type code, ignoring qualifiers like const, or 0 if the class doesn't implement it
+static char setterArgumentType(Class class, SEL setter)
+{
+    Method method = class_getInstanceMethod(class, setter);
+    char *argumentType = method ? method_copyArgumentType(method, 2) : NULL;
+    char type = argumentType ? argumentType[strspn(argumentType, "rnNoORV")] : 0;
+    free(argumentType);
+    return type;
+}
+
+// Wraps each field's setter so calling it sets the field's bit in dirtyFieldMask. Called at open for classes returning YES from
+//  tracksChangesWithSetters. Returns NO, without interposing anything new, if any setter takes a type we can't forward.
++ (BOOL)interposeSettersForFieldNames:(NSArray *)fieldNamesByIndex
+{
+    if (fieldNamesByIndex.count > 64) {
+        NSLog(@"[FCModel] %@ has more than 64 fields, so it can't track changes with setters", NSStringFromClass(self));
+        return NO;
+    }
+
+    NSMutableDictionary *trackers = g_setterTrackers[(id) self];
+    if (! trackers) trackers = g_setterTrackers[(id) self] = [NSMutableDictionary dictionary];
+    for (FCModelSetterTracker *tracker in trackers.objectEnumerator) tracker->fieldIndex = -1;
+
+    NSMutableDictionary *settersToInterpose = [NSMutableDictionary dictionary];
+    for (NSString *fieldName in fieldNamesByIndex) {
+        if (trackers[fieldName]) continue;
+
+        SEL setter = setterForFieldName(self, fieldName);
+        char type = setterArgumentType(self, setter);
+        if (! type || ! strchr("@#cCBsSiIlLqQfd", type)) {
+            NSLog(@"[FCModel] %@.%@ has no setter that FCModel can wrap, so %@ can't track changes with setters", NSStringFromClass(self), fieldName, NSStringFromClass(self));
+            return NO;
+        }
+        settersToInterpose[fieldName] = @[ NSStringFromSelector(setter), [NSString stringWithFormat:@"%c", type] ];
+    }
+
+    Class modelClass = self;
+    [settersToInterpose enumerateKeysAndObjectsUsingBlock:^(NSString *fieldName, NSArray *setterInfo, BOOL *stop) {
+        SEL setter = NSSelectorFromString(setterInfo[0]);
+        Method method = class_getInstanceMethod(modelClass, setter);
+        IMP originalIMP = method_getImplementation(method);
+        FCModelSetterTracker *tracker = [FCModelSetterTracker new];
+
+        // Subclasses inherit the wrapper along with the setter, but their bits come from their own wrappers, so only mark exact-class instances
+        #define FCModelTrackingSetterIMP(type) imp_implementationWithBlock(^(FCModel *instance, type value) { \
+            ((void (*)(id, SEL, type)) originalIMP)(instance, setter, value); \
+            if (! instance->setterTrackingSuppressed && tracker->fieldIndex >= 0 && instance.class == modelClass) instance->dirtyFieldMask |= (1ULL << tracker->fieldIndex); \
+        })
+
+        IMP trackingIMP;
+        switch ([setterInfo[1] characterAtIndex:0]) {
+            case 'c': trackingIMP = FCModelTrackingSetterIMP(char); break;
+            case 'C': trackingIMP = FCModelTrackingSetterIMP(unsigned char); break;
+            case 'B': trackingIMP = FCModelTrackingSetterIMP(bool); break;
+            case 's': trackingIMP = FCModelTrackingSetterIMP(short); break;
+            case 'S': trackingIMP = FCModelTrackingSetterIMP(unsigned short); break;
+            case 'i': trackingIMP = FCModelTrackingSetterIMP(int); break;
+            case 'I': trackingIMP = FCModelTrackingSetterIMP(unsigned int); break;
+            case 'l': trackingIMP = FCModelTrackingSetterIMP(long); break;
+            case 'L': trackingIMP = FCModelTrackingSetterIMP(unsigned long); break;
+            case 'q': trackingIMP = FCModelTrackingSetterIMP(long long); break;
+            case 'Q': trackingIMP = FCModelTrackingSetterIMP(unsigned long long); break;
+            case 'f': trackingIMP = FCModelTrackingSetterIMP(float); break;
+            case 'd': trackingIMP = FCModelTrackingSetterIMP(double); break;
+            default:  trackingIMP = FCModelTrackingSetterIMP(id); break;
+        }
+        #undef FCModelTrackingSetterIMP
+
+        class_replaceMethod(modelClass, setter, trackingIMP, method_getTypeEncoding(method));
+        trackers[fieldName] = tracker;
+    }];
+
+    [fieldNamesByIndex enumerateObjectsUsingBlock:^(NSString *fieldName, NSUInteger idx, BOOL *stop) {
+        ((FCModelSetterTracker *) trackers[fieldName])->fieldIndex = idx;
+    }];
+    return YES;
+}
+
+- (uint64_t)fieldMaskForFieldNames:(id <NSFastEnumeration>)fieldNames
+{
+    uint64_t mask = 0;
+    NSDictionary *fieldInfo = g_fieldInfo[self.class];
+    for (NSString *fieldName in fieldNames) mask |= (1ULL << ((FCModelFieldInfo *) fieldInfo[fieldName]).fieldIndex);
+    return mask;
+}
+
+- (NSArray *)trackedChangedFieldNames
+{
+    NSArray *fieldNamesByIndex = g_fieldNamesByIndex[self.class];
+    uint64_t mask = dirtyFieldMask & ~(1ULL << ((FCModelFieldInfo *) g_fieldInfo[self.class][g_primaryKeyFieldName[self.class]]).fieldIndex);
+    NSMutableArray *fieldNames = [NSMutableArray array];
+    for (NSUInteger fieldIndex = 0; mask && fieldIndex < fieldNamesByIndex.count; fieldIndex++) {
+        if (mask & (1ULL << fieldIndex)) {
+            [fieldNames addObject:fieldNamesByIndex[fieldIndex]];
+            mask &= ~(1ULL << fieldIndex);
+        }
     }
+    return fieldNames;
 }
 
 + (NSArray *)databaseFieldNames     { return checkForOpenDatabaseFatal(NO) ? [g_fieldInfo[self] allKeys] : nil; }
@@ -316,7 +1551,57 @@ static inline BOOL checkForOpenDatabaseFatal(BOOL fatal)
 + (NSArray *)cachedInstancesWhere:(NSString *)queryAfterWHERE arguments:(NSArray *)arguments ignoreFieldsForInvalidation:(NSSet *)ignoredFields
 {
     if (! checkForOpenDatabaseFatal(NO)) return nil;
-    return [FCModelLiveResultArray arrayWithModelClass:self queryAfterWHERE:queryAfterWHERE arguments:arguments ignoreFieldsForInvalidation:nil].allObjects;
+    return [FCModelLiveResultArray arrayWithModelClass:self queryAfterWHERE:queryAfterWHERE arguments:arguments ignoreFieldsForInvalidation:ignoredFields].allObjects;
+}
+
+typedef struct {
+    const char *tableName;
+    __unsafe_unretained NSMutableSet *columnNames;
+} FCModelQueryColumnReads;
+
+static int queryColumnReadsAuthorizer(void *context, int action, const char *tableName, const char *columnName, const char *databaseName, const char *triggerName)
+{
+    FCModelQueryColumnReads *reads = (FCModelQueryColumnReads *) context;
+    if (action == SQLITE_READ && tableName && columnName && columnName[0] && sqlite3_stricmp(tableName, reads->tableName) == 0) {
+        [reads->columnNames addObject:@(columnName)];
+    }
+    return SQLITE_OK;
+}
+
+// Used by FCModelLiveResult: the fields that a cached query's WHERE clause and any ORDER BY, etc. read from this class's table,
+//  collected by an authorizer while the query is prepared. Returns nil if it can't be prepared. SQLite has one authorizer per
+//  connection and no way to read it back, so this uses the queue's analysis connection to leave any the app set in place.
++ (NSSet *)fieldNamesReadByQueryAfterWHERE:(NSString *)queryAfterWHERE
+{
+    if (! checkForOpenDatabaseFatal(NO)) return nil;
+    if (! queryAfterWHERE) return [NSSet set];
+
+    __block NSSet *fieldNames = nil;
+    NSString *tableName = NSStringFromClass(self);
+    NSString *query = [self expandQuery:[@"SELECT 1 FROM \"$T\" WHERE " stringByAppendingString:queryAfterWHERE]];
+    [g_databaseQueue inAnalysisDatabase:^(FMDatabase *db) {
+        NSMutableSet *columnNames = [NSMutableSet set];
+        FCModelQueryColumnReads reads = { tableName.UTF8String, columnNames };
+        sqlite3_stmt *statement = NULL;
+        sqlite3_set_authorizer(db.sqliteHandle, queryColumnReadsAuthorizer, &reads);
+        int result = sqlite3_prepare_v2(db.sqliteHandle, query.UTF8String, -1, &statement, NULL);
+        sqlite3_set_authorizer(db.sqliteHandle, NULL, NULL);
+        sqlite3_finalize(statement);
+        if (result == SQLITE_OK) fieldNames = [columnNames copy];
+    }];
+    return fieldNames;
+}
+
+// Used by FCModelLiveResult to size IN (...) lists, which share the limit with the query's own arguments
++ (NSUInteger)maximumQueryParameterCount
+{
+    if (! checkForOpenDatabaseFatal(NO)) return 0;
+
+    __block NSUInteger maxParameterCount = 0;
+    [g_databaseQueue readDatabase:^(FMDatabase *db) {
+        maxParameterCount = (NSUInteger) sqlite3_limit(db.sqliteHandle, SQLITE_LIMIT_VARIABLE_NUMBER, -1);
+    }];
+    return maxParameterCount;
 }
 
 + (id)cachedObjectWithIdentifier:(id)identifier generator:(id (^)(void))generatorBlock
@@ -340,13 +1625,16 @@ static inline BOOL checkForOpenDatabaseFatal(BOOL fatal)
 
     __block BOOL success = NO;
     __block NSError *error = nil;
+    __block BOOL allChangesCaptured = NO;
     [g_databaseQueue writeDatabase:^(FMDatabase *db) {
-        success = [db executeUpdate:[self expandQuery:query] error:nil withArgumentsInArray:nil orDictionary:nil orVAList:*foolTheStaticAnalyzer];
+        allChangesCaptured = [self captureRowChangesInDatabase:db block:^{
+            success = [db executeUpdate:[self expandQuery:query] error:nil withArgumentsInArray:nil orDictionary:nil orVAList:*foolTheStaticAnalyzer];
+        }];
         if (! success) error = [db.lastError copy];
     }];
 
     va_end(args);
-    if (success) [self dataWasUpdatedExternally];
+    if (success) [self reloadCapturedRowChanges:allChangesCaptured];
     return error;
 }
 
@@ -356,15 +1644,83 @@ static inline BOOL checkForOpenDatabaseFatal(BOOL fatal)
 
     __block BOOL success = NO;
     __block NSError *error = nil;
+    __block BOOL allChangesCaptured = NO;
     [g_databaseQueue writeDatabase:^(FMDatabase *db) {
-        success = [db executeUpdate:[self expandQuery:query] error:nil withArgumentsInArray:arguments orDictionary:nil orVAList:NULL];
+        allChangesCaptured = [self captureRowChangesInDatabase:db block:^{
+            success = [db executeUpdate:[self expandQuery:query] error:nil withArgumentsInArray:arguments orDictionary:nil orVAList:NULL];
+        }];
         if (! success) error = [db.lastError copy];
     }];
 
-    if (success) [self dataWasUpdatedExternally];
+    if (success) [self reloadCapturedRowChanges:allChangesCaptured];
     return error;
 }
 
+// Reloading mid-transaction would read changes that may still be rolled back, so wait for the commit.
++ (void)dataWasUpdatedExternallyAfterTransaction
+{
+    FCModelTransactionFrame *frame = currentTransactionFrame(NSThread.currentThread);
+    if (frame) {
+        [frame.deferredActions addObject:^(NSThread *thread) { [self dataWasUpdatedExternally]; }];
+    } else {
+        [self dataWasUpdatedExternally];
+    }
+}
+
+// Resolves a statement's current row to its loaded instance, loading it if needed
+static FCModel *instanceForStatementRow(Class class, sqlite3_stmt *statement, FCModelRowColumnMap *columnMap, FCModelRowDecoder *decoder, FCModelIdentityMap *identityMap)
+{
+    // Resident instances with INTEGER keys can be found without boxing the key
+    int primaryKeyColumn = columnMap ? columnMap->primaryKeyColumn : -1;
+    if (identityMap.integerKeys && primaryKeyColumn >= 0 && sqlite3_column_type(statement, primaryKeyColumn) == SQLITE_INTEGER) {
+        FCModel *resident = [identityMap instanceForInt64PrimaryKey:sqlite3_column_int64(statement, primaryKeyColumn)];
+        if (resident) return resident;
+    }
+
+    id primaryKeyValue = [decoder primaryKeyValueFromStatement:statement columnMap:columnMap];
+    return [class instanceWithPrimaryKey:primaryKeyValue fromStatement:statement columnMap:columnMap createIfNonexistent:NO];
+}
+
+// Steps a bound statement from the queue's statement cache through all of its rows, then resets it.
+//  Must be called inside a readDatabase: block.
++ (NSArray *)instancesFromCachedStatement:(sqlite3_stmt *)statement inDatabase:(FMDatabase *)db
+{
+    FCModelRowDecoder *decoder = g_rowDecoders[self];
+    FCModelIdentityMap *identityMap = g_identityMaps[self];
+    FCModelRowColumnMap *columnMap = nil;
+    NSMutableArray *instances = [NSMutableArray array];
+
+    // Resetting ends the statement's read transaction, which would otherwise hold back WAL checkpoints, so it has to happen
+    //  even if decoding a row raises
+    int stepResult;
+    @try {
+        while (SQLITE_ROW == (stepResult = sqlite3_step(statement))) {
+            if (! columnMap) columnMap = [decoder columnMapForStatement:statement];
+            [instances addObject:instanceForStatementRow(self, statement, columnMap, decoder, identityMap)];
+        }
+    } @finally {
+        sqlite3_reset(statement);
+        sqlite3_clear_bindings(statement);
+    }
+    if (stepResult != SQLITE_DONE) [self queryFailedInDatabase:db];
+    return instances;
+}
+
+// Runs an expanded SELECT through the statement cache of whichever connection readDatabase: uses
++ (NSArray *)instancesFromCachedStatementWithSQL:(NSString *)sql arguments:(NSArray *)arguments
+{
+    __block NSArray *instances = nil;
+    [g_databaseQueue readDatabase:^(FMDatabase *db) {
+        sqlite3_stmt *statement = [g_databaseQueue cachedStatementForKey:sql inDatabase:db sqlBuilder:^NSString *{ return sql; }];
+        if (! statement) [self queryFailedInDatabase:db];
+
+        int bindIndex = 1;
+        for (id argument in arguments) [db bindObject:argument toColumn:bindIndex++ inStatement:statement];
+        instances = [self instancesFromCachedStatement:statement inDatabase:db];
+    }];
+    return instances;
+}
+
 + (id)_instancesWhere:(NSString *)query andArgs:(va_list)args orArgsArray:(NSArray *)argsArray orResultSet:(FMResultSet *)existingResultSet onlyFirst:(BOOL)onlyFirst keyed:(BOOL)keyed
 {
     if (! checkForOpenDatabaseFatal(NO)) return nil;
@@ -378,9 +1734,13 @@ static inline BOOL checkForOpenDatabaseFatal(BOOL fatal)
         else instances = [NSMutableArray array];
     }
     
+    FCModelRowDecoder *decoder = g_rowDecoders[self];
+    FCModelIdentityMap *identityMap = g_identityMaps[self];
+    __block FCModelRowColumnMap *columnMap = nil;
     void (^processResult)(FMResultSet *, BOOL *) = ^(FMResultSet *s, BOOL *stop){
-        NSDictionary *rowDictionary = s.resultDictionary;
-        instance = [self instanceWithPrimaryKey:rowDictionary[g_primaryKeyFieldName[self]] databaseRowValues:rowDictionary createIfNonexistent:NO];
+        sqlite3_stmt *statement = s.statement.statement;
+        if (! columnMap) columnMap = [decoder columnMapForStatement:statement];
+        instance = instanceForStatementRow(self, statement, columnMap, decoder, identityMap);
         if (onlyFirst) {
             *stop = YES;
             return;
@@ -478,6 +1838,114 @@ static inline BOOL checkForOpenDatabaseFatal(BOOL fatal)
     return [self _instancesWhere:[@"1 ORDER BY " stringByAppendingString:queryAfterORDERBY] andArgs:NULL orArgsArray:args orResultSet:nil onlyFirst:NO keyed:NO];
 }
 
++ (void)enumerateInstancesWhere:(NSString *)queryAfterWHERE arguments:(NSArray *)arguments batchSize:(NSUInteger)batchSize usingBlock:(void (^)(id instance, BOOL *stop))block
+{
+    if (! checkForOpenDatabaseFatal(NO)) return;
+    if (batchSize == 0) batchSize = 1000;
+
+    // Each batch seeks past the last primary key seen, so later batches cost the same as the first
+    NSString *condition = queryAfterWHERE ? [NSString stringWithFormat:@"(%@)", queryAfterWHERE] : @"1";
+    NSString *firstBatchSQL = [self expandQuery:[NSString stringWithFormat:@"SELECT * FROM \"$T\" WHERE %@ ORDER BY \"$PK\" LIMIT ?", condition]];
+    NSString *nextBatchSQL = [self expandQuery:[NSString stringWithFormat:@"SELECT * FROM \"$T\" WHERE %@ AND \"$PK\" > ? ORDER BY \"$PK\" LIMIT ?", condition]];
+
+    id lastPrimaryKey = nil;
+    BOOL stop = NO;
+    while (! stop) {
+        @autoreleasepool {
+            NSMutableArray *batchArguments = arguments ? [arguments mutableCopy] : [NSMutableArray array];
+            if (lastPrimaryKey) [batchArguments addObject:lastPrimaryKey];
+            [batchArguments addObject:@(batchSize)];
+            NSArray *batch = [self instancesFromCachedStatementWithSQL:(lastPrimaryKey ? nextBatchSQL : firstBatchSQL) arguments:batchArguments];
+
+            for (FCModel *instance in batch) {
+                block(instance, &stop);
+                if (stop) break;
+            }
+            if (batch.count < batchSize) break;
+            lastPrimaryKey = [batch.lastObject primaryKey];
+        }
+    }
+}
+
++ (NSArray *)instancesWhere:(NSString *)queryAfterWHERE arguments:(NSArray *)arguments orderedBy:(NSString *)fieldNameAndDirection after:(FCModel *)lastInstance limit:(NSUInteger)limit
+{
+    if (! checkForOpenDatabaseFatal(NO)) return nil;
+
+    static NSRegularExpression *orderExpression;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        orderExpression = [NSRegularExpression regularExpressionWithPattern:@"^\\s*\"?(\\w+)\"?(?:\\s+(ASC|DESC))?\\s*$" options:NSRegularExpressionCaseInsensitive error:NULL];
+    });
+    NSTextCheckingResult *match = fieldNameAndDirection ? [orderExpression firstMatchInString:fieldNameAndDirection options:0 range:NSMakeRange(0, fieldNameAndDirection.length)] : nil;
+    NSString *fieldName = match ? [fieldNameAndDirection substringWithRange:[match rangeAtIndex:1]] : nil;
+    if (! fieldName || ! g_fieldInfo[self][fieldName]) {
+        [[NSException exceptionWithName:NSInvalidArgumentException reason:[NSString stringWithFormat:@"%@ can't be ordered by \"%@\"", NSStringFromClass(self), fieldNameAndDirection] userInfo:nil] raise];
+    }
+    BOOL descending = [match rangeAtIndex:2].location != NSNotFound && [[fieldNameAndDirection substringWithRange:[match rangeAtIndex:2]] caseInsensitiveCompare:@"DESC"] == NSOrderedSame;
+
+    // Seek past the last row by (sort value, primary key), so every page is an index range scan instead of an OFFSET.
+    //  NULLs sort first ascending and last descending.
+    id lastPrimaryKey = lastInstance.primaryKey;
+    id lastValue = lastPrimaryKey ? (lastInstance._rowValuesInDatabase[fieldName] ?: [lastInstance encodedValueForFieldName:fieldName]) : nil;
+    NSMutableArray *pageArguments = arguments ? [arguments mutableCopy] : [NSMutableArray array];
+    NSString *seekCondition = @"";
+    if (lastPrimaryKey && lastValue != NSNull.null) {
+        seekCondition = descending ?
+            @" AND (\"$F\" < ? OR (\"$F\" = ? AND \"$PK\" < ?) OR \"$F\" IS NULL)" :
+            @" AND (\"$F\" > ? OR (\"$F\" = ? AND \"$PK\" > ?))"
+        ;
+        [pageArguments addObjectsFromArray:@[ lastValue, lastValue, lastPrimaryKey ]];
+    } else if (lastPrimaryKey) {
+        seekCondition = descending ? @" AND \"$F\" IS NULL AND \"$PK\" < ?" : @" AND ((\"$F\" IS NULL AND \"$PK\" > ?) OR \"$F\" IS NOT NULL)";
+        [pageArguments addObject:lastPrimaryKey];
+    }
+    [pageArguments addObject:@(limit)];
+
+    NSString *direction = descending ? @" DESC" : @"";
+    NSString *sql = [NSString stringWithFormat:@"SELECT * FROM \"$T\" WHERE (%@)%@ ORDER BY \"%@\"%@, \"$PK\"%@ LIMIT ?",
+        (queryAfterWHERE ?: @"1"), [seekCondition stringByReplacingOccurrencesOfString:@"$F" withString:fieldName], fieldName, direction, direction
+    ];
+    return [self instancesFromCachedStatementWithSQL:[self expandQuery:sql] arguments:pageArguments];
+}
+
++ (NSArray *)rowViewsWithFieldNames:(NSArray *)fieldNames where:(NSString *)queryAfterWHERE arguments:(NSArray *)arguments
+{
+    if (! checkForOpenDatabaseFatal(NO)) return nil;
+
+    NSString *primaryKeyFieldName = g_primaryKeyFieldName[self];
+    NSMutableOrderedSet *columnNames = [NSMutableOrderedSet orderedSetWithObject:primaryKeyFieldName];
+    for (NSString *fieldName in fieldNames) {
+        if (! g_fieldInfo[self][fieldName]) {
+            [[NSException exceptionWithName:NSInvalidArgumentException reason:[NSString stringWithFormat:@"%@ has no field \"%@\"", NSStringFromClass(self), fieldName] userInfo:nil] raise];
+        }
+        [columnNames addObject:fieldName];
+    }
+
+    NSString *query = [NSString stringWithFormat:@"SELECT \"%@\" FROM \"$T\"%@%@", [columnNames.array componentsJoinedByString:@"\",\""], (queryAfterWHERE ? @" WHERE " : @""), (queryAfterWHERE ?: @"")];
+    NSArray *viewFieldNames = [fieldNames copy];
+    FCModelRowDecoder *decoder = g_rowDecoders[self];
+    NSMutableArray *rowViews = [NSMutableArray array];
+    [g_databaseQueue readDatabase:^(FMDatabase *db) {
+        FMResultSet *s = [db executeQuery:[self expandQuery:query] withArgumentsInArray:arguments];
+        if (! s) [self queryFailedInDatabase:db];
+
+        FCModelRowColumnMap *columnMap = nil;
+        while ([s next]) {
+            sqlite3_stmt *statement = s.statement.statement;
+            if (! columnMap) columnMap = [decoder columnMapForStatement:statement];
+
+            FCModelRowView *rowView = [FCModelRowView new];
+            rowView.modelClass = self;
+            rowView.fieldNames = viewFieldNames;
+            rowView.primaryKey = [decoder primaryKeyValueFromStatement:statement columnMap:columnMap];
+            rowView.rowValues = [decoder decodeRowFromStatement:statement columnMap:columnMap intoInstance:nil];
+            [rowViews addObject:rowView];
+        }
+        [s close];
+    }];
+    return rowViews;
+}
+
 + (NSArray *)instancesWithPrimaryKeyValues:(NSArray *)primaryKeyValues
 {
     if (! checkForOpenDatabaseFatal(NO)) return nil;
@@ -676,13 +2144,9 @@ static inline BOOL checkForOpenDatabaseFatal(BOOL fatal)
         id largestNumber = [self firstValueFromQuery:@"SELECT MAX($PK) FROM $T"];
         int64_t largestExistingValue = largestNumber && largestNumber != NSNull.null ? ((NSNumber *) largestNumber).longLongValue : 0;
 
-        dispatch_semaphore_wait(g_instancesReadLock, DISPATCH_TIME_FOREVER);
-        NSMapTable *classCache = g_instances[self];
-        NSArray *instances = classCache ? [classCache.objectEnumerator.allObjects copy] : [NSArray array];
-        for (FCModel *instance in instances) {
+        for (FCModel *instance in [g_identityMaps[self] allInstances]) {
             largestExistingValue = MAX(largestExistingValue, ((NSNumber *)instance.primaryKey).longLongValue);
         }
-        dispatch_semaphore_signal(g_instancesReadLock);
         
         largestExistingValue++;
         return @(largestExistingValue);
@@ -705,8 +2169,7 @@ static inline BOOL checkForOpenDatabaseFatal(BOOL fatal)
 - (instancetype)initWithFieldValues:(NSDictionary *)fieldValues existsInDatabaseAlready:(BOOL)existsInDB
 {
     if ( (self = [super init]) ) {
-        [NSNotificationCenter.defaultCenter addObserver:self selector:@selector(reload:) name:FCModelReloadNotification object:self.class];
-        [NSNotificationCenter.defaultCenter addObserver:self selector:@selector(saveByNotification:) name:FCModelSaveNotification object:self.class];
+        pthread_mutex_init(&serializedFieldValuesLock, NULL);
         existsInDatabase = existsInDB;
         deleted = NO;
         
@@ -732,14 +2195,11 @@ static inline BOOL checkForOpenDatabaseFatal(BOOL fatal)
                         if ([self.class instanceFromDatabaseWithPrimaryKey:newKeyValue]) continue; // already exists in database
 
                         // already exists in memory (unsaved)
-                        dispatch_semaphore_wait(g_instancesReadLock, DISPATCH_TIME_FOREVER);
-                        NSMapTable *classCache = g_instances[self.class];
-                        if (! classCache) classCache = g_instances[(id) self.class] = [NSMapTable strongToWeakObjectsMapTable];
-                        conflict = (nil != [classCache objectForKey:newKeyValue]);
-                        if (! conflict) [classCache setObject:self forKey:newKeyValue];
-                        dispatch_semaphore_signal(g_instancesReadLock);
+                        conflict = (self != [identityMapForClass(self.class) addInstance:self forPrimaryKey:newKeyValue]);
                         
+                        setterTrackingSuppressed++;
                         [self setValue:newKeyValue forKey:key];
+                        setterTrackingSuppressed--;
                     } while (conflict);
                     
                 } else if (info.defaultValue) {
@@ -754,78 +2214,126 @@ static inline BOOL checkForOpenDatabaseFatal(BOOL fatal)
     return self;
 }
 
-- (void)saveByNotification:(NSNotification *)n
+- (instancetype)initWithStatement:(sqlite3_stmt *)statement columnMap:(FCModelRowColumnMap *)columnMap
 {
-    if (! checkForOpenDatabaseFatal(NO)) return;
-    
-    if (deleted) return;
-    Class targetedClass = n.object;
-    if (targetedClass && ! [self isKindOfClass:targetedClass]) return;
-    [self save];
+    if ( (self = [super init]) ) {
+        pthread_mutex_init(&serializedFieldValuesLock, NULL);
+        existsInDatabase = YES;
+        deleted = NO;
+
+        FCModelRowDecoder *decoder = g_rowDecoders[self.class];
+        setterTrackingSuppressed++;
+        self._rowValuesInDatabase = [decoder decodeRowFromStatement:statement columnMap:columnMap intoInstance:self];
+        setterTrackingSuppressed--;
+
+        [self didInit];
+    }
+    return self;
 }
 
-- (void)reload:(NSNotification *)n
+// Re-reads loaded instances of this class with chunked IN (...) queries rather than one query each, then updates and notifies
+//  only the instances whose database values changed or whose rows are gone.
++ (void)reloadInstances:(NSArray *)instances sourceThread:(NSThread *)sourceThread
 {
     if (! checkForOpenDatabaseFatal(NO)) return;
 
-    Class targetedClass = n.object;
-    if (targetedClass && ! [self isKindOfClass:targetedClass]) return;
-    if (! self.existsInDatabase) return;
+    NSMutableDictionary *instancesByPrimaryKey = [NSMutableDictionary dictionaryWithCapacity:instances.count];
+    for (FCModel *instance in instances) {
+        id primaryKeyValue = instance.primaryKey;
+        if (instance->existsInDatabase && primaryKeyValue && primaryKeyValue != NSNull.null) instancesByPrimaryKey[primaryKeyValue] = instance;
+    }
+    if (! instancesByPrimaryKey.count) return;
+
+    FCModelRowDecoder *decoder = g_rowDecoders[self];
+    NSArray *primaryKeyValues = instancesByPrimaryKey.allKeys;
+    NSMapTable *rowValuesByInstance = [NSMapTable strongToStrongObjectsMapTable];
+
+    [g_databaseQueue readDatabase:^(FMDatabase *db) {
+        NSUInteger maxParameterCount = (NSUInteger) sqlite3_limit(db.sqliteHandle, SQLITE_LIMIT_VARIABLE_NUMBER, -1);
+        FCModelRowColumnMap *columnMap = nil;
+        for (NSUInteger start = 0; start < primaryKeyValues.count; start += maxParameterCount) {
+            NSArray *chunk = [primaryKeyValues subarrayWithRange:NSMakeRange(start, MIN(maxParameterCount, primaryKeyValues.count - start))];
+            NSMutableString *query = [NSMutableString stringWithString:[self expandQuery:@"SELECT * FROM \"$T\" WHERE \"$PK\" IN (?"]];
+            for (NSUInteger i = 1; i < chunk.count; i++) [query appendString:@",?"];
+            [query appendString:@")"];
+
+            FMResultSet *s = [db executeQuery:query withArgumentsInArray:chunk];
+            if (! s) [self queryFailedInDatabase:db];
+            while ([s next]) {
+                sqlite3_stmt *statement = s.statement.statement;
+                if (! columnMap) columnMap = [decoder columnMapForStatement:statement];
+                FCModel *instance = instancesByPrimaryKey[[decoder primaryKeyValueFromStatement:statement columnMap:columnMap]];
+                if (instance) [rowValuesByInstance setObject:[decoder decodeRowFromStatement:statement columnMap:columnMap intoInstance:nil] forKey:instance];
+            }
+            [s close];
+        }
+    }];
+
+    NSSet *allFields = [NSSet setWithArray:self.databaseFieldNames];
+    for (FCModel *instance in instancesByPrimaryKey.objectEnumerator) {
+        NSDictionary *rowValues = [rowValuesByInstance objectForKey:instance];
+        NSSet *changedFields;
+        if (rowValues) {
+            NSDictionary *previousRowValues = instance._rowValuesInDatabase;
+            NSMutableSet *differentFields = [NSMutableSet set];
+            [rowValues enumerateKeysAndObjectsUsingBlock:^(NSString *fieldName, id value, BOOL *stop) {
+                id previousValue = previousRowValues[fieldName];
+                if (previousValue != value && ! [value isEqual:previousValue]) [differentFields addObject:fieldName];
+            }];
 
-    __block NSDictionary *resultDictionary = nil;
+            if (! differentFields.count) continue;
+            changedFields = differentFields;
 
-    [g_databaseQueue readDatabase:^(FMDatabase *db) {
-        FMResultSet *s = [db executeQuery:[self.class expandQuery:@"SELECT * FROM \"$T\" WHERE \"$PK\"=?"], self.primaryKey];
-        if (! s) [self.class queryFailedInDatabase:db];
-        if ([s next]) {
-            // Update from new database values
-            resultDictionary = [s.resultDictionary copy];
+            [instance updateFromDatabaseRowValues:rowValues];
+            [instance didUpdate];
+            [self postChangeNotification:FCModelUpdateNotification changedFields:changedFields instance:instance sourceThread:sourceThread];
         } else {
             // This instance no longer exists in database
-            deleted = YES;
-            existsInDatabase = NO;
+            changedFields = allFields;
+            instance->deleted = YES;
+            instance->existsInDatabase = NO;
+            instance._rowValuesInDatabase = nil;
+            [instance didDelete];
+            [self postChangeNotification:FCModelDeleteNotification changedFields:changedFields instance:instance sourceThread:sourceThread];
         }
-        [s close];
-    }];
 
-    if (deleted) {
-        self._rowValuesInDatabase = nil;
-        [self didDelete];
-        [self.class postChangeNotification:FCModelDeleteNotification changedFields:[NSSet setWithArray:self.class.databaseFieldNames] instance:self sourceThread:NSThread.currentThread];
-    } else {
-        NSDictionary *unsavedChanges = self.unsavedChanges;
-        NSSet *ignoredFieldNames = g_ignoredFieldNames[NSStringFromClass(self.class)];
+        [self postChangeNotification:FCModelWillSendAnyChangeNotification changedFields:changedFields instance:instance sourceThread:sourceThread];
+        [self postChangeNotification:FCModelAnyChangeNotification changedFields:changedFields instance:instance sourceThread:sourceThread];
+    }
+}
 
-        [resultDictionary enumerateKeysAndObjectsUsingBlock:^(NSString *fieldName, id fieldValue, BOOL *stop) {
-            if ([fieldName isEqualToString:g_primaryKeyFieldName[self.class]] || (ignoredFieldNames && [ignoredFieldNames containsObject:fieldName])) return;
-            fieldValue = fieldValue == NSNull.null ? nil : fieldValue;
-            
-            id unsavedChangeValue = unsavedChanges[fieldName];
-            if (unsavedChangeValue) {
-                // Conflict if the value isn't equal to the new DB value.
-                if (unsavedChangeValue == NSNull.null) unsavedChangeValue = nil;
+// Assigns newly read database values, resolving conflicts with unsaved changes
+- (void)updateFromDatabaseRowValues:(NSDictionary *)resultDictionary
+{
+    NSDictionary *unsavedChanges = self.unsavedChanges;
+    NSSet *ignoredFieldNames = g_ignoredFieldNames[NSStringFromClass(self.class)];
 
-                if (! [unsavedChangeValue isKindOfClass:[fieldValue class]]) {
-                    unsavedChangeValue = [self encodedValueForFieldName:fieldName];
-                }
+    [resultDictionary enumerateKeysAndObjectsUsingBlock:^(NSString *fieldName, id fieldValue, BOOL *stop) {
+        if ([fieldName isEqualToString:g_primaryKeyFieldName[self.class]] || (ignoredFieldNames && [ignoredFieldNames containsObject:fieldName])) return;
+        fieldValue = fieldValue == NSNull.null ? nil : fieldValue;
+        
+        id unsavedChangeValue = unsavedChanges[fieldName];
+        if (unsavedChangeValue) {
+            // Conflict if the value isn't equal to the new DB value.
+            if (unsavedChangeValue == NSNull.null) unsavedChangeValue = nil;
 
-                if (unsavedChangeValue != fieldValue && ((! unsavedChangeValue || ! fieldValue) || ! [fieldValue isEqual:unsavedChangeValue])) {
-                    // Conflict: model was loaded from DB, modified without being saved, and now the reload wants to set a different value
-                    fieldValue = [self valueOfFieldName:fieldName byResolvingReloadConflictWithDatabaseValue:fieldValue];
-                }
+            if (! [unsavedChangeValue isKindOfClass:[fieldValue class]]) {
+                unsavedChangeValue = [self encodedValueForFieldName:fieldName];
+            }
 
-                [self decodeFieldValue:fieldValue intoPropertyName:fieldName];
-            } else {
-                // No conflict. Just assign the new value.
-                [self decodeFieldValue:fieldValue intoPropertyName:fieldName];
+            if (unsavedChangeValue != fieldValue && ((! unsavedChangeValue || ! fieldValue) || ! [fieldValue isEqual:unsavedChangeValue])) {
+                // Conflict: model was loaded from DB, modified without being saved, and now the reload wants to set a different value
+                fieldValue = [self valueOfFieldName:fieldName byResolvingReloadConflictWithDatabaseValue:fieldValue];
             }
-        }];
-        
-        self._rowValuesInDatabase = resultDictionary;
-        
-        [self didUpdate];
-        [self.class postChangeNotification:FCModelUpdateNotification changedFields:[NSSet setWithArray:self.class.databaseFieldNames] instance:self sourceThread:NSThread.currentThread];
-    }
+
+            [self decodeFieldValue:fieldValue intoPropertyName:fieldName];
+        } else {
+            // No conflict. Just assign the new value.
+            [self decodeFieldValue:fieldValue intoPropertyName:fieldName];
+        }
+    }];
+    
+    self._rowValuesInDatabase = resultDictionary;
 }
 
 - (id)valueOfFieldName:(NSString *)fieldName byResolvingReloadConflictWithDatabaseValue:(id)valueInDatabase
@@ -855,14 +2363,35 @@ static inline BOOL checkForOpenDatabaseFatal(BOOL fatal)
 - (void)revertUnsavedChangeToFieldName:(NSString *)fieldName
 {
     id oldValue = self._rowValuesInDatabase ? self._rowValuesInDatabase[fieldName] : nil;
-    if (oldValue) [self decodeFieldValue:oldValue intoPropertyName:fieldName];
+    if (oldValue) {
+        [self decodeFieldValue:oldValue intoPropertyName:fieldName];
+        if (classTracksSetters(self.class)) dirtyFieldMask &= ~[self fieldMaskForFieldNames:@[ fieldName ]];
+    }
 }
 
-- (void)dealloc { [NSNotificationCenter.defaultCenter removeObserver:self]; }
+- (void)dealloc
+{
+    [NSNotificationCenter.defaultCenter removeObserver:self];
+    pthread_mutex_destroy(&serializedFieldValuesLock);
+}
 - (BOOL)existsInDatabase  { return existsInDatabase; }
-- (BOOL)hasUnsavedChanges { return ! existsInDatabase || self.unsavedChanges.count; }
+- (BOOL)hasUnsavedChanges
+{
+    if (existsInDatabase && classTracksSetters(self.class)) return self.trackedChangedFieldNames.count;
+    return ! existsInDatabase || self.unsavedChanges.count;
+}
 
 - (NSDictionary *)unsavedChanges
+{
+    if (existsInDatabase && classTracksSetters(self.class)) {
+        NSMutableDictionary *changes = [NSMutableDictionary dictionary];
+        for (NSString *fieldName in self.trackedChangedFieldNames) changes[fieldName] = [self valueForKey:fieldName] ?: NSNull.null;
+        return [changes copy];
+    }
+    return self.unsavedChangesComparedToDatabaseValues;
+}
+
+- (NSDictionary *)unsavedChangesComparedToDatabaseValues
 {
     NSMutableDictionary *changes = [NSMutableDictionary dictionary];
     
@@ -871,6 +2400,11 @@ static inline BOOL checkForOpenDatabaseFatal(BOOL fatal)
 
         NSDictionary *rowValuesInDatabase = self._rowValuesInDatabase;
         id oldValue = rowValuesInDatabase && [rowValuesInDatabase isKindOfClass:NSDictionary.class] ? rowValuesInDatabase[fieldName] : nil;
+
+        // Lazily decoded fields compare their stored bytes, so unread ones stay undecoded
+        NSData *serializedData = [self serializedDataOfUnchangedFieldName:fieldName];
+        if (serializedData && oldValue && (serializedData == oldValue || [serializedData isEqual:oldValue])) return;
+
         if (oldValue) oldValue = [self unserializedRepresentationOfDatabaseValue:(oldValue == NSNull.null ? nil : oldValue) forPropertyNamed:fieldName];
         
         id newValue = [self valueForKey:fieldName];
@@ -890,7 +2424,11 @@ static inline BOOL checkForOpenDatabaseFatal(BOOL fatal)
     return [changes copy];
 }
 
-- (NSArray *)changedFieldNames { return self.unsavedChanges.allKeys; }
+- (NSArray *)changedFieldNames
+{
+    if (existsInDatabase && classTracksSetters(self.class)) return self.trackedChangedFieldNames;
+    return self.unsavedChanges.allKeys;
+}
 
 - (FCModelSaveResult)save
 {
@@ -902,125 +2440,187 @@ static inline BOOL checkForOpenDatabaseFatal(BOOL fatal)
     __block BOOL update;
     __block NSSet *changedFields = nil;
     [g_databaseQueue writeDatabase:^(FMDatabase *db) {
+        result = [self saveInDatabase:db changes:self.unsavedChanges isUpdate:&update changedFields:&changedFields];
+    }];
+
+    if (result == FCModelSaveSucceeded) [self postSaveNotificationsForUpdate:update changedFields:changedFields sourceThread:sourceThread];
+    return result;
+}
+
+// Must be called inside a writeDatabase: block, with changes from unsavedChanges computed in that same block.
+- (FCModelSaveResult)saveInDatabase:(FMDatabase *)db changes:(NSDictionary *)changes isUpdate:(BOOL *)outUpdate changedFields:(NSSet **)outChangedFields
+{
+    BOOL dirty = changes.count;
+    if (! dirty && existsInDatabase) return FCModelSaveNoChanges;
     
-        NSDictionary *changes = self.unsavedChanges;
-        BOOL dirty = changes.count;
-        if (! dirty && existsInDatabase) { result = FCModelSaveNoChanges; return; }
-        
-        update = existsInDatabase;
+    BOOL update = existsInDatabase;
+    NSSet *changedFields;
+    
+    NSString *tableName = NSStringFromClass(self.class);
+    NSString *pkName = g_primaryKeyFieldName[self.class];
+    NSDictionary *fieldInfo = g_fieldInfo[self.class];
+    id primaryKey = [self encodedValueForFieldName:pkName];
+    NSAssert1(primaryKey, @"Cannot update %@ without primary key value", NSStringFromClass(self.class));
+   
+    if (update) {
+        if (! [self shouldUpdate]) {
+            [self saveWasRefused];
+            return FCModelSaveRefused;
+        }
+        changedFields = [NSSet setWithArray:changes.allKeys];
+    } else {
+        if (! [self shouldInsert]) {
+            [self saveWasRefused];
+            return FCModelSaveRefused;
+        }
+        changedFields = [NSSet setWithArray:fieldInfo.allKeys];
+    }
+
+    // Validate NOT NULL columns
+    [fieldInfo enumerateKeysAndObjectsUsingBlock:^(id key, FCModelFieldInfo *info, BOOL *stop) {
+        if (info.nullAllowed) return;
+    
+        id value = [self valueForKey:key];
+        if (! value || value == NSNull.null) {
+            [[NSException exceptionWithName:NSInvalidArgumentException reason:[NSString stringWithFormat:@"Cannot save NULL to NOT NULL property %@.%@", tableName, key] userInfo:nil] raise];
+        }
+    }];
+
+    NSError *error = nil;
+    BOOL success;
+    NSArray *fieldNamesByIndex = g_fieldNamesByIndex[self.class];
+    if (fieldNamesByIndex.count <= 64) {
+        uint64_t columnMask = 0;
+        if (update) {
+            for (NSString *fieldName in changes) columnMask |= (1ULL << ((FCModelFieldInfo *) fieldInfo[fieldName]).fieldIndex);
+        } else {
+            columnMask = (fieldNamesByIndex.count == 64 ? UINT64_MAX : (1ULL << fieldNamesByIndex.count) - 1);
+            columnMask &= ~(1ULL << ((FCModelFieldInfo *) fieldInfo[pkName]).fieldIndex);
+        }
+        success = [self executeCachedStatement:(update ? FCModelStatementUpdate : FCModelStatementInsert) columnMask:columnMask primaryKey:primaryKey inDatabase:db error:&error];
+    } else {
+        // Too many columns for a mask, so this table goes through FMDB without statement caching
         NSArray *columnNames;
-        NSMutableArray *values;
-        
-        NSString *tableName = NSStringFromClass(self.class);
-        NSString *pkName = g_primaryKeyFieldName[self.class];
-        id primaryKey = [self encodedValueForFieldName:pkName];
-        NSAssert1(primaryKey, @"Cannot update %@ without primary key value", NSStringFromClass(self.class));
-       
         if (update) {
-            if (! [self shouldUpdate]) {
-                [self saveWasRefused];
-                result = FCModelSaveRefused;
-                return;
-            }
-            columnNames = [changes allKeys];
-            changedFields = [NSSet setWithArray:columnNames];
+            columnNames = [changes.allKeys sortedArrayUsingSelector:@selector(compare:)];
         } else {
-            if (! [self shouldInsert]) {
-                [self saveWasRefused];
-                result = FCModelSaveRefused;
-                return;
-            }
-
-            changedFields = [NSSet setWithArray:self.class.databaseFieldNames];
-            NSMutableSet *columnNamesMinusPK = [[NSSet setWithArray:[g_fieldInfo[self.class] allKeys]] mutableCopy];
+            NSMutableArray *columnNamesMinusPK = [fieldNamesByIndex mutableCopy];
             [columnNamesMinusPK removeObject:pkName];
-            columnNames = [columnNamesMinusPK allObjects];
+            columnNames = columnNamesMinusPK;
         }
 
-        // Validate NOT NULL columns
-        [g_fieldInfo[self.class] enumerateKeysAndObjectsUsingBlock:^(id key, FCModelFieldInfo *info, BOOL *stop) {
-            if (info.nullAllowed) return;
-        
-            id value = [self valueForKey:key];
-            if (! value || value == NSNull.null) {
-                [[NSException exceptionWithName:NSInvalidArgumentException reason:[NSString stringWithFormat:@"Cannot save NULL to NOT NULL property %@.%@", tableName, key] userInfo:nil] raise];
-            }
-        }];
-
-        values = [NSMutableArray arrayWithCapacity:columnNames.count];
-        [columnNames enumerateObjectsUsingBlock:^(id obj, NSUInteger idx, BOOL *stop) {
-            [values addObject:[self encodedValueForFieldName:obj]];
-        }];
+        NSMutableArray *values = [NSMutableArray arrayWithCapacity:columnNames.count + 1];
+        for (NSString *fieldName in columnNames) [values addObject:[self encodedValueForFieldName:fieldName]];
         [values addObject:primaryKey];
 
-        NSString *query;
-        if (update) {
-            query = [NSString stringWithFormat:
-                @"UPDATE \"%@\" SET \"%@\"=? WHERE \"%@\"=?",
-                tableName,
-                [columnNames componentsJoinedByString:@"\"=?,\""],
-                pkName
-            ];
-        } else {
-            if (columnNames.count > 0) {
-                query = [NSString stringWithFormat:
-                    @"INSERT INTO \"%@\" (\"%@\",\"%@\") VALUES (%@?)",
-                    tableName,
-                    [columnNames componentsJoinedByString:@"\",\""],
-                    pkName,
-                    [@"" stringByPaddingToLength:(columnNames.count * 2) withString:@"?," startingAtIndex:0]
-                ];
-            } else {
-                query = [NSString stringWithFormat:
-                    @"INSERT INTO \"%@\" (\"%@\") VALUES (?)",
-                    tableName,
-                    pkName
-                ];
-            }
-        }
-
-        BOOL success = NO;
+        NSString *query = [self.class sqlForStatementOperation:(update ? FCModelStatementUpdate : FCModelStatementInsert) columnNames:columnNames];
         success = [db executeUpdate:query withArgumentsInArray:values];
-        if (success) {
-            self._lastSQLiteError = nil;
-        } else {
-            self._lastSQLiteError = db.lastError;
-        }
-        
-        if (! success) {
-            [self saveDidFail];
-            result = FCModelSaveFailed;
-            return;
+        if (! success) error = db.lastError;
+    }
+    self._lastSQLiteError = error;
+    
+    if (! success) {
+        [self saveDidFail];
+        return FCModelSaveFailed;
+    }
+    
+    [self saveStateForTransactionRollback];
+    NSDictionary *rowValuesInDatabase = self._rowValuesInDatabase;
+    NSMutableDictionary *newRowValues = rowValuesInDatabase ? [rowValuesInDatabase mutableCopy] : [NSMutableDictionary dictionary];
+    NSSet *lazyFieldNames = g_lazilyDecodedFieldNames[self.class];
+    [changes enumerateKeysAndObjectsUsingBlock:^(NSString *fieldName, id obj, BOOL *stop) {
+        id value = obj == NSNull.null ? nil : obj;
+        id databaseValue = [self serializedDatabaseRepresentationOfValue:value forPropertyNamed:fieldName];
+        newRowValues[fieldName] = databaseValue ?: NSNull.null;
+        if (value && [databaseValue isKindOfClass:NSData.class] && [lazyFieldNames containsObject:fieldName]) {
+            [self setSerializedData:databaseValue decodedValue:value forFieldName:fieldName];
         }
-        
-        NSDictionary *rowValuesInDatabase = self._rowValuesInDatabase;
-        NSMutableDictionary *newRowValues = rowValuesInDatabase ? [rowValuesInDatabase mutableCopy] : [NSMutableDictionary dictionary];
-        [changes enumerateKeysAndObjectsUsingBlock:^(NSString *fieldName, id obj, BOOL *stop) {
-            obj = [self serializedDatabaseRepresentationOfValue:(obj == NSNull.null ? nil : obj) forPropertyNamed:fieldName];
-            newRowValues[fieldName] = obj ?: NSNull.null;
+    }];
+    self._rowValuesInDatabase = newRowValues;
+    existsInDatabase = YES;
+    dirtyFieldMask = (update && classTracksSetters(self.class)) ? (dirtyFieldMask & ~[self fieldMaskForFieldNames:changes]) : 0;
+    
+    if (update) [self didUpdate];
+    else [self didInsert];
+    
+    if (outUpdate) *outUpdate = update;
+    if (outChangedFields) *outChangedFields = changedFields;
+    return FCModelSaveSucceeded;
+}
+
++ (NSString *)sqlForStatementOperation:(FCModelStatementOperation)operation columnNames:(NSArray *)columnNames
+{
+    NSString *tableName = NSStringFromClass(self);
+    NSString *pkName = g_primaryKeyFieldName[self];
+
+    if (operation == FCModelStatementDelete) {
+        return [NSString stringWithFormat:@"DELETE FROM \"%@\" WHERE \"%@\"=?", tableName, pkName];
+    } else if (operation == FCModelStatementUpdate) {
+        return [NSString stringWithFormat:
+            @"UPDATE \"%@\" SET \"%@\"=? WHERE \"%@\"=?",
+            tableName,
+            [columnNames componentsJoinedByString:@"\"=?,\""],
+            pkName
+        ];
+    } else if (columnNames.count > 0) {
+        return [NSString stringWithFormat:
+            @"INSERT INTO \"%@\" (\"%@\",\"%@\") VALUES (%@?)",
+            tableName,
+            [columnNames componentsJoinedByString:@"\",\""],
+            pkName,
+            [@"" stringByPaddingToLength:(columnNames.count * 2) withString:@"?," startingAtIndex:0]
+        ];
+    } else {
+        return [NSString stringWithFormat:@"INSERT INTO \"%@\" (\"%@\") VALUES (?)", tableName, pkName];
+    }
+}
+
+// Runs an INSERT, UPDATE, or DELETE through the queue's statement cache, binding the columns in columnMask by index, then the primary key.
+//  Must be called inside a writeDatabase: block.
+- (BOOL)executeCachedStatement:(FCModelStatementOperation)operation columnMask:(uint64_t)columnMask primaryKey:(id)primaryKey inDatabase:(FMDatabase *)db error:(NSError **)outError
+{
+    Class class = self.class;
+    NSArray *fieldNamesByIndex = g_fieldNamesByIndex[class];
+
+    FCModelStatementKey *key = [FCModelStatementKey new];
+    key->modelClass = class;
+    key->operation = operation;
+    key->columnMask = columnMask;
+
+    sqlite3_stmt *statement = [g_databaseQueue cachedStatementForKey:key inDatabase:db sqlBuilder:^NSString *{
+        NSMutableArray *columnNames = [NSMutableArray array];
+        [fieldNamesByIndex enumerateObjectsUsingBlock:^(NSString *fieldName, NSUInteger idx, BOOL *stop) {
+            if (columnMask & (1ULL << idx)) [columnNames addObject:fieldName];
         }];
-        self._rowValuesInDatabase = newRowValues;
-        existsInDatabase = YES;
-        
-        if (update) [self didUpdate];
-        else [self didInsert];
-        
-        result = FCModelSaveSucceeded;
+        return [class sqlForStatementOperation:operation columnNames:columnNames];
     }];
 
-    if (result == FCModelSaveSucceeded) {
-        if (update) {
-            [self.class postChangeNotification:FCModelWillSendAnyChangeNotification changedFields:changedFields instance:self sourceThread:sourceThread];
-            [self.class postChangeNotification:FCModelUpdateNotification changedFields:changedFields instance:self sourceThread:sourceThread];
-            [self.class postChangeNotification:FCModelAnyChangeNotification changedFields:changedFields instance:self sourceThread:sourceThread];
-        } else {
-            [self.class postChangeNotification:FCModelWillSendAnyChangeNotification changedFields:changedFields instance:self sourceThread:sourceThread];
-            [self.class postChangeNotification:FCModelInsertNotification changedFields:changedFields instance:self sourceThread:sourceThread];
-            [self.class postChangeNotification:FCModelAnyChangeNotification changedFields:changedFields instance:self sourceThread:sourceThread];
+    if (! statement) {
+        if (outError) *outError = db.lastError;
+        return NO;
+    }
+
+    int bindIndex = 1;
+    NSUInteger fieldCount = fieldNamesByIndex.count;
+    for (NSUInteger fieldIndex = 0; fieldIndex < fieldCount; fieldIndex++) {
+        if (columnMask & (1ULL << fieldIndex)) {
+            [db bindObject:[self encodedValueForFieldName:fieldNamesByIndex[fieldIndex]] toColumn:bindIndex++ inStatement:statement];
         }
     }
-    
-    return result;
+    [db bindObject:primaryKey toColumn:bindIndex inStatement:statement];
+
+    BOOL success = (SQLITE_DONE == sqlite3_step(statement));
+    if (! success && outError) *outError = db.lastError;
+    sqlite3_reset(statement);
+    sqlite3_clear_bindings(statement);
+    return success;
+}
+
+- (void)postSaveNotificationsForUpdate:(BOOL)update changedFields:(NSSet *)changedFields sourceThread:(NSThread *)sourceThread
+{
+    [self.class postChangeNotification:FCModelWillSendAnyChangeNotification changedFields:changedFields instance:self sourceThread:sourceThread];
+    [self.class postChangeNotification:(update ? FCModelUpdateNotification : FCModelInsertNotification) changedFields:changedFields instance:self sourceThread:sourceThread];
+    [self.class postChangeNotification:FCModelAnyChangeNotification changedFields:changedFields instance:self sourceThread:sourceThread];
 }
 
 - (FCModelSaveResult)delete
@@ -1039,10 +2639,9 @@ static inline BOOL checkForOpenDatabaseFatal(BOOL fatal)
             return;
         }
         
-        __block BOOL success = NO;
-        NSString *query = [self.class expandQuery:@"DELETE FROM \"$T\" WHERE \"$PK\" = ?"];
-        success = [db executeUpdate:query, [self primaryKey]];
-        self._lastSQLiteError = success ? nil : db.lastError;
+        NSError *error = nil;
+        BOOL success = [self executeCachedStatement:FCModelStatementDelete columnMask:0 primaryKey:[self primaryKey] inDatabase:db error:&error];
+        self._lastSQLiteError = error;
 
         if (! success) {
             [self saveDidFail];
@@ -1050,6 +2649,7 @@ static inline BOOL checkForOpenDatabaseFatal(BOOL fatal)
             return;
         }
         
+        [self saveStateForTransactionRollback];
         deleted = YES;
         existsInDatabase = NO;
         [self didDelete];
@@ -1071,21 +2671,133 @@ static inline BOOL checkForOpenDatabaseFatal(BOOL fatal)
 - (void)removeFromCache
 {
     id primaryKeyValue = self.primaryKey;
-    if (g_instances && primaryKeyValue && primaryKeyValue != NSNull.null) {
-        dispatch_semaphore_wait(g_instancesReadLock, DISPATCH_TIME_FOREVER);
-        NSMapTable *classCache = g_instances[self.class];
-        [classCache removeObjectForKey:primaryKeyValue];
-        dispatch_semaphore_signal(g_instancesReadLock);
+    if (primaryKeyValue && primaryKeyValue != NSNull.null) [g_identityMaps[self.class] removeInstanceForPrimaryKey:primaryKeyValue];
+}
+
+- (void)saveStateForTransactionRollback
+{
+    FCModelTransactionFrame *frame = currentTransactionFrame(NSThread.currentThread);
+    if (! frame || [frame.instanceSnapshots objectForKey:self]) return;
+    [frame.instanceSnapshots setObject:@[ @(existsInDatabase), @(deleted), self._rowValuesInDatabase ?: NSNull.null ] forKey:self];
+}
+
+- (void)restoreStateFromTransactionSnapshot:(NSArray *)snapshot
+{
+    BOOL wasDeletedInTransaction = deleted && ! [snapshot[1] boolValue];
+    existsInDatabase = [snapshot[0] boolValue];
+    deleted = [snapshot[1] boolValue];
+    self._rowValuesInDatabase = snapshot[2] == NSNull.null ? nil : snapshot[2];
+    if (existsInDatabase && classTracksSetters(self.class)) dirtyFieldMask |= [self fieldMaskForFieldNames:self.unsavedChangesComparedToDatabaseValues];
+
+    if (wasDeletedInTransaction) {
+        // Put it back in the unique map, unless something else has taken its place
+        id primaryKeyValue = self.primaryKey;
+        if (! primaryKeyValue || primaryKeyValue == NSNull.null) return;
+        [identityMapForClass(self.class) addInstance:self forPrimaryKey:primaryKeyValue];
     }
 }
 
++ (BOOL)performTransaction:(BOOL (^)(void))block
+{
+    checkForOpenDatabaseFatal(YES);
+
+    NSThread *callingThread = NSThread.currentThread;
+    __block BOOL committed = NO;
+    __block NSArray *actionsToReplay = nil;
+    [g_databaseQueue writeDatabase:^(FMDatabase *db) {
+        NSMutableDictionary *threadDictionary = NSThread.currentThread.threadDictionary;
+        NSMutableArray *stack = threadDictionary[FCModelTransactionStackKey];
+        BOOL outermost = ! stack;
+        if (outermost) stack = threadDictionary[FCModelTransactionStackKey] = [NSMutableArray array];
+
+        // Savepoints work both for nesting and inside a transaction that someone began manually with inDatabaseSync:
+        BOOL useSavepoint = ! sqlite3_get_autocommit(db.sqliteHandle);
+        NSString *savepointName = [NSString stringWithFormat:@"FCModelTransaction%lu", (unsigned long) stack.count];
+        NSError *error = nil;
+        if (! (useSavepoint ? [db startSavePointWithName:savepointName error:&error] : [db beginDeferredTransaction])) {
+            if (outermost) [threadDictionary removeObjectForKey:FCModelTransactionStackKey];
+            [self queryFailedInDatabase:db];
+        }
+        if (useSavepoint) [g_rowChangeLog beginSavepoint];
+
+        FCModelTransactionFrame *frame = [FCModelTransactionFrame new];
+        [stack addObject:frame];
+        BOOL shouldCommit = NO;
+        @try {
+            shouldCommit = block();
+        } @finally {
+            [stack removeLastObject];
+            if (outermost) [threadDictionary removeObjectForKey:FCModelTransactionStackKey];
+
+            if (shouldCommit) committed = useSavepoint ? [db releaseSavePointWithName:savepointName error:&error] : [db commit];
+
+            if (! committed) {
+                if (useSavepoint) {
+                    [db rollbackToSavePointWithName:savepointName error:&error];
+                    [g_rowChangeLog rollbackToSavepoint];
+                    [db releaseSavePointWithName:savepointName error:&error];
+                } else {
+                    [db rollback];
+                }
+            }
+            if (useSavepoint) [g_rowChangeLog releaseSavepoint];
+            [g_rowChangeLog commitIfTransactionEndedInDatabase:db];
+
+            if (! committed) {
+                for (FCModel *instance in frame.instanceSnapshots.keyEnumerator.allObjects) {
+                    [instance restoreStateFromTransactionSnapshot:[frame.instanceSnapshots objectForKey:instance]];
+                }
+            } else if (outermost) {
+                actionsToReplay = [frame.deferredActions copy];
+            } else {
+                // Inner commit: the outer transaction can still roll these back or needs to replay them
+                FCModelTransactionFrame *parent = stack.lastObject;
+                for (FCModel *instance in frame.instanceSnapshots.keyEnumerator.allObjects) {
+                    if (! [parent.instanceSnapshots objectForKey:instance]) [parent.instanceSnapshots setObject:[frame.instanceSnapshots objectForKey:instance] forKey:instance];
+                }
+                [parent.deferredActions addObjectsFromArray:frame.deferredActions];
+            }
+        }
+    }];
+
+    for (void (^action)(NSThread *) in actionsToReplay) action(callingThread);
+    return committed;
+}
+
 + (void)saveAll
 {
     checkForOpenDatabaseFatal(YES);
-    NSArray *classesToNotify = (self == FCModel.class ? g_primaryKeyFieldName.allKeys : @[ self ]);
-    for (Class class in classesToNotify) {
-        [NSNotificationCenter.defaultCenter postNotificationName:FCModelSaveNotification object:class userInfo:nil];
-    }
+
+    NSMutableArray *loadedInstances = [NSMutableArray array];
+    [g_identityMaps enumerateKeysAndObjectsUsingBlock:^(Class class, FCModelIdentityMap *identityMap, BOOL *stop) {
+        if ([class isSubclassOfClass:self]) [loadedInstances addObjectsFromArray:identityMap.allInstances];
+    }];
+    if (! loadedInstances.count) return;
+
+    void (^saveDirtyInstances)() = ^{
+        [self performTransaction:^BOOL{
+            [g_databaseQueue writeDatabase:^(FMDatabase *db) {
+                // Each save reuses the cached statement for its class and changed-column set
+                NSThread *databaseThread = NSThread.currentThread;
+                for (FCModel *instance in loadedInstances) {
+                    if (instance->deleted) continue;
+                    NSDictionary *changes = instance.unsavedChanges;
+                    if (! changes.count && instance->existsInDatabase) continue;
+
+                    BOOL update;
+                    NSSet *changedFields;
+                    if (FCModelSaveSucceeded == [instance saveInDatabase:db changes:changes isUpdate:&update changedFields:&changedFields]) {
+                        [instance postSaveNotificationsForUpdate:update changedFields:changedFields sourceThread:databaseThread];
+                    }
+                }
+            }];
+            return YES;
+        }];
+    };
+
+    // Coalesce the transaction's notifications into one set per class, unless the caller is already batching
+    if (self.isBatchingNotificationsForCurrentThread) saveDirtyInstances();
+    else [self performWithBatchedNotifications:saveDirtyInstances];
 }
 
 #pragma mark - Utilities
@@ -1125,8 +2837,15 @@ static inline BOOL checkForOpenDatabaseFatal(BOOL fatal)
 
 + (void)openDatabaseAtPath:(NSString *)path withDatabaseInitializer:(void (^)(FMDatabase *db))databaseInitializer schemaBuilder:(void (^)(FMDatabase *db, int *schemaVersion))schemaBuilder
 {
-    g_databaseQueue = [[FCModelDatabaseQueue alloc] initWithDatabasePath:path];
+    [self openDatabaseAtPath:path withDatabaseInitializer:databaseInitializer schemaBuilder:schemaBuilder maximumConcurrentReaders:0];
+}
+
++ (void)openDatabaseAtPath:(NSString *)path withDatabaseInitializer:(void (^)(FMDatabase *db))databaseInitializer schemaBuilder:(void (^)(FMDatabase *db, int *schemaVersion))schemaBuilder maximumConcurrentReaders:(NSUInteger)readerCount
+{
+    g_databaseQueue = [[FCModelDatabaseQueue alloc] initWithDatabasePath:path maximumConcurrentReaders:readerCount];
+    g_databaseQueue.readerInitializer = databaseInitializer;
     NSMutableDictionary *mutableFieldInfo = [NSMutableDictionary dictionary];
+    NSMutableDictionary *mutableFieldNamesByIndex = [NSMutableDictionary dictionary];
     NSMutableDictionary *mutableIgnoredFieldNames = [NSMutableDictionary dictionary];
     NSMutableDictionary *mutablePrimaryKeyFieldName = [NSMutableDictionary dictionary];
     
@@ -1157,6 +2876,7 @@ static inline BOOL checkForOpenDatabaseFatal(BOOL fatal)
         if (autoincTables.count) g_tablesUsingAutoIncrementEmulation = [autoincTables copy];
         
         // Read schema for field names and primary keys
+        NSMutableSet *tablesWithRowIDPrimaryKeys = [NSMutableSet set];
         FMResultSet *tablesRS = [db executeQuery:
             @"SELECT DISTINCT tbl_name FROM (SELECT * FROM sqlite_master UNION ALL SELECT * FROM sqlite_temp_master) WHERE type != 'meta' AND name NOT LIKE 'sqlite_%'"
        ];
@@ -1208,12 +2928,13 @@ static inline BOOL checkForOpenDatabaseFatal(BOOL fatal)
                 }
                 
                 int isPK = [columnsRS intForColumnIndex:5];
+                NSString *fieldType = [columnsRS stringForColumnIndex:2];
                 if (isPK) {
                     primaryKeyColumnCount++;
                     primaryKeyName = fieldName;
+                    if ([fieldType caseInsensitiveCompare:@"INTEGER"] == NSOrderedSame) [tablesWithRowIDPrimaryKeys addObject:tableName];
                 }
 
-                NSString *fieldType = [columnsRS stringForColumnIndex:2];
                 FCModelFieldInfo *info = [FCModelFieldInfo new];
                 info.propertyClass = propertyClass;
                 info.propertyTypeEncoding = [typeString substringFromIndex:1];
@@ -1274,8 +2995,14 @@ static inline BOOL checkForOpenDatabaseFatal(BOOL fatal)
                 raise];
             }
             
+            NSArray *fieldNamesByIndex = [fields.allKeys sortedArrayUsingSelector:@selector(compare:)];
+            [fieldNamesByIndex enumerateObjectsUsingBlock:^(NSString *fieldName, NSUInteger idx, BOOL *stop) {
+                ((FCModelFieldInfo *) fields[fieldName]).fieldIndex = idx;
+            }];
+
             id classKey = tableModelClass;
             [mutableFieldInfo setObject:fields forKey:classKey];
+            [mutableFieldNamesByIndex setObject:fieldNamesByIndex forKey:classKey];
             [mutablePrimaryKeyFieldName setObject:primaryKeyName forKey:classKey];
             [columnsRS close];
 
@@ -1284,8 +3011,52 @@ static inline BOOL checkForOpenDatabaseFatal(BOOL fatal)
         [tablesRS close];
     
         g_fieldInfo = [mutableFieldInfo copy];
+        g_fieldNamesByIndex = [mutableFieldNamesByIndex copy];
         g_ignoredFieldNames = [mutableIgnoredFieldNames copy];
-        g_primaryKeyFieldName = [mutablePrimaryKeyFieldName copy];
+        g_primaryKeyFieldName = [mutablePrimaryKeyFieldName copy]; // before the row decoders below, which read it
+
+        NSMutableSet *classesTrackingSetters = [NSMutableSet set];
+        [g_fieldNamesByIndex enumerateKeysAndObjectsUsingBlock:^(Class class, NSArray *fieldNamesByIndex, BOOL *stop) {
+            if ([class tracksChangesWithSetters] && [class interposeSettersForFieldNames:fieldNamesByIndex]) [classesTrackingSetters addObject:class];
+        }];
+        g_classesTrackingSetters = [classesTrackingSetters copy];
+
+        NSMutableDictionary *lazilyDecodedFieldNames = [NSMutableDictionary dictionary];
+        [g_fieldNamesByIndex enumerateKeysAndObjectsUsingBlock:^(Class class, NSArray *fieldNamesByIndex, BOOL *stop) {
+            NSSet *fieldNames = [class interposeAccessorsForLazilyDecodedFieldNames:fieldNamesByIndex];
+            if (fieldNames.count) lazilyDecodedFieldNames[(id) class] = fieldNames;
+        }];
+        g_lazilyDecodedFieldNames = [lazilyDecodedFieldNames copy];
+
+        NSMutableDictionary *fieldCodecs = [NSMutableDictionary dictionary];
+        [g_fieldInfo enumerateKeysAndObjectsUsingBlock:^(Class class, NSDictionary *fields, BOOL *stop) {
+            NSMutableDictionary *codecs = [NSMutableDictionary dictionary];
+            [fields enumerateKeysAndObjectsUsingBlock:^(NSString *fieldName, FCModelFieldInfo *info, BOOL *stop) {
+                if (info.propertyClass != NSArray.class && info.propertyClass != NSDictionary.class) return;
+                id <FCModelCodec> codec = [class codecForFieldName:fieldName];
+                if (codec) codecs[fieldName] = codec;
+            }];
+            fieldCodecs[(id) class] = [codecs copy];
+        }];
+        g_fieldCodecs = [fieldCodecs copy];
+
+        // After setters are wrapped, so decoders call the wrapped ones
+        NSMutableDictionary *rowDecoders = [NSMutableDictionary dictionary];
+        for (Class class in g_fieldNamesByIndex) rowDecoders[(id) class] = [[FCModelRowDecoder alloc] initWithModelClass:class];
+        g_rowDecoders = [rowDecoders copy];
+
+        NSMutableDictionary *identityMaps = [NSMutableDictionary dictionary];
+        [g_primaryKeyFieldName enumerateKeysAndObjectsUsingBlock:^(Class class, NSString *primaryKeyName, BOOL *stop) {
+            FCModelFieldInfo *primaryKeyInfo = g_fieldInfo[class][primaryKeyName];
+            identityMaps[(id) class] = [[FCModelIdentityMap alloc] initWithIntegerPrimaryKeys:(primaryKeyInfo.type == FCModelFieldTypeInteger)];
+        }];
+        g_identityMaps = [identityMaps copy];
+        g_tablesWithRowIDPrimaryKeys = [tablesWithRowIDPrimaryKeys copy];
+
+        g_rowChangeLog = [FCModelRowChangeLog new];
+        void *rowChangeLogContext = (__bridge void *) g_rowChangeLog;
+        sqlite3_update_hook(db.sqliteHandle, rowChangeLogUpdateHook, rowChangeLogContext);
+        sqlite3_rollback_hook(db.sqliteHandle, rowChangeLogRollbackHook, rowChangeLogContext);
     }];
     
     [g_databaseQueue startMonitoringForExternalChanges];
@@ -1295,24 +3066,35 @@ static inline BOOL checkForOpenDatabaseFatal(BOOL fatal)
 {
     if (! g_databaseQueue) return YES;
     
-    [NSThread.currentThread.threadDictionary removeObjectsForKeys:@[ FCModelEnqueuedBatchNotificationsKey, FCModelEnqueuedBatchChangedFieldsKey ]];
+    [NSThread.currentThread.threadDictionary removeObjectsForKeys:@[ FCModelEnqueuedBatchNotificationsKey, FCModelEnqueuedBatchChangedFieldsKey, FCModelEnqueuedBatchChangesKey ]];
+    [self takeCoalescedNotifications:NULL changes:NULL];
     [FCModelCachedObject clearCache];
 
     __block BOOL modelsAreStillLoaded = NO;
-    dispatch_semaphore_wait(g_instancesReadLock, DISPATCH_TIME_FOREVER);
-    [g_instances enumerateKeysAndObjectsUsingBlock:^(Class class, NSMapTable *classInstances, BOOL *stop) {
-        for (id primaryKeyValue in classInstances.keyEnumerator.allObjects) {
+    [g_identityMaps enumerateKeysAndObjectsUsingBlock:^(Class class, FCModelIdentityMap *identityMap, BOOL *stop) {
+        for (FCModel *instance in identityMap.allInstances) {
             modelsAreStillLoaded = YES;
-            NSLog(@"[FCModel] closeDatabase: %@ ID %@ is still retained by something and is being abandoned by FCModel. This can cause weird bugs. Don't let this happen.", NSStringFromClass(class), primaryKeyValue);
+            NSLog(@"[FCModel] closeDatabase: %@ ID %@ is still retained by something and is being abandoned by FCModel. This can cause weird bugs. Don't let this happen.", NSStringFromClass(class), instance.primaryKey);
         }
+        [identityMap removeAllInstances];
     }];
-    [g_instances removeAllObjects];
-    dispatch_semaphore_signal(g_instancesReadLock);
 
+    [g_databaseQueue writeDatabase:^(FMDatabase *db) {
+        sqlite3_update_hook(db.sqliteHandle, NULL, NULL);
+        sqlite3_rollback_hook(db.sqliteHandle, NULL, NULL);
+    }];
     [g_databaseQueue close];
     g_databaseQueue = nil;
+    g_rowChangeLog = nil;
     g_primaryKeyFieldName = nil;
     g_fieldInfo = nil;
+    g_fieldNamesByIndex = nil;
+    g_classesTrackingSetters = nil;
+    g_lazilyDecodedFieldNames = nil;
+    g_fieldCodecs = nil;
+    g_rowDecoders = nil;
+    g_identityMaps = nil;
+    g_tablesWithRowIDPrimaryKeys = nil;
     g_ignoredFieldNames = nil;
     g_tablesUsingAutoIncrementEmulation = nil;
     
@@ -1324,7 +3106,12 @@ static inline BOOL checkForOpenDatabaseFatal(BOOL fatal)
 + (void)inDatabaseSync:(void (^)(FMDatabase *db))block
 {
     checkForOpenDatabaseFatal(YES);
-    [g_databaseQueue readDatabase:block];
+
+    __block BOOL allChangesCaptured = NO;
+    [g_databaseQueue inDatabase:^(FMDatabase *db) {
+        allChangesCaptured = [self captureRowChangesInDatabase:db block:^{ block(db); }];
+    }];
+    [self reloadCapturedRowChanges:allChangesCaptured];
 }
 
 #pragma mark - Batch notification queuing
@@ -1337,6 +3124,7 @@ static inline BOOL checkForOpenDatabaseFatal(BOOL fatal)
     
     thread.threadDictionary[FCModelEnqueuedBatchNotificationsKey] = [NSMutableDictionary dictionary];
     thread.threadDictionary[FCModelEnqueuedBatchChangedFieldsKey] = [NSMutableDictionary dictionary];
+    thread.threadDictionary[FCModelEnqueuedBatchChangesKey] = [NSMutableArray array];
 }
 
 + (void)_endNotificationBatchForThread:(NSThread *)thread sendNotifications:(BOOL)sendQueuedNotifications
@@ -1345,39 +3133,157 @@ static inline BOOL checkForOpenDatabaseFatal(BOOL fatal)
 
     NSDictionary *notificationsToSend = sendQueuedNotifications ? [thread.threadDictionary[FCModelEnqueuedBatchNotificationsKey] copy] : nil;
     NSDictionary *changedFields = sendQueuedNotifications ? [thread.threadDictionary[FCModelEnqueuedBatchChangedFieldsKey] copy] : nil;
-    [thread.threadDictionary removeObjectsForKeys:@[ FCModelEnqueuedBatchNotificationsKey, FCModelEnqueuedBatchChangedFieldsKey ]];
+    NSArray *changes = sendQueuedNotifications ? [thread.threadDictionary[FCModelEnqueuedBatchChangesKey] copy] : nil;
+    [thread.threadDictionary removeObjectsForKeys:@[ FCModelEnqueuedBatchNotificationsKey, FCModelEnqueuedBatchChangedFieldsKey, FCModelEnqueuedBatchChangesKey ]];
     
-    if (sendQueuedNotifications && notificationsToSend.count) {
-        onMainThreadAsync(^{
-            NSComparator notificationComparator = ^(NSString *left, NSString *right) {
-                NSComparisonResult result = [left compare:right];
-
-                if (result != NSOrderedSame) {
-                    if ([left isEqualToString:FCModelAnyChangeNotification]) {
-                        result = NSOrderedDescending;
-                    } else if ([right isEqualToString:FCModelAnyChangeNotification]) {
-                        result = NSOrderedAscending;
-                    } else if ([left isEqualToString:FCModelWillSendAnyChangeNotification]) {
-                        result = NSOrderedAscending;
-                    } else if ([right isEqualToString:FCModelWillSendAnyChangeNotification]) {
-                        result = NSOrderedDescending;
-                    }
-                }
+    if (sendQueuedNotifications && notificationsToSend.count) [self deliverBatchedNotifications:notificationsToSend changedFields:changedFields changes:changes];
+}
+
+// Posts a batch's notifications, one per class and name: WillSendAnyChange first, AnyChange last. Then its change records.
++ (void)deliverBatchedNotifications:(NSDictionary *)notificationsToSend changedFields:(NSDictionary *)changedFields changes:(NSArray *)changes
+{
+    void (^postNotification)(Class, NSString *) = ^(Class class, NSString *key) {
+        // NSNull stands in for class-wide changes that didn't name an instance
+        NSSet *instances = notificationsToSend[class][key];
+        BOOL unidentifiedRowsChanged = [instances containsObject:NSNull.null];
+        if (unidentifiedRowsChanged) instances = [instances objectsPassingTest:^BOOL(id instance, BOOL *stop) { return instance != NSNull.null; }];
+        [NSNotificationCenter.defaultCenter postNotificationName:key object:class userInfo:(unidentifiedRowsChanged ? @{
+            FCModelInstanceSetKey : instances,
+            FCModelChangedFieldsKey : changedFields[class],
+            FCModelUnidentifiedRowsChangedKey : @YES
+        } : @{
+            FCModelInstanceSetKey : instances,
+            FCModelChangedFieldsKey : changedFields[class]
+        })];
+    };
 
-                return result;
-            };
+    BOOL cachedObjectsInvalidated = notificationsWaitForDatabaseQueue();
+    if (cachedObjectsInvalidated) {
+        [notificationsToSend enumerateKeysAndObjectsUsingBlock:^(Class class, NSDictionary *notificationsForClass, BOOL *stop) {
+            if (notificationsForClass[FCModelWillSendAnyChangeNotification]) postNotification(class, FCModelWillSendAnyChangeNotification);
+        }];
+    }
 
-            [notificationsToSend enumerateKeysAndObjectsUsingBlock:^(Class class, NSDictionary *notificationsForClass, BOOL *stopOuter) {
-                NSArray *keys = [notificationsForClass.allKeys sortedArrayUsingComparator:notificationComparator];
-                for (NSString *key in keys) {
-                    [NSNotificationCenter.defaultCenter postNotificationName:key object:class userInfo:@{
-                        FCModelInstanceSetKey : notificationsForClass[key],
-                        FCModelChangedFieldsKey : changedFields[class]
-                    }];
+    onNotificationQueue(^{
+        NSComparator notificationComparator = ^(NSString *left, NSString *right) {
+            NSComparisonResult result = [left compare:right];
+
+            if (result != NSOrderedSame) {
+                if ([left isEqualToString:FCModelAnyChangeNotification]) {
+                    result = NSOrderedDescending;
+                } else if ([right isEqualToString:FCModelAnyChangeNotification]) {
+                    result = NSOrderedAscending;
+                } else if ([left isEqualToString:FCModelWillSendAnyChangeNotification]) {
+                    result = NSOrderedAscending;
+                } else if ([right isEqualToString:FCModelWillSendAnyChangeNotification]) {
+                    result = NSOrderedDescending;
                 }
-            }];
+            }
+
+            return result;
+        };
+
+        [notificationsToSend enumerateKeysAndObjectsUsingBlock:^(Class class, NSDictionary *notificationsForClass, BOOL *stopOuter) {
+            NSArray *keys = [notificationsForClass.allKeys sortedArrayUsingComparator:notificationComparator];
+            for (NSString *key in keys) {
+                if (cachedObjectsInvalidated && [key isEqualToString:FCModelWillSendAnyChangeNotification]) continue;
+                postNotification(class, key);
+            }
+        }];
+
+        [FCModel deliverChanges:changes];
+    });
+}
+
++ (void)setNotificationDeliveryQueue:(dispatch_queue_t)queue
+{
+    if (g_databaseQueue) [[NSException exceptionWithName:NSInternalInconsistencyException reason:@"The notification delivery queue must be set while the database is closed" userInfo:nil] raise];
+
+    if (queue && queue != dispatch_get_main_queue()) dispatch_queue_set_specific(queue, FCModelNotificationQueueKey, (__bridge void *) queue, NULL);
+    dispatch_semaphore_wait(g_notificationQueueLock, DISPATCH_TIME_FOREVER);
+    g_notificationQueue = queue;
+    g_notificationsDeliveredSynchronously = ! queue;
+    dispatch_semaphore_signal(g_notificationQueueLock);
+}
+
+#pragma mark - Cross-thread notification coalescing
+
++ (void)setNotificationCoalescingInterval:(NSTimeInterval)interval maximumCount:(NSUInteger)maximumCount
+{
+    dispatch_semaphore_wait(g_coalescingLock, DISPATCH_TIME_FOREVER);
+    g_coalescingInterval = MAX(0, interval);
+    g_coalescingMaximumCount = maximumCount;
+    dispatch_semaphore_signal(g_coalescingLock);
+
+    if (interval <= 0) [self flushCoalescedNotifications];
+}
+
+// Returns NO if coalescing is off and the caller should post the notification itself
++ (BOOL)coalesceNotification:(NSString *)name changedFields:(NSSet *)changedFields instance:(FCModel *)instance change:(FCModelChange *)change
+{
+    dispatch_semaphore_wait(g_coalescingLock, DISPATCH_TIME_FOREVER);
+    NSTimeInterval interval = g_coalescingInterval;
+    if (interval <= 0) {
+        dispatch_semaphore_signal(g_coalescingLock);
+        return NO;
+    }
+
+    BOOL startedWindow = NO;
+    if (! g_coalescedNotifications) {
+        g_coalescedNotifications = [NSMutableDictionary dictionary];
+        g_coalescedChangedFields = [NSMutableDictionary dictionary];
+        g_coalescedChanges = [NSMutableArray array];
+        startedWindow = YES;
+    }
+    enqueueBatchedNotification(g_coalescedNotifications, g_coalescedChangedFields, g_coalescedChanges, self, name, changedFields, instance, change);
+
+    // Each change's notifications end with FCModelAnyChangeNotification, so counting only those never splits one change's
+    //  notifications across windows
+    if ([name isEqualToString:FCModelAnyChangeNotification]) g_coalescedCount++;
+    BOOL full = g_coalescingMaximumCount && g_coalescedCount >= g_coalescingMaximumCount;
+    uint64_t window = g_coalescingWindow;
+    dispatch_semaphore_signal(g_coalescingLock);
+
+    if (full) {
+        [self flushCoalescedNotifications];
+    } else if (startedWindow) {
+        dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t) (interval * NSEC_PER_SEC)), dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+            NSDictionary *changedFields;
+            NSArray *changes;
+            NSDictionary *notifications = nil;
+            dispatch_semaphore_wait(g_coalescingLock, DISPATCH_TIME_FOREVER);
+            BOOL current = (window == g_coalescingWindow);
+            dispatch_semaphore_signal(g_coalescingLock);
+            if (current) notifications = [self takeCoalescedNotifications:&changedFields changes:&changes];
+            if (notifications.count) [self deliverBatchedNotifications:notifications changedFields:changedFields changes:changes];
         });
     }
+    return YES;
+}
+
+// Ends the pending window, returning its notifications (or nil), their changed fields, and its change records
++ (NSDictionary *)takeCoalescedNotifications:(NSDictionary **)changedFieldsOut changes:(NSArray **)changesOut
+{
+    if (! g_coalescingLock) return nil;
+    dispatch_semaphore_wait(g_coalescingLock, DISPATCH_TIME_FOREVER);
+    NSDictionary *notifications = g_coalescedNotifications;
+    if (changedFieldsOut) *changedFieldsOut = g_coalescedChangedFields;
+    if (changesOut) *changesOut = g_coalescedChanges;
+    g_coalescedNotifications = nil;
+    g_coalescedChangedFields = nil;
+    g_coalescedChanges = nil;
+    g_coalescedCount = 0;
+    g_coalescingWindow++;
+    dispatch_semaphore_signal(g_coalescingLock);
+    return notifications;
+}
+
++ (void)flushCoalescedNotifications
+{
+    NSDictionary *changedFields;
+    NSArray *changes;
+    NSDictionary *notifications = [self takeCoalescedNotifications:&changedFields changes:&changes];
+    if (notifications.count) [self deliverBatchedNotifications:notifications changedFields:changedFields changes:changes];
 }
 
 + (BOOL)isBatchingNotificationsForCurrentThread { return NSThread.currentThread.threadDictionary[FCModelEnqueuedBatchNotificationsKey] != nil; }
@@ -1393,44 +3299,139 @@ static inline BOOL checkForOpenDatabaseFatal(BOOL fatal)
 
 + (void)postChangeNotification:(NSString *)name changedFields:(NSSet *)changedFields instance:(FCModel *)instance sourceThread:(NSThread *)thread
 {
+    FCModelTransactionFrame *transactionFrame = currentTransactionFrame(thread);
+    if (transactionFrame) {
+        [transactionFrame.deferredActions addObject:^(NSThread *callingThread) {
+            [self postChangeNotification:name changedFields:changedFields instance:instance sourceThread:callingThread];
+        }];
+        return;
+    }
+
     BOOL enqueued = NO;
+    FCModelChange *change = [self changeForNotification:name changedFields:changedFields instance:instance];
     
     NSMutableDictionary *enqueuedBatchNotifications = thread.threadDictionary[FCModelEnqueuedBatchNotificationsKey];
     if (enqueuedBatchNotifications) {
-        id class = (id) self;
-        NSMutableDictionary *notificationsForClass = enqueuedBatchNotifications[class];
-        if (! notificationsForClass) {
-            notificationsForClass = [NSMutableDictionary dictionary];
-            enqueuedBatchNotifications[class] = notificationsForClass;
-        }
-
-        NSMutableDictionary *enqueuedBatchChangedFields = thread.threadDictionary[FCModelEnqueuedBatchChangedFieldsKey];
-        NSMutableSet *changedFieldsForClass = enqueuedBatchChangedFields[class];
-        if (! changedFieldsForClass) {
-            changedFieldsForClass = [NSMutableSet set];
-            enqueuedBatchChangedFields[class] = changedFieldsForClass;
-        }
-        [changedFieldsForClass unionSet:changedFields];
-        
-        NSMutableSet *instancesForNotification = notificationsForClass[name];
-        if (instancesForNotification) {
-            if (instance) [instancesForNotification addObject:instance];
-        } else {
-            instancesForNotification = instance ? [NSMutableSet setWithObject:instance] : [NSMutableSet set];
-            notificationsForClass[name] = instancesForNotification;
-        }
-
+        enqueueBatchedNotification(enqueuedBatchNotifications, thread.threadDictionary[FCModelEnqueuedBatchChangedFieldsKey], thread.threadDictionary[FCModelEnqueuedBatchChangesKey], self, name, changedFields, instance, change);
         enqueued = YES;
+    } else if (! [name isEqualToString:FCModelWillSendAnyChangeNotification]) {
+        // WillSendAnyChange invalidates cached objects, so it's never held back
+        enqueued = [self coalesceNotification:name changedFields:changedFields instance:instance change:change];
     }
     
     if (! enqueued) {
-        onMainThreadAsync(^{
-            [NSNotificationCenter.defaultCenter postNotificationName:name object:self.class userInfo:@{
-                FCModelInstanceSetKey : instance ? [NSSet setWithObject:instance] : [NSSet setWithArray:self.allLoadedInstances],
+        void (^post)() = ^{
+            [NSNotificationCenter.defaultCenter postNotificationName:name object:self.class userInfo:(instance ? @{
+                FCModelInstanceSetKey : [NSSet setWithObject:instance],
                 FCModelChangedFieldsKey : changedFields
-            }];
-        });
+            } : @{
+                FCModelInstanceSetKey : [NSSet setWithArray:self.allLoadedInstances],
+                FCModelChangedFieldsKey : changedFields,
+                FCModelUnidentifiedRowsChangedKey : @YES
+            })];
+            if (change) [FCModel deliverChanges:@[ change ]];
+        };
+
+        if ([name isEqualToString:FCModelWillSendAnyChangeNotification] && notificationsWaitForDatabaseQueue()) post();
+        else onNotificationQueue(post);
+    }
+}
+
+#pragma mark - Change subscriptions
+
++ (id)subscribeToChangesWithPrimaryKey:(id)primaryKey fieldNames:(NSArray *)fieldNames block:(void (^)(NSArray *changes))block
+{
+    // Matched by equality against changes' primary keys, so e.g. @"1" has to become @1 like it would for instanceWithPrimaryKey:
+    primaryKey = [self normalizedPrimaryKeyValue:primaryKey];
+
+    FCModelChangeSubscription *subscription = [FCModelChangeSubscription new];
+    subscription.modelClass = self;
+    subscription.primaryKey = primaryKey;
+    subscription.fieldNames = [fieldNames copy];
+    subscription.block = block;
+
+    dispatch_semaphore_wait(g_changeSubscriptionsLock, DISPATCH_TIME_FOREVER);
+    if (! g_changeSubscriptions) g_changeSubscriptions = [NSMutableDictionary dictionary];
+    id class = (id) self;
+    FCModelChangeSubscriptionList *list = g_changeSubscriptions[class];
+    if (! list) list = g_changeSubscriptions[class] = [FCModelChangeSubscriptionList new];
+
+    if (primaryKey) {
+        NSMutableArray *subscriptionsForRow = list.subscriptionsByPrimaryKey[primaryKey];
+        if (! subscriptionsForRow) subscriptionsForRow = list.subscriptionsByPrimaryKey[primaryKey] = [NSMutableArray array];
+        [subscriptionsForRow addObject:subscription];
+    } else {
+        [list.subscriptionsForAllRows addObject:subscription];
+    }
+    dispatch_semaphore_signal(g_changeSubscriptionsLock);
+
+    return subscription;
+}
+
++ (void)removeChangeSubscription:(FCModelChangeSubscription *)subscription
+{
+    if (! subscription) return;
+
+    dispatch_semaphore_wait(g_changeSubscriptionsLock, DISPATCH_TIME_FOREVER);
+    id class = (id) subscription.modelClass;
+    FCModelChangeSubscriptionList *list = g_changeSubscriptions[class];
+    if (subscription.primaryKey) {
+        NSMutableArray *subscriptionsForRow = list.subscriptionsByPrimaryKey[subscription.primaryKey];
+        [subscriptionsForRow removeObjectIdenticalTo:subscription];
+        if (! subscriptionsForRow.count) [list.subscriptionsByPrimaryKey removeObjectForKey:subscription.primaryKey];
+    } else {
+        [list.subscriptionsForAllRows removeObjectIdenticalTo:subscription];
+    }
+    if (list && ! list.subscriptionsForAllRows.count && ! list.subscriptionsByPrimaryKey.count) [g_changeSubscriptions removeObjectForKey:class];
+    dispatch_semaphore_signal(g_changeSubscriptionsLock);
+}
+
++ (uint64_t)changeMaskForFieldNames:(NSArray *)fieldNames { return checkForOpenDatabaseFatal(NO) ? changeMaskForFieldNames(self, fieldNames) : 0; }
+
+// The record subscriptions get for a notification, or nil if it doesn't make one or nothing subscribes to this class.
+//  Only the insert, update, and delete notifications and the class-wide AnyChange make records.
++ (FCModelChange *)changeForNotification:(NSString *)name changedFields:(NSSet *)changedFields instance:(FCModel *)instance
+{
+    FCModelChangeOperation operation;
+    if (! instance) {
+        if (! [name isEqualToString:FCModelAnyChangeNotification]) return nil;
+        operation = FCModelChangeUnidentifiedRows;
+    } else if ([name isEqualToString:FCModelUpdateNotification]) {
+        operation = FCModelChangeUpdate;
+    } else if ([name isEqualToString:FCModelInsertNotification]) {
+        operation = FCModelChangeInsert;
+    } else if ([name isEqualToString:FCModelDeleteNotification]) {
+        operation = FCModelChangeDelete;
+    } else {
+        return nil;
+    }
+
+    dispatch_semaphore_wait(g_changeSubscriptionsLock, DISPATCH_TIME_FOREVER);
+    BOOL subscribed = g_changeSubscriptions[(id) self] || g_changeSubscriptions[(id) FCModel.class];
+    dispatch_semaphore_signal(g_changeSubscriptionsLock);
+    if (! subscribed) return nil;
+
+    return [[FCModelChange alloc] initWithModelClass:self operation:operation primaryKey:instance.primaryKey changedFieldMask:(
+        operation == FCModelChangeUnidentifiedRows ? UINT64_MAX : changeMaskForFieldNames(self, changedFields)
+    )];
+}
+
+// Called on the notification queue. Each matching subscription's block gets its records in one call.
++ (void)deliverChanges:(NSArray *)changes
+{
+    if (! changes.count) return;
+
+    NSMutableArray *subscriptions = [NSMutableArray array];
+    NSMapTable *changesBySubscription = [NSMapTable strongToStrongObjectsMapTable];
+    dispatch_semaphore_wait(g_changeSubscriptionsLock, DISPATCH_TIME_FOREVER);
+    FCModelChangeSubscriptionList *allClassesList = g_changeSubscriptions[(id) FCModel.class];
+    for (FCModelChange *change in changes) {
+        [g_changeSubscriptions[(id) change.modelClass] addSubscriptionsForChange:change toList:subscriptions changesBySubscription:changesBySubscription];
+        if (change.modelClass != FCModel.class) [allClassesList addSubscriptionsForChange:change toList:subscriptions changesBySubscription:changesBySubscription];
     }
+    dispatch_semaphore_signal(g_changeSubscriptionsLock);
+
+    for (FCModelChangeSubscription *subscription in subscriptions) subscription.block([changesBySubscription objectForKey:subscription]);
 }
 
 @end
@@ -7,14 +7,54 @@
 
 #import <Foundation/Foundation.h>
 
+typedef struct {
+    uint64_t hits;          // value reads answered by a current cached result
+    uint64_t misses;        // value reads that ran the generator
+    uint64_t evictions;     // entries dropped to stay within the limits
+    uint64_t invalidations; // current results discarded because their data changed
+    NSUInteger entryCount;
+    NSUInteger estimatedByteCount;
+} FCModelCacheStatistics;
+
 @interface FCModelCachedObject : NSObject
 
 + (instancetype)objectWithModelClass:(Class)fcModelClass cacheIdentifier:(id)identifier ignoreFieldsForInvalidation:(NSSet *)ignoredFields generator:(id (^)(void))generatorBlock;
 
+// Safe to read from any thread. When there's no current value, concurrent readers share a single run of the generator.
 @property (readonly) id value;
 
+// If set, reads after an invalidation return the previous value immediately while the generator refreshes it in the
+//  background, rather than waiting for it. Memory warnings still discard the previous value.
+// This is a property of the shared cached object, so it applies to every reader of its identifier.
+@property (atomic) BOOL servesStaleValueWhileRegenerating;
+
 + (void)clearCache;
 
+// Cache limits, globally or for one model class. 0 means unlimited, the default.
+//
+// Over a limit, the least recently read entries are evicted (approximately, using the CLOCK algorithm). Evicted objects that
+//  are still referenced keep working, but later requests for the same identifier get a new object and regenerate the value.
+// Byte counts are estimates: the sizes of the generated value's objects, strings, data, and collection members.
++ (void)setMaximumEntryCount:(NSUInteger)maxEntries estimatedByteCount:(NSUInteger)maxBytes;
++ (void)setMaximumEntryCount:(NSUInteger)maxEntries estimatedByteCount:(NSUInteger)maxBytes forModelClass:(Class)fcModelClass;
+
+// Counters accumulate for the life of the process. clearCache resets only the entry and byte counts.
++ (FCModelCacheStatistics)cacheStatistics;
++ (FCModelCacheStatistics)cacheStatisticsForModelClass:(Class)fcModelClass;
+
+@end
+
+
+// Index-level differences between two results of an FCModelLiveResultArray, e.g. for table- or collection-view batch updates.
+// Moved objects are reported as a deletion and an insertion.
+
+@interface FCModelLiveResultArrayChanges : NSObject
+
+@property (nonatomic, readonly) NSIndexSet *deletedIndexes;  // in the previous result
+@property (nonatomic, readonly) NSIndexSet *insertedIndexes; // in the new result
+@property (nonatomic, readonly) NSIndexSet *updatedIndexes;  // in the new result: same objects in the same order, with changed values
+@property (nonatomic, readonly) BOOL hasChanges;
+
 @end
 
 
@@ -24,10 +64,19 @@
 //
 // Enumeration and indexed subscript access are intentionally omitted since the array can be invalidated or change from under you at any time.
 // Please use allObjects, which gives an immutable snapshot copy, for array access.
+//
+// Results are kept up to date incrementally: when specific instances change, only their rows are checked against the query
+//  and spliced in or out. Queries with ORDER BY, LIMIT, or GROUP BY, and changes that don't name their instances (e.g.
+//  dataWasUpdatedExternally), re-read only the matching primary keys and diff them against the current result.
+// Changes to fields that the query doesn't read (found with an authorizer when the query is first prepared) can't add or
+//  remove rows or reorder them, so they're reported as updates without any query.
 
 @interface FCModelLiveResultArray : NSObject
 
 + (instancetype)arrayWithModelClass:(Class)fcModelClass queryAfterWHERE:(NSString *)query arguments:(NSArray *)arguments ignoreFieldsForInvalidation:(NSSet *)ignoredFields;
 - (NSArray *)allObjects;
 
+// Also returns what changed since this array's previous allObjectsWithChanges: call (everything is inserted on the first call).
+- (NSArray *)allObjectsWithChanges:(FCModelLiveResultArrayChanges **)outChanges;
+
 @end
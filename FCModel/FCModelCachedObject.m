@@ -7,21 +7,202 @@
 
 #import "FCModelCachedObject.h"
 #import "FCModel.h"
+#import <objc/runtime.h>
+#import <pthread.h>
+#import <stdatomic.h>
+
+// Memory warnings only exist with UIKit. Elsewhere, e.g. on OS X or Linux, the cache limits are the only thing that evicts.
+#if defined(__APPLE__)
+#import <TargetConditionals.h>
+#endif
+#if TARGET_OS_IPHONE && defined(__has_include)
+#if __has_include(<UIKit/UIKit.h>)
+#import <UIKit/UIKit.h>
+#define FCModelObservesMemoryWarnings 1
+#endif
+#endif
+#ifndef FCModelObservesMemoryWarnings
+#define FCModelObservesMemoryWarnings 0
+#endif
 
 // FCModelCachedObject has its own notification that runs BEFORE the other FCModel change notifications
 //  so it can remove stale data before any application actions fetch new data in response to the change.
 extern NSString * const FCModelWillSendAnyChangeNotification;
+extern NSString * const FCModelUnidentifiedRowsChangedKey;
+
+@interface FCModel (FCModelLiveResult)
++ (NSSet *)fieldNamesReadByQueryAfterWHERE:(NSString *)queryAfterWHERE;
++ (NSUInteger)maximumQueryParameterCount;
+@end
+
+#pragma mark - Cache accounting
+
+// Limits, sizes, and counters for one model class's cached objects, or for all of them
+@interface FCModelCacheState : NSObject {
+@public
+    NSUInteger maximumEntryCount, maximumByteCount; // 0 = unlimited
+    NSUInteger entryCount, byteCount;
+    _Atomic(int64_t) hits, misses, evictions, invalidations; // only statistics, so updated with relaxed ordering
+}
+- (BOOL)isOverLimit;
+- (FCModelCacheStatistics)statistics;
+@end
+
+static inline void incrementCounter(_Atomic(int64_t) *counter) { atomic_fetch_add_explicit(counter, 1, memory_order_relaxed); }
+static inline uint64_t counterValue(_Atomic(int64_t) *counter) { return (uint64_t) atomic_load_explicit(counter, memory_order_relaxed); }
+
+@implementation FCModelCacheState
+
+- (BOOL)isOverLimit
+{
+    return (maximumEntryCount && entryCount > maximumEntryCount) || (maximumByteCount && byteCount > maximumByteCount);
+}
+
+- (FCModelCacheStatistics)statistics
+{
+    return (FCModelCacheStatistics) {
+        .hits = counterValue(&hits), .misses = counterValue(&misses), .evictions = counterValue(&evictions), .invalidations = counterValue(&invalidations),
+        .entryCount = entryCount, .estimatedByteCount = byteCount,
+    };
+}
+
+@end
+
+// Rough retained size of a generated value: object sizes, string and data contents, and collection members two levels deep
+static NSUInteger estimatedByteCountOfObject(id object, int depth)
+{
+    if (! object || object == NSNull.null) return 0;
+    NSUInteger bytes = class_getInstanceSize(object_getClass(object));
+    if ([object isKindOfClass:NSData.class]) {
+        bytes += ((NSData *) object).length;
+    } else if ([object isKindOfClass:NSString.class]) {
+        bytes += ((NSString *) object).length * sizeof(unichar);
+    } else if ([object isKindOfClass:NSDictionary.class]) {
+        bytes += ((NSDictionary *) object).count * 2 * sizeof(id);
+        if (depth < 2) {
+            [(NSDictionary *) object enumerateKeysAndObjectsUsingBlock:^(id key, id value, BOOL *stop) {
+                bytes += estimatedByteCountOfObject(key, depth + 1) + estimatedByteCountOfObject(value, depth + 1);
+            }];
+        }
+    } else if ([object conformsToProtocol:@protocol(NSFastEnumeration)] && [object respondsToSelector:@selector(count)]) {
+        bytes += [object count] * sizeof(id);
+        if (depth < 2) for (id member in object) bytes += estimatedByteCountOfObject(member, depth + 1);
+    }
+    return bytes;
+}
+
+
+#pragma mark - Cache keys
+
+// Fibonacci hashing: multiplying by 2^N / golden ratio spreads pointers and weak hashes over the high bits of an NSUInteger
+#if __LP64__
+#define FCModelFibonacciHashMultiplier 0x9E3779B97F4A7C15UL
+#else
+#define FCModelFibonacciHashMultiplier 0x9E3779B9U
+#endif
+
+// A cached object's model class and identifier, with its hash computed once. Array identifiers, such as
+//  FCModelLiveResult's query and arguments, hash their members, since NSArray's own hash is only its count.
+@interface FCModelCacheKey : NSObject <NSCopying> {
+@public
+    __unsafe_unretained Class modelClass;
+    id identifier;
+    NSUInteger precomputedHash;
+}
++ (instancetype)keyWithModelClass:(Class)fcModelClass identifier:(id)identifier;
+@end
+
+static NSUInteger cacheIdentifierHash(id identifier)
+{
+    if (! [identifier isKindOfClass:NSArray.class]) return [identifier hash];
+    NSUInteger hash = [identifier count];
+    for (id member in identifier) hash = hash * 31 + cacheIdentifierHash(member);
+    return hash;
+}
+
+@implementation FCModelCacheKey
+
++ (instancetype)keyWithModelClass:(Class)fcModelClass identifier:(id)identifier
+{
+    FCModelCacheKey *key = [self new];
+    key->modelClass = fcModelClass;
+    key->identifier = identifier;
+    key->precomputedHash = cacheIdentifierHash(identifier) ^ (((NSUInteger) fcModelClass) * (NSUInteger) FCModelFibonacciHashMultiplier);
+    return key;
+}
+
+- (id)copyWithZone:(NSZone *)zone { return self; }
+- (NSUInteger)hash { return precomputedHash; }
+
+- (BOOL)isEqual:(id)object
+{
+    if (object == self) return YES;
+    if (! [object isKindOfClass:FCModelCacheKey.class]) return NO;
+    FCModelCacheKey *key = (FCModelCacheKey *) object;
+    return key->precomputedHash == precomputedHash && key->modelClass == modelClass && [key->identifier isEqual:identifier];
+}
+
+@end
+
+
+#pragma mark - FCModelCachedObject private interface
+
+@interface FCModelCachedObject ()
+
+@property (nonatomic) Class modelClass;
+@property (nonatomic, copy) id (^generator)(void);
+@property (nonatomic) BOOL currentResultIsValid;
+@property (nonatomic) id currentResult;
+@property (nonatomic) NSSet *ignoredFieldsForInvalidation;
+
+// Guards the result state above and below. The generator, and in-place updates of a valid result, run outside of it, once at
+//  a time: concurrent reads that find no current result, or one being updated, wait on generationGroup and share its result.
+@property (nonatomic, readonly) dispatch_semaphore_t resultLock;
+@property (nonatomic) dispatch_group_t generationGroup; // non-nil while the generator or an update runs
+@property (nonatomic) uint64_t resultVersion;           // incremented by every invalidation, so a racing generation isn't kept
+@property (nonatomic) uint64_t generationResultVersion;
+@property (nonatomic) BOOL currentResultIsStale;        // invalid, but kept to serve while regenerating
+
+// Managed by FCModelGeneratedObjectCache on its queue, except referenced, which value sets from any thread
+@property (nonatomic) FCModelCacheKey *cacheKey;
+@property (nonatomic) FCModelCacheState *cacheState;
+@property (nonatomic) BOOL cached;
+@property (nonatomic) NSUInteger accountedByteCount;
+@property (atomic) BOOL referenced;
+
+- (void)dataSourceChanged:(NSNotification *)n;
+- (void)flush:(NSNotification *)n;
+- (id)takePendingUpdate;
+- (id)resultByApplyingUpdate:(id)update toResult:(id)result;
+
+@end
+
 
 #pragma mark - Global cache
 
-@interface FCModelGeneratedObjectCache : NSObject
-@property (nonatomic) NSMutableDictionary *cache;
+#define FCModelGeneratedObjectCacheStripeCount 16
+
+// Lookups only lock one of several stripes, chosen by the key's hash, so cache hits on different threads rarely wait on each
+//  other. Inserts, evictions, and accounting are serialized on cacheQueue, which takes the stripe locks it needs.
+//
+// Cached objects are evicted with the CLOCK algorithm: reading a value sets its referenced bit, and when a limit is exceeded,
+//  the hand sweeps the entries in insertion order, clearing set bits and evicting the first entry found without one.
+@interface FCModelGeneratedObjectCache : NSObject {
+    pthread_mutex_t stripeLocks[FCModelGeneratedObjectCacheStripeCount];
+    NSMutableDictionary *stripeObjects[FCModelGeneratedObjectCacheStripeCount]; // FCModelCacheKey -> FCModelCachedObject
+}
 @property (nonatomic) dispatch_queue_t cacheQueue;
+@property (nonatomic) NSMutableDictionary *classStates;
+@property (nonatomic) FCModelCacheState *totals;
+@property (nonatomic) NSMutableArray *clockEntries;
+@property (nonatomic) NSUInteger clockHand;
 
 + (instancetype)sharedInstance;
 - (void)clear:(id)sender;
-- (FCModelCachedObject *)objectWithModelClass:(Class)fcModelClass identifier:(id)identifier;
-- (void)saveObject:(FCModelCachedObject *)obj class:(Class)fcModelClass identifier:(id)identifier;
+- (FCModelCachedObject *)objectWithModelClass:(Class)fcModelClass identifier:(id)identifier creator:(FCModelCachedObject *(^)(void))creator;
+- (void)updateEstimatedByteCount:(NSUInteger)byteCount ofObject:(FCModelCachedObject *)obj;
+- (void)setMaximumEntryCount:(NSUInteger)maxEntries byteCount:(NSUInteger)maxBytes forModelClass:(Class)fcModelClass;
+- (FCModelCacheStatistics)statisticsForModelClass:(Class)fcModelClass;
 
 @end
 
@@ -41,8 +222,14 @@ extern NSString * const FCModelWillSendAnyChangeNotification;
 {
     if ( (self = [super init]) ) {
         self.cacheQueue = dispatch_queue_create("FCModelGeneratedObjectCache", NULL);
-        self.cache = [NSMutableDictionary dictionary];
-#if TARGET_OS_IPHONE
+        for (int stripe = 0; stripe < FCModelGeneratedObjectCacheStripeCount; stripe++) {
+            pthread_mutex_init(&stripeLocks[stripe], NULL);
+            stripeObjects[stripe] = [NSMutableDictionary dictionary];
+        }
+        self.classStates = [NSMutableDictionary dictionary];
+        self.totals = [FCModelCacheState new];
+        self.clockEntries = [NSMutableArray array];
+#if FCModelObservesMemoryWarnings
         [NSNotificationCenter.defaultCenter addObserver:self selector:@selector(clear:) name:UIApplicationDidReceiveMemoryWarningNotification object:nil];
 #endif
     }
@@ -53,54 +240,159 @@ extern NSString * const FCModelWillSendAnyChangeNotification;
 {
     [NSNotificationCenter.defaultCenter removeObserver:self];
     [self clear:nil];
+    for (int stripe = 0; stripe < FCModelGeneratedObjectCacheStripeCount; stripe++) pthread_mutex_destroy(&stripeLocks[stripe]);
 }
 
+// The top 4 bits, for 16 stripes
+static inline NSUInteger cacheStripe(FCModelCacheKey *key) { return (key->precomputedHash * (NSUInteger) FCModelFibonacciHashMultiplier) >> (sizeof(NSUInteger) * 8 - 4); }
+
 - (void)clear:(id)sender
 {
     dispatch_sync(self.cacheQueue, ^{
-        [self.cache removeAllObjects];
+        for (FCModelCachedObject *obj in self.clockEntries) obj.cached = NO;
+        [self.clockEntries removeAllObjects];
+        self.clockHand = 0;
+        for (int stripe = 0; stripe < FCModelGeneratedObjectCacheStripeCount; stripe++) {
+            pthread_mutex_lock(&stripeLocks[stripe]);
+            [stripeObjects[stripe] removeAllObjects];
+            pthread_mutex_unlock(&stripeLocks[stripe]);
+        }
+
+        for (FCModelCacheState *state in self.classStates.allValues) state->entryCount = state->byteCount = 0;
+        self.totals->entryCount = self.totals->byteCount = 0;
     });
 }
 
-- (void)saveObject:(FCModelCachedObject *)obj class:(Class)fcModelClass identifier:(id)identifier
+// Must be called on cacheQueue
+- (FCModelCacheState *)stateForModelClass:(Class)fcModelClass
 {
-    dispatch_sync(self.cacheQueue, ^{
-        NSMutableDictionary *classCache = self.cache[fcModelClass];
-        if (! classCache) {
-            classCache = [NSMutableDictionary dictionary];
-            self.cache[(id)fcModelClass] = classCache;
-        }
-        
-        classCache[identifier] = obj;
-    });
+    FCModelCacheState *state = self.classStates[fcModelClass];
+    if (! state) {
+        state = [FCModelCacheState new];
+        self.classStates[(id)fcModelClass] = state;
+    }
+    return state;
 }
 
-- (FCModelCachedObject *)objectWithModelClass:(Class)fcModelClass identifier:(id)identifier
+// Inserting rechecks for the key on cacheQueue, so concurrent first requests for an identifier share one object
+- (FCModelCachedObject *)objectWithModelClass:(Class)fcModelClass identifier:(id)identifier creator:(FCModelCachedObject *(^)(void))creator
 {
-    __block FCModelCachedObject *result = nil;
+    FCModelCacheKey *key = [FCModelCacheKey keyWithModelClass:fcModelClass identifier:identifier];
+    NSUInteger stripe = cacheStripe(key);
+    pthread_mutex_lock(&stripeLocks[stripe]);
+    __block FCModelCachedObject *result = stripeObjects[stripe][key];
+    pthread_mutex_unlock(&stripeLocks[stripe]);
+    if (result) return result;
+
     dispatch_sync(self.cacheQueue, ^{
-        NSMutableDictionary *classCache = self.cache[fcModelClass];
-        if (! classCache) return;
-        result = classCache[identifier];
+        pthread_mutex_lock(&stripeLocks[stripe]);
+        result = stripeObjects[stripe][key];
+        pthread_mutex_unlock(&stripeLocks[stripe]);
+        if (result) return;
+
+        result = creator();
+        key->identifier = [key->identifier copy]; // as NSDictionary would for its own keys
+        FCModelCacheState *state = [self stateForModelClass:fcModelClass];
+        result.cacheKey = key;
+        result.cacheState = state;
+        result.cached = YES;
+        result.referenced = YES;
+        result.accountedByteCount = 0;
+        pthread_mutex_lock(&stripeLocks[stripe]);
+        stripeObjects[stripe][key] = result;
+        pthread_mutex_unlock(&stripeLocks[stripe]);
+        [self.clockEntries addObject:result];
+        state->entryCount++;
+        self.totals->entryCount++;
+
+        [self evictObjectsToFitState:state];
     });
     return result;
 }
 
-@end
+- (void)updateEstimatedByteCount:(NSUInteger)byteCount ofObject:(FCModelCachedObject *)obj
+{
+    dispatch_sync(self.cacheQueue, ^{
+        if (! obj.cached || byteCount == obj.accountedByteCount) return;
 
+        FCModelCacheState *state = obj.cacheState;
+        state->byteCount = state->byteCount - obj.accountedByteCount + byteCount;
+        self.totals->byteCount = self.totals->byteCount - obj.accountedByteCount + byteCount;
+        obj.accountedByteCount = byteCount;
 
-#pragma mark - FCModelCachedObject
+        [self evictObjectsToFitState:state];
+    });
+}
 
-@interface FCModelCachedObject ()
+- (void)setMaximumEntryCount:(NSUInteger)maxEntries byteCount:(NSUInteger)maxBytes forModelClass:(Class)fcModelClass
+{
+    dispatch_sync(self.cacheQueue, ^{
+        FCModelCacheState *state = fcModelClass ? [self stateForModelClass:fcModelClass] : self.totals;
+        state->maximumEntryCount = maxEntries;
+        state->maximumByteCount = maxBytes;
+        [self evictObjectsToFitState:state];
+    });
+}
 
-@property (nonatomic) Class modelClass;
-@property (nonatomic, copy) id (^generator)(void);
-@property (nonatomic) BOOL currentResultIsValid;
-@property (nonatomic) id currentResult;
-@property (nonatomic) NSSet *ignoredFieldsForInvalidation;
+- (FCModelCacheStatistics)statisticsForModelClass:(Class)fcModelClass
+{
+    __block FCModelCacheStatistics statistics;
+    dispatch_sync(self.cacheQueue, ^{
+        statistics = (fcModelClass ? [self stateForModelClass:fcModelClass] : self.totals).statistics;
+    });
+    return statistics;
+}
+
+// Must be called on cacheQueue. Evicts until both the totals and the given class state are within their limits,
+//  considering only that class's entries if just its own limit is exceeded.
+- (void)evictObjectsToFitState:(FCModelCacheState *)classState
+{
+    FCModelCacheState *totals = self.totals;
+    while (self.clockEntries.count) {
+        BOOL overGlobalLimit = totals.isOverLimit;
+        if (! overGlobalLimit && ! classState.isOverLimit) break;
+
+        if (self.clockHand >= self.clockEntries.count) self.clockHand = 0;
+        FCModelCachedObject *obj = self.clockEntries[self.clockHand];
+        if (! overGlobalLimit && obj.cacheState != classState) {
+            self.clockHand++;
+        } else if (obj.referenced) {
+            obj.referenced = NO;
+            self.clockHand++;
+        } else {
+            FCModelCacheState *state = obj.cacheState;
+            [self removeObject:obj atClockIndex:self.clockHand];
+            incrementCounter(&state->evictions);
+            incrementCounter(&totals->evictions);
+        }
+    }
+}
+
+// Must be called on cacheQueue
+- (void)removeObject:(FCModelCachedObject *)obj atClockIndex:(NSUInteger)index
+{
+    if (index == NSNotFound) return;
+    [self.clockEntries removeObjectAtIndex:index];
+    if (index < self.clockHand) self.clockHand--;
+    NSUInteger stripe = cacheStripe(obj.cacheKey);
+    pthread_mutex_lock(&stripeLocks[stripe]);
+    [stripeObjects[stripe] removeObjectForKey:obj.cacheKey];
+    pthread_mutex_unlock(&stripeLocks[stripe]);
+
+    FCModelCacheState *state = obj.cacheState;
+    state->entryCount--;
+    state->byteCount -= obj.accountedByteCount;
+    self.totals->entryCount--;
+    self.totals->byteCount -= obj.accountedByteCount;
+    obj.accountedByteCount = 0;
+    obj.cached = NO;
+}
 
 @end
 
+
+#pragma mark - FCModelCachedObject
+
 @implementation FCModelCachedObject
 
 + (void)clearCache
@@ -108,6 +400,23 @@ extern NSString * const FCModelWillSendAnyChangeNotification;
     [FCModelGeneratedObjectCache.sharedInstance clear:nil];
 }
 
++ (void)setMaximumEntryCount:(NSUInteger)maxEntries estimatedByteCount:(NSUInteger)maxBytes
+{
+    [FCModelGeneratedObjectCache.sharedInstance setMaximumEntryCount:maxEntries byteCount:maxBytes forModelClass:nil];
+}
+
++ (void)setMaximumEntryCount:(NSUInteger)maxEntries estimatedByteCount:(NSUInteger)maxBytes forModelClass:(Class)fcModelClass
+{
+    [FCModelGeneratedObjectCache.sharedInstance setMaximumEntryCount:maxEntries byteCount:maxBytes forModelClass:fcModelClass];
+}
+
++ (FCModelCacheStatistics)cacheStatistics { return [FCModelGeneratedObjectCache.sharedInstance statisticsForModelClass:nil]; }
+
++ (FCModelCacheStatistics)cacheStatisticsForModelClass:(Class)fcModelClass
+{
+    return [FCModelGeneratedObjectCache.sharedInstance statisticsForModelClass:fcModelClass];
+}
+
 + (instancetype)objectWithModelClass:(Class)fcModelClass cacheIdentifier:(id)identifier generator:(id (^)(void))generatorBlock
 {
     return [self objectWithModelClass:fcModelClass cacheIdentifier:identifier ignoreFieldsForInvalidation:nil generator:generatorBlock];
@@ -115,10 +424,8 @@ extern NSString * const FCModelWillSendAnyChangeNotification;
 
 + (instancetype)objectWithModelClass:(Class)fcModelClass cacheIdentifier:(id)identifier ignoreFieldsForInvalidation:(NSSet *)ignoredFields generator:(id (^)(void))generatorBlock
 {
-    FCModelCachedObject *obj = [FCModelGeneratedObjectCache.sharedInstance objectWithModelClass:fcModelClass identifier:identifier];
-
-    if (! obj) {
-        obj = [[FCModelCachedObject alloc] init];
+    return (FCModelCachedObject *) [FCModelGeneratedObjectCache.sharedInstance objectWithModelClass:fcModelClass identifier:identifier creator:^FCModelCachedObject *{
+        FCModelCachedObject *obj = [[self alloc] init];
         obj.modelClass = fcModelClass;
         obj.generator = generatorBlock;
         obj.ignoredFieldsForInvalidation = ignoredFields;
@@ -126,13 +433,19 @@ extern NSString * const FCModelWillSendAnyChangeNotification;
         [NSNotificationCenter.defaultCenter addObserver:obj selector:@selector(dataSourceChanged:) name:FCModelWillReloadNotification object:fcModelClass];
         [NSNotificationCenter.defaultCenter addObserver:obj selector:@selector(dataSourceChanged:) name:FCModelWillSendAnyChangeNotification object:fcModelClass];
 
-#if TARGET_OS_IPHONE
+#if FCModelObservesMemoryWarnings
         [NSNotificationCenter.defaultCenter addObserver:obj selector:@selector(flush:) name:UIApplicationDidReceiveMemoryWarningNotification object:nil];
 #endif
+        return obj;
+    }];
+}
 
-        [FCModelGeneratedObjectCache.sharedInstance saveObject:obj class:fcModelClass identifier:identifier];
+- (instancetype)init
+{
+    if ( (self = [super init]) ) {
+        _resultLock = dispatch_semaphore_create(1);
     }
-    return obj;
+    return self;
 }
 
 - (void)dealloc { [NSNotificationCenter.defaultCenter removeObserver:self]; }
@@ -148,32 +461,453 @@ extern NSString * const FCModelWillSendAnyChangeNotification;
         if (fieldsWeCareAbout.count == 0) return;
     }
     
-    [self flush:n];
+    dispatch_semaphore_wait(self.resultLock, DISPATCH_TIME_FOREVER);
+    [self invalidateResultKeepingStaleValue:self.servesStaleValueWhileRegenerating];
+    dispatch_semaphore_signal(self.resultLock);
 }
 
 - (void)flush:(NSNotification *)n
 {
-    self.currentResult = nil;
+    dispatch_semaphore_wait(self.resultLock, DISPATCH_TIME_FOREVER);
+    [self invalidateResultKeepingStaleValue:NO];
+    dispatch_semaphore_signal(self.resultLock);
+}
+
+// Must be called with resultLock held
+- (void)invalidateResultKeepingStaleValue:(BOOL)keepStaleValue
+{
+    FCModelCacheState *state = self.cached ? self.cacheState : nil;
+    if (self.currentResultIsValid && state) {
+        incrementCounter(&state->invalidations);
+        incrementCounter(&FCModelGeneratedObjectCache.sharedInstance.totals->invalidations);
+    }
+    self.resultVersion++;
+    self.currentResultIsStale = keepStaleValue && (self.currentResultIsValid || self.currentResultIsStale);
+    if (! self.currentResultIsStale) self.currentResult = nil;
     self.currentResultIsValid = NO;
 }
 
+// For subclasses that bring a valid result up to date in place. Called with resultLock held, so it only takes what the update
+//  needs, if anything, and clears it. The update itself can query the database, so it runs without the lock.
+- (id)takePendingUpdate { return nil; }
+- (id)resultByApplyingUpdate:(id)update toResult:(id)result { return result; }
+
+- (void)setCurrentResult:(id)currentResult
+{
+    _currentResult = currentResult;
+    if (self.cached) [FCModelGeneratedObjectCache.sharedInstance updateEstimatedByteCount:estimatedByteCountOfObject(currentResult, 0) ofObject:self];
+}
+
 - (id)value
 {
-    if (! self.currentResultIsValid) {
-        self.currentResult = self.generator();
-        self.currentResultIsValid = YES;
+    self.referenced = YES;
+    FCModelCacheState *state = self.cached ? self.cacheState : nil, *totals = FCModelGeneratedObjectCache.sharedInstance.totals;
+
+    id result = nil, update = nil;
+    BOOL generateHere = NO;
+    dispatch_semaphore_wait(self.resultLock, DISPATCH_TIME_FOREVER);
+    while (1) {
+        if (self.currentResultIsValid && ! self.generationGroup) {
+            result = self.currentResult;
+            if ( (update = [self takePendingUpdate]) ) [self beginGeneration];
+            break;
+        }
+
+        if (self.currentResultIsStale) {
+            result = self.currentResult;
+            if (! self.generationGroup) {
+                [self beginGeneration];
+                dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{ [self runGeneration:self.generator]; });
+            }
+            break;
+        }
+
+        if (! self.generationGroup) {
+            [self beginGeneration];
+            generateHere = YES;
+            break;
+        }
+
+        dispatch_group_t generationGroup = self.generationGroup;
+        dispatch_semaphore_signal(self.resultLock);
+        dispatch_group_wait(generationGroup, DISPATCH_TIME_FOREVER);
+        dispatch_semaphore_wait(self.resultLock, DISPATCH_TIME_FOREVER);
+    }
+    dispatch_semaphore_signal(self.resultLock);
+
+    if (generateHere) {
+        if (state) { incrementCounter(&state->misses); incrementCounter(&totals->misses); }
+        return [self runGeneration:self.generator];
+    }
+
+    if (state) { incrementCounter(&state->hits); incrementCounter(&totals->hits); }
+    if (update) {
+        id currentResult = result;
+        return [self runGeneration:^id{ return [self resultByApplyingUpdate:update toResult:currentResult]; }];
+    }
+    return result;
+}
+
+// Must be called with resultLock held
+- (void)beginGeneration
+{
+    self.generationGroup = dispatch_group_create();
+    dispatch_group_enter(self.generationGroup);
+    self.generationResultVersion = self.resultVersion;
+}
+
+// Runs the generator or an update without resultLock held, keeping its result unless it was invalidated while it ran
+- (id)runGeneration:(id (^)(void))generator
+{
+    id result = nil;
+    BOOL finished = NO;
+    @try {
+        result = generator();
+        finished = YES;
+    } @finally {
+        dispatch_semaphore_wait(self.resultLock, DISPATCH_TIME_FOREVER);
+        if (finished && self.resultVersion == self.generationResultVersion) {
+            self.currentResult = result;
+            self.currentResultIsValid = YES;
+            self.currentResultIsStale = NO;
+        } else if (! finished && self.currentResultIsValid) {
+            // A failed update took its pending changes with it, so the result can't be trusted anymore
+            [self invalidateResultKeepingStaleValue:NO];
+        }
+        dispatch_group_t generationGroup = self.generationGroup;
+        self.generationGroup = nil;
+        dispatch_semaphore_signal(self.resultLock);
+        dispatch_group_leave(generationGroup);
+    }
+    return result;
+}
+
+@end
+
+
+
+#pragma mark - FCModelLiveResultArrayChanges
+
+@interface FCModelLiveResultArrayChanges ()
+@property (nonatomic) NSIndexSet *deletedIndexes;
+@property (nonatomic) NSIndexSet *insertedIndexes;
+@property (nonatomic) NSIndexSet *updatedIndexes;
+@end
+
+@implementation FCModelLiveResultArrayChanges
+
++ (instancetype)changesFromObjects:(NSArray *)oldObjects toObjects:(NSArray *)newObjects updatedObjects:(NSSet *)updatedObjects
+{
+    NSMapTable *oldIndexes = [NSMapTable mapTableWithKeyOptions:NSPointerFunctionsObjectPointerPersonality valueOptions:NSPointerFunctionsStrongMemory];
+    [oldObjects enumerateObjectsUsingBlock:^(id obj, NSUInteger idx, BOOL *stop) { [oldIndexes setObject:@(idx) forKey:obj]; }];
+
+    // Old positions of the objects in both results, in their new order
+    NSUInteger newCount = newObjects.count;
+    NSUInteger *commonOldIndexes = malloc(MAX(newCount, 1) * sizeof(NSUInteger));
+    NSUInteger *commonNewIndexes = malloc(MAX(newCount, 1) * sizeof(NSUInteger));
+    NSUInteger commonCount = 0;
+    NSMutableIndexSet *inserted = [NSMutableIndexSet indexSet];
+    NSMutableIndexSet *retainedOldIndexes = [NSMutableIndexSet indexSet];
+    for (NSUInteger i = 0; i < newCount; i++) {
+        NSNumber *oldIndex = [oldIndexes objectForKey:newObjects[i]];
+        if (oldIndex) {
+            commonOldIndexes[commonCount] = oldIndex.unsignedIntegerValue;
+            commonNewIndexes[commonCount] = i;
+            commonCount++;
+            [retainedOldIndexes addIndex:oldIndex.unsignedIntegerValue];
+        } else {
+            [inserted addIndex:i];
+        }
+    }
+
+    NSMutableIndexSet *deleted = [NSMutableIndexSet indexSetWithIndexesInRange:NSMakeRange(0, oldObjects.count)];
+    [deleted removeIndexes:retainedOldIndexes];
+
+    // Objects on the longest run that kept their relative order stay put; the rest moved
+    NSUInteger *tailIndexes = malloc(MAX(commonCount, 1) * sizeof(NSUInteger)); // tailIndexes[k]: index of the smallest tail of an increasing run of length k+1
+    NSUInteger *predecessors = malloc(MAX(commonCount, 1) * sizeof(NSUInteger));
+    NSUInteger runLength = 0;
+    for (NSUInteger i = 0; i < commonCount; i++) {
+        NSUInteger low = 0, high = runLength;
+        while (low < high) {
+            NSUInteger mid = (low + high) / 2;
+            if (commonOldIndexes[tailIndexes[mid]] < commonOldIndexes[i]) low = mid + 1; else high = mid;
+        }
+        predecessors[i] = low > 0 ? tailIndexes[low - 1] : NSNotFound;
+        tailIndexes[low] = i;
+        if (low == runLength) runLength++;
+    }
+
+    NSMutableIndexSet *unmoved = [NSMutableIndexSet indexSet];
+    for (NSUInteger i = runLength ? tailIndexes[runLength - 1] : NSNotFound; i != NSNotFound; i = predecessors[i]) [unmoved addIndex:i];
+
+    NSMutableIndexSet *updated = [NSMutableIndexSet indexSet];
+    for (NSUInteger i = 0; i < commonCount; i++) {
+        if ([unmoved containsIndex:i]) {
+            if ([updatedObjects containsObject:newObjects[commonNewIndexes[i]]]) [updated addIndex:commonNewIndexes[i]];
+        } else {
+            [deleted addIndex:commonOldIndexes[i]];
+            [inserted addIndex:commonNewIndexes[i]];
+        }
     }
-    return self.currentResult;
+
+    free(commonOldIndexes);
+    free(commonNewIndexes);
+    free(tailIndexes);
+    free(predecessors);
+
+    FCModelLiveResultArrayChanges *changes = [self new];
+    changes.deletedIndexes = deleted;
+    changes.insertedIndexes = inserted;
+    changes.updatedIndexes = updated;
+    return changes;
+}
+
+- (BOOL)hasChanges { return self.deletedIndexes.count || self.insertedIndexes.count || self.updatedIndexes.count; }
+
+- (NSString *)description
+{
+    return [NSString stringWithFormat:@"<FCModelLiveResultArrayChanges deleted=%@ inserted=%@ updated=%@>", self.deletedIndexes, self.insertedIndexes, self.updatedIndexes];
 }
 
 @end
 
 
+#pragma mark - FCModelLiveResult
+
+// The shared, incrementally maintained result behind every FCModelLiveResultArray with the same query and arguments
+@interface FCModelLiveResult : FCModelCachedObject
+@property (nonatomic, copy) NSString *query;
+@property (nonatomic, copy) NSArray *arguments;
+@property (nonatomic) BOOL needsFullComparison; // ordered or limited queries can't be updated row by row
+@property (nonatomic) NSSet *queryFieldNames;   // fields the query reads, so changes to others can't affect its rows or order; nil if unknown
+@property (nonatomic) BOOL unidentifiedRowsChanged;
+@property (nonatomic) NSMutableSet *pendingInstances;
+@property (nonatomic) uint64_t changeVersion;
+@property (nonatomic) NSMapTable *instanceChangeVersions; // weak instance -> NSNumber of the changeVersion when it last changed
+@end
+
+// Whether the query has an ORDER BY, GROUP BY, LIMIT, or OFFSET of its own, as opposed to one in a subquery or string literal
+static BOOL queryHasTopLevelOrderingOrLimit(NSString *query)
+{
+    static NSRegularExpression *orderedQueryExpression;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        orderedQueryExpression = [NSRegularExpression regularExpressionWithPattern:@"\\b(ORDER\\s+BY|GROUP\\s+BY|LIMIT|OFFSET)\\b" options:NSRegularExpressionCaseInsensitive error:NULL];
+    });
+    if (! query) return NO;
+
+    // Blank out everything inside parentheses and quotes, so only the top level can match
+    NSUInteger length = query.length;
+    unichar *characters = malloc(MAX(length, 1) * sizeof(unichar));
+    [query getCharacters:characters range:NSMakeRange(0, length)];
+    NSUInteger depth = 0;
+    unichar quote = 0;
+    for (NSUInteger i = 0; i < length; i++) {
+        unichar c = characters[i];
+        if (quote) {
+            if (c == quote) quote = 0; // a doubled quote just closes and reopens
+            characters[i] = ' ';
+        } else if (c == '\'' || c == '"' || c == '`' || c == '[') {
+            quote = (c == '[' ? ']' : c);
+            characters[i] = ' ';
+        } else if (c == '(') {
+            depth++;
+            characters[i] = ' ';
+        } else if (c == ')') {
+            if (depth) depth--;
+            characters[i] = ' ';
+        } else if (depth) {
+            characters[i] = ' ';
+        }
+    }
+    NSString *topLevelQuery = [[NSString alloc] initWithCharactersNoCopy:characters length:length freeWhenDone:YES];
+    return [orderedQueryExpression firstMatchInString:topLevelQuery options:0 range:NSMakeRange(0, length)] != nil;
+}
+
+@implementation FCModelLiveResult
+
++ (instancetype)resultWithModelClass:(Class)fcModelClass queryAfterWHERE:(NSString *)query arguments:(NSArray *)arguments ignoreFieldsForInvalidation:(NSSet *)ignoredFields
+{
+    id identifier = @[ NSStringFromClass(self), (query ?: NSNull.null), (arguments ?: NSNull.null) ];
+    FCModelLiveResult *result = (FCModelLiveResult *) [self objectWithModelClass:fcModelClass cacheIdentifier:identifier ignoreFieldsForInvalidation:ignoredFields generator:^id{
+        return query ? [fcModelClass instancesWhere:query arguments:arguments] : [fcModelClass allInstances];
+    }];
+
+    dispatch_semaphore_wait(result.resultLock, DISPATCH_TIME_FOREVER);
+    BOOL configured = result.pendingInstances != nil;
+    dispatch_semaphore_signal(result.resultLock);
+    if (configured) return result;
+
+    // Finding the fields prepares the query, which can wait for the database, so it's done without holding resultLock
+    NSSet *queryFieldNames = [fcModelClass fieldNamesReadByQueryAfterWHERE:query];
+
+    dispatch_semaphore_wait(result.resultLock, DISPATCH_TIME_FOREVER);
+    if (! result.pendingInstances) {
+        result.query = query;
+        result.arguments = arguments;
+        result.needsFullComparison = queryHasTopLevelOrderingOrLimit(query);
+        result.queryFieldNames = queryFieldNames;
+        result.pendingInstances = [NSMutableSet set];
+        result.instanceChangeVersions = [NSMapTable weakToStrongObjectsMapTable];
+    }
+    dispatch_semaphore_signal(result.resultLock);
+    return result;
+}
+
+- (void)dataSourceChanged:(NSNotification *)n
+{
+    if (n.object != nil && n.object != self.modelClass) return;
+
+    NSSet *changedFields = n.userInfo[FCModelChangedFieldsKey], *ignoredFields = self.ignoredFieldsForInvalidation;
+    if (ignoredFields && changedFields) {
+        NSMutableSet *fieldsWeCareAbout = [changedFields mutableCopy];
+        [fieldsWeCareAbout minusSet:ignoredFields];
+        if (fieldsWeCareAbout.count == 0) return;
+    }
+
+    dispatch_semaphore_wait(self.resultLock, DISPATCH_TIME_FOREVER);
+    if (self.currentResultIsValid) {
+        NSSet *instances = n.userInfo[FCModelInstanceSetKey];
+        NSSet *queryFieldNames = self.queryFieldNames;
+        if ([n.name isEqualToString:FCModelWillReloadNotification] || [n.userInfo[FCModelUnidentifiedRowsChangedKey] boolValue]) {
+            self.unidentifiedRowsChanged = YES;
+        } else if (! queryFieldNames.count || ! changedFields || [changedFields intersectsSet:queryFieldNames]) {
+            [self.pendingInstances unionSet:instances];
+        } else {
+            // Only deletions can change which rows match. The rest are still reported as updates below.
+            for (FCModel *instance in instances) if (! instance.existsInDatabase) [self.pendingInstances addObject:instance];
+        }
+
+        self.changeVersion++;
+        NSNumber *version = @(self.changeVersion);
+        for (id instance in instances) [self.instanceChangeVersions setObject:version forKey:instance];
+    } else {
+        // Nothing to update until it's first read, but a query already in flight may have missed this change
+        self.resultVersion++;
+    }
+    dispatch_semaphore_signal(self.resultLock);
+}
+
+- (void)flush:(NSNotification *)n
+{
+    dispatch_semaphore_wait(self.resultLock, DISPATCH_TIME_FOREVER);
+    [self invalidateResultKeepingStaleValue:NO];
+    [self.pendingInstances removeAllObjects];
+    self.unidentifiedRowsChanged = NO;
+    dispatch_semaphore_signal(self.resultLock);
+}
+
+// The pending instances, or NSNull if the whole result has to be compared
+- (id)takePendingUpdate
+{
+    id update = nil;
+    if (self.unidentifiedRowsChanged || self.needsFullComparison) {
+        if (self.unidentifiedRowsChanged || self.pendingInstances.count) update = NSNull.null;
+    } else if (self.pendingInstances.count) {
+        update = [self.pendingInstances copy];
+    }
+    [self.pendingInstances removeAllObjects];
+    self.unidentifiedRowsChanged = NO;
+    return update;
+}
+
+- (id)resultByApplyingUpdate:(id)update toResult:(NSArray *)result
+{
+    return update == NSNull.null ? [self objectsByComparingPrimaryKeysWithResult:result] : [self objectsBySplicingInstances:update intoResult:result];
+}
+
+// Re-reads just the matching primary keys, reusing current instances and only fetching the new ones
+- (NSArray *)objectsByComparingPrimaryKeysWithResult:(NSArray *)result
+{
+    Class modelClass = self.modelClass;
+    NSArray *primaryKeyValues = self.query ?
+        [modelClass firstColumnArrayFromQuery:[@"SELECT \"$PK\" FROM \"$T\" WHERE " stringByAppendingString:self.query] arguments:self.arguments] :
+        [modelClass firstColumnArrayFromQuery:@"SELECT \"$PK\" FROM \"$T\"" arguments:nil]
+    ;
+
+    NSMutableDictionary *instancesByPrimaryKey = [NSMutableDictionary dictionary];
+    for (FCModel *instance in result) {
+        if (instance.existsInDatabase) instancesByPrimaryKey[instance.primaryKey] = instance;
+    }
+
+    NSMutableArray *newPrimaryKeyValues = [NSMutableArray array];
+    for (id primaryKeyValue in primaryKeyValues) {
+        if (! instancesByPrimaryKey[primaryKeyValue]) [newPrimaryKeyValues addObject:primaryKeyValue];
+    }
+    if (newPrimaryKeyValues.count) [instancesByPrimaryKey addEntriesFromDictionary:[modelClass keyedInstancesWithPrimaryKeyValues:newPrimaryKeyValues]];
+
+    NSMutableArray *objects = [NSMutableArray arrayWithCapacity:primaryKeyValues.count];
+    for (id primaryKeyValue in primaryKeyValues) {
+        FCModel *instance = instancesByPrimaryKey[primaryKeyValue];
+        if (instance) [objects addObject:instance];
+    }
+    return [objects copy];
+}
+
+// Checks only the changed instances' rows against the query, then splices them in or out
+- (NSArray *)objectsBySplicingInstances:(NSSet *)changedInstances intoResult:(NSArray *)result
+{
+    Class modelClass = self.modelClass;
+    NSMutableArray *candidatePrimaryKeyValues = [NSMutableArray array];
+    for (FCModel *instance in changedInstances) {
+        if (instance.existsInDatabase) [candidatePrimaryKeyValues addObject:instance.primaryKey];
+    }
+
+    NSMutableSet *matchingPrimaryKeyValues = [NSMutableSet set];
+    if (! self.query) {
+        [matchingPrimaryKeyValues addObjectsFromArray:candidatePrimaryKeyValues];
+    } else {
+        // The query's own arguments count against the same limit as the IN list
+        NSUInteger maxParameterCount = [modelClass maximumQueryParameterCount];
+        NSUInteger chunkSize = maxParameterCount > self.arguments.count ? maxParameterCount - self.arguments.count : 1;
+        for (NSUInteger start = 0; start < candidatePrimaryKeyValues.count; start += chunkSize) {
+            NSArray *chunk = [candidatePrimaryKeyValues subarrayWithRange:NSMakeRange(start, MIN(chunkSize, candidatePrimaryKeyValues.count - start))];
+            NSMutableString *query = [NSMutableString stringWithString:@"SELECT \"$PK\" FROM \"$T\" WHERE \"$PK\" IN (?"];
+            for (NSUInteger i = 1; i < chunk.count; i++) [query appendString:@",?"];
+            [query appendFormat:@") AND (%@)", self.query];
+            [matchingPrimaryKeyValues addObjectsFromArray:[modelClass firstColumnArrayFromQuery:query arguments:(self.arguments ? [chunk arrayByAddingObjectsFromArray:self.arguments] : chunk)]];
+        }
+    }
+
+    NSMutableArray *objects = [result mutableCopy];
+    NSMutableSet *presentInstances = [NSMutableSet setWithArray:objects];
+    NSMutableIndexSet *indexesToRemove = [NSMutableIndexSet indexSet];
+    [objects enumerateObjectsUsingBlock:^(FCModel *instance, NSUInteger idx, BOOL *stop) {
+        if ([changedInstances containsObject:instance] && ! (instance.existsInDatabase && [matchingPrimaryKeyValues containsObject:instance.primaryKey])) {
+            [indexesToRemove addIndex:idx];
+        }
+    }];
+    [objects removeObjectsAtIndexes:indexesToRemove];
+
+    for (FCModel *instance in changedInstances) {
+        if (! [presentInstances containsObject:instance] && instance.existsInDatabase && [matchingPrimaryKeyValues containsObject:instance.primaryKey]) {
+            [objects addObject:instance];
+        }
+    }
+    return [objects copy];
+}
+
+- (NSSet *)instancesChangedSinceVersion:(uint64_t)version
+{
+    NSMutableSet *instances = [NSMutableSet set];
+    dispatch_semaphore_wait(self.resultLock, DISPATCH_TIME_FOREVER);
+    for (id instance in self.instanceChangeVersions.keyEnumerator) {
+        if ([[self.instanceChangeVersions objectForKey:instance] unsignedLongLongValue] > version) [instances addObject:instance];
+    }
+    dispatch_semaphore_signal(self.resultLock);
+    return instances;
+}
+
+@end
+
 
 #pragma mark - FCModelLiveResultArray
 
 @interface FCModelLiveResultArray ()
-@property (nonatomic) FCModelCachedObject *cachedObject;
+@property (nonatomic) FCModelLiveResult *liveResult;
+@property (nonatomic) NSArray *objectsAtLastChanges;
+@property (nonatomic) uint64_t changeVersionAtLastChanges;
 @end
 
 @implementation FCModelLiveResultArray
@@ -181,15 +915,25 @@ extern NSString * const FCModelWillSendAnyChangeNotification;
 + (instancetype)arrayWithModelClass:(Class)fcModelClass queryAfterWHERE:(NSString *)query arguments:(NSArray *)arguments ignoreFieldsForInvalidation:(NSSet *)ignoredFields
 {
     FCModelLiveResultArray *set = [self new];
-    
-    set.cachedObject = [FCModelCachedObject objectWithModelClass:fcModelClass cacheIdentifier:@[(query ?: NSNull.null), (arguments ?: NSNull.null)] ignoreFieldsForInvalidation:ignoredFields generator:^id{
-        return query ? [fcModelClass instancesWhere:query arguments:arguments] : [fcModelClass allInstances];
-    }];
-
+    set.liveResult = [FCModelLiveResult resultWithModelClass:fcModelClass queryAfterWHERE:query arguments:arguments ignoreFieldsForInvalidation:ignoredFields];
     return set;
 }
 
-- (NSArray *)allObjects { return self.cachedObject.value; }
+- (NSArray *)allObjects { return self.liveResult.value; }
 
-@end
+- (NSArray *)allObjectsWithChanges:(FCModelLiveResultArrayChanges **)outChanges
+{
+    NSArray *objects = self.liveResult.value;
+    if (outChanges) {
+        *outChanges = [FCModelLiveResultArrayChanges
+            changesFromObjects:(self.objectsAtLastChanges ?: @[])
+            toObjects:objects
+            updatedObjects:(self.objectsAtLastChanges ? [self.liveResult instancesChangedSinceVersion:self.changeVersionAtLastChanges] : nil)
+        ];
+    }
+    self.objectsAtLastChanges = objects;
+    self.changeVersionAtLastChanges = self.liveResult.changeVersion;
+    return objects;
+}
 
+@end
@@ -0,0 +1,43 @@
+//
+//  FCModelCodec.h
+//
+//  Copyright (c) 2014 Marco Arment. See included LICENSE file.
+//
+
+#import <Foundation/Foundation.h>
+
+extern NSString * const FCModelCodecErrorDomain;
+
+// Converts an NSArray or NSDictionary property's value to and from the NSData stored in its BLOB column.
+//  Codecs are shared by every instance and thread, so they must be stateless.
+//
+// To choose a field's codec, override FCModel's +codecForFieldName:. It's called once per field when the database is opened.
+//
+@protocol FCModelCodec <NSObject>
+
+// Returns nil and sets error if the value, or anything in it, can't be encoded
+- (NSData *)dataFromValue:(id)value error:(NSError **)error;
+
+// Returns nil if the data is malformed. Collections are returned immutable.
+- (id)valueFromData:(NSData *)data;
+
+@end
+
+
+// Binary property lists, FCModel's original format and the default. Can store anything NSPropertyListSerialization can.
+@interface FCModelPropertyListCodec : NSObject <FCModelCodec>
++ (instancetype)sharedCodec;
+@end
+
+
+// A compact, versioned binary format that encodes and decodes several times faster than binary plists. Stores the same types:
+//  NSArray, NSDictionary, NSString, NSNumber, NSData, and NSDate. Arrays of only integers or only floating-point numbers, and
+//  dictionaries of only strings, are written in packed forms. Strings that can't be converted to UTF-8, such as those with
+//  unpaired surrogates, are rejected with an error.
+//
+// Data that isn't in this format is read as a property list, so existing plist BLOBs keep working after switching a field to it.
+//  They stay plists until the field is changed and saved; saving other changes to the instance doesn't rewrite them.
+//
+@interface FCModelBinaryCodec : NSObject <FCModelCodec>
++ (instancetype)sharedCodec;
+@end
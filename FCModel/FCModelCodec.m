@@ -0,0 +1,427 @@
+//
+//  FCModelCodec.m
+//
+//  Copyright (c) 2014 Marco Arment. See included LICENSE file.
+//
+
+#import "FCModelCodec.h"
+
+NSString * const FCModelCodecErrorDomain = @"FCModelCodecErrorDomain";
+
+static NSError *unencodableValueError(id value)
+{
+    return [NSError errorWithDomain:FCModelCodecErrorDomain code:1 userInfo:@{
+        NSLocalizedDescriptionKey : [NSString stringWithFormat:@"%@ values can't be encoded", NSStringFromClass([value class])]
+    }];
+}
+
+static NSError *unencodableStringError(void)
+{
+    return [NSError errorWithDomain:FCModelCodecErrorDomain code:2 userInfo:@{
+        NSLocalizedDescriptionKey : @"Strings that aren't valid Unicode, such as those with unpaired surrogates, can't be encoded as UTF-8"
+    }];
+}
+
+@implementation FCModelPropertyListCodec
+
++ (instancetype)sharedCodec
+{
+    static FCModelPropertyListCodec *codec;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{ codec = [self new]; });
+    return codec;
+}
+
+- (NSData *)dataFromValue:(id)value error:(NSError **)error
+{
+    return [NSPropertyListSerialization dataWithPropertyList:value format:NSPropertyListBinaryFormat_v1_0 options:NSPropertyListImmutable error:error];
+}
+
+- (id)valueFromData:(NSData *)data
+{
+    return [NSPropertyListSerialization propertyListWithData:data options:kCFPropertyListImmutable format:NULL error:NULL];
+}
+
+@end
+
+
+// The data is the header "FCM" plus a version byte, then one value: a tag byte and its payload. Lengths and counts are unsigned
+//  LEB128 varints, integers are zigzag-encoded varints, and doubles are 8 bytes, little-endian.
+static const uint8_t FCModelBinaryCodecMagic[3] = { 'F', 'C', 'M' };
+static const uint8_t FCModelBinaryCodecVersion = 1;
+static const NSUInteger FCModelBinaryCodecMaximumDepth = 512;
+
+typedef NS_ENUM(uint8_t, FCModelBinaryTag) {
+    FCModelBinaryTagTrue         = 'T',
+    FCModelBinaryTagFalse        = 'F',
+    FCModelBinaryTagInteger      = 'i', // zigzag varint
+    FCModelBinaryTagUnsigned     = 'u', // 8 bytes, for values above INT64_MAX
+    FCModelBinaryTagDouble       = 'd',
+    FCModelBinaryTagString       = 's', // byte length, UTF-8
+    FCModelBinaryTagData         = 'b', // byte length, bytes
+    FCModelBinaryTagDate         = 't', // double, seconds since the reference date
+    FCModelBinaryTagArray        = 'a', // count, values
+    FCModelBinaryTagDictionary   = 'm', // count, key and value pairs
+    FCModelBinaryTagIntegerArray = 'I', // count, zigzag varints
+    FCModelBinaryTagDoubleArray  = 'D', // count, doubles
+    FCModelBinaryTagStringMap    = 'S', // count, key and value pairs of byte length and UTF-8
+};
+
+typedef NS_ENUM(NSInteger, FCModelNumberKind) {
+    FCModelNumberKindBoolean,
+    FCModelNumberKindInteger,
+    FCModelNumberKindUnsigned,
+    FCModelNumberKindDouble,
+};
+
+static inline FCModelNumberKind numberKind(NSNumber *number)
+{
+    CFTypeRef cfNumber = (__bridge CFTypeRef) number;
+    if (cfNumber == kCFBooleanTrue || cfNumber == kCFBooleanFalse) return FCModelNumberKindBoolean;
+    if ([number isKindOfClass:NSDecimalNumber.class] || CFNumberIsFloatType((CFNumberRef) cfNumber)) return FCModelNumberKindDouble;
+    char type = number.objCType[0];
+    if ((type == 'Q' || type == 'L') && number.unsignedLongLongValue > INT64_MAX) return FCModelNumberKindUnsigned;
+    return FCModelNumberKindInteger;
+}
+
+#pragma mark - Writing
+
+typedef struct {
+    uint8_t *bytes;
+    size_t length;
+    size_t capacity;
+} FCModelBinaryWriter;
+
+static inline void writerReserve(FCModelBinaryWriter *writer, size_t byteCount)
+{
+    if (writer->length + byteCount <= writer->capacity) return;
+    writer->capacity = MAX(writer->capacity * 2, writer->length + byteCount);
+    writer->bytes = realloc(writer->bytes, writer->capacity);
+}
+
+static inline void writeByte(FCModelBinaryWriter *writer, uint8_t byte)
+{
+    writerReserve(writer, 1);
+    writer->bytes[writer->length++] = byte;
+}
+
+static inline void writeBytes(FCModelBinaryWriter *writer, const void *bytes, size_t byteCount)
+{
+    writerReserve(writer, byteCount);
+    memcpy(writer->bytes + writer->length, bytes, byteCount);
+    writer->length += byteCount;
+}
+
+static inline void writeVarint(FCModelBinaryWriter *writer, uint64_t value)
+{
+    writerReserve(writer, 10);
+    while (value >= 0x80) {
+        writer->bytes[writer->length++] = (uint8_t) (value | 0x80);
+        value >>= 7;
+    }
+    writer->bytes[writer->length++] = (uint8_t) value;
+}
+
+static inline void writeZigzag(FCModelBinaryWriter *writer, int64_t value) { writeVarint(writer, ((uint64_t) value << 1) ^ (uint64_t) (value >> 63)); }
+
+static inline void writeDouble(FCModelBinaryWriter *writer, double value)
+{
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    bits = CFSwapInt64HostToLittle(bits);
+    writeBytes(writer, &bits, sizeof(bits));
+}
+
+static inline BOOL writeString(FCModelBinaryWriter *writer, NSString *string, NSError **error)
+{
+    // Converted straight into the buffer past the longest possible length prefix, then moved back behind the actual one
+    NSUInteger maximumLength = [string maximumLengthOfBytesUsingEncoding:NSUTF8StringEncoding];
+    writerReserve(writer, 10 + maximumLength);
+    uint8_t *scratch = writer->bytes + writer->length + 10;
+    NSUInteger usedLength = 0;
+    NSRange remainingRange = NSMakeRange(0, 0);
+    BOOL converted = [string getBytes:scratch maxLength:maximumLength usedLength:&usedLength encoding:NSUTF8StringEncoding options:0 range:NSMakeRange(0, string.length) remainingRange:&remainingRange];
+    if (! converted || remainingRange.length) {
+        if (error) *error = unencodableStringError();
+        return NO;
+    }
+
+    writeVarint(writer, usedLength);
+    memmove(writer->bytes + writer->length, scratch, usedLength);
+    writer->length += usedLength;
+    return YES;
+}
+
+static BOOL writeValue(FCModelBinaryWriter *writer, id value, NSError **error);
+
+static BOOL writeArray(FCModelBinaryWriter *writer, NSArray *array, NSError **error)
+{
+    // Packed if every member is an integer, or every member is floating-point
+    FCModelNumberKind packedKind = FCModelNumberKindBoolean;
+    for (id member in array) {
+        FCModelNumberKind kind = [member isKindOfClass:NSNumber.class] ? numberKind(member) : FCModelNumberKindBoolean;
+        if ((kind != FCModelNumberKindInteger && kind != FCModelNumberKindDouble) || (packedKind != FCModelNumberKindBoolean && kind != packedKind)) {
+            packedKind = FCModelNumberKindBoolean;
+            break;
+        }
+        packedKind = kind;
+    }
+
+    if (packedKind == FCModelNumberKindInteger) {
+        writeByte(writer, FCModelBinaryTagIntegerArray);
+        writeVarint(writer, array.count);
+        for (NSNumber *member in array) writeZigzag(writer, member.longLongValue);
+    } else if (packedKind == FCModelNumberKindDouble) {
+        writeByte(writer, FCModelBinaryTagDoubleArray);
+        writeVarint(writer, array.count);
+        for (NSNumber *member in array) writeDouble(writer, member.doubleValue);
+    } else {
+        writeByte(writer, FCModelBinaryTagArray);
+        writeVarint(writer, array.count);
+        for (id member in array) if (! writeValue(writer, member, error)) return NO;
+    }
+    return YES;
+}
+
+static BOOL writeDictionary(FCModelBinaryWriter *writer, NSDictionary *dictionary, NSError **error)
+{
+    BOOL stringMap = YES;
+    for (id key in dictionary) {
+        if (! [key isKindOfClass:NSString.class] || ! [dictionary[key] isKindOfClass:NSString.class]) {
+            stringMap = NO;
+            break;
+        }
+    }
+
+    writeByte(writer, stringMap ? FCModelBinaryTagStringMap : FCModelBinaryTagDictionary);
+    writeVarint(writer, dictionary.count);
+    for (id key in dictionary) {
+        id value = dictionary[key];
+        if (stringMap) {
+            if (! writeString(writer, key, error) || ! writeString(writer, value, error)) return NO;
+        } else if (! writeValue(writer, key, error) || ! writeValue(writer, value, error)) {
+            return NO;
+        }
+    }
+    return YES;
+}
+
+static BOOL writeValue(FCModelBinaryWriter *writer, id value, NSError **error)
+{
+    if ([value isKindOfClass:NSString.class]) {
+        writeByte(writer, FCModelBinaryTagString);
+        return writeString(writer, value, error);
+    } else if ([value isKindOfClass:NSNumber.class]) {
+        switch (numberKind(value)) {
+            case FCModelNumberKindBoolean: writeByte(writer, [value boolValue] ? FCModelBinaryTagTrue : FCModelBinaryTagFalse); break;
+            case FCModelNumberKindInteger: writeByte(writer, FCModelBinaryTagInteger); writeZigzag(writer, [value longLongValue]); break;
+            case FCModelNumberKindDouble:  writeByte(writer, FCModelBinaryTagDouble); writeDouble(writer, [value doubleValue]); break;
+            case FCModelNumberKindUnsigned: {
+                uint64_t bits = CFSwapInt64HostToLittle([value unsignedLongLongValue]);
+                writeByte(writer, FCModelBinaryTagUnsigned);
+                writeBytes(writer, &bits, sizeof(bits));
+                break;
+            }
+        }
+    } else if ([value isKindOfClass:NSData.class]) {
+        writeByte(writer, FCModelBinaryTagData);
+        writeVarint(writer, [value length]);
+        writeBytes(writer, [value bytes], [value length]);
+    } else if ([value isKindOfClass:NSDate.class]) {
+        writeByte(writer, FCModelBinaryTagDate);
+        writeDouble(writer, [value timeIntervalSinceReferenceDate]);
+    } else if ([value isKindOfClass:NSArray.class]) {
+        return writeArray(writer, value, error);
+    } else if ([value isKindOfClass:NSDictionary.class]) {
+        return writeDictionary(writer, value, error);
+    } else {
+        if (error) *error = unencodableValueError(value);
+        return NO;
+    }
+    return YES;
+}
+
+#pragma mark - Reading
+
+typedef struct {
+    const uint8_t *bytes;
+    const uint8_t *end;
+    NSUInteger depth;
+} FCModelBinaryReader;
+
+static inline BOOL readVarint(FCModelBinaryReader *reader, uint64_t *value)
+{
+    uint64_t result = 0;
+    for (int shift = 0; shift < 64 && reader->bytes < reader->end; shift += 7) {
+        uint8_t byte = *reader->bytes++;
+        result |= (uint64_t) (byte & 0x7F) << shift;
+        if (! (byte & 0x80)) {
+            *value = result;
+            return YES;
+        }
+    }
+    return NO;
+}
+
+// Rejects counts that couldn't fit in the remaining bytes, so malformed data can't cause huge allocations
+static inline BOOL readCount(FCModelBinaryReader *reader, size_t minimumBytesEach, NSUInteger *count)
+{
+    uint64_t value;
+    if (! readVarint(reader, &value) || value > (uint64_t) (reader->end - reader->bytes) / minimumBytesEach) return NO;
+    *count = (NSUInteger) value;
+    return YES;
+}
+
+static inline BOOL readUInt64(FCModelBinaryReader *reader, uint64_t *value)
+{
+    if (reader->end - reader->bytes < (ptrdiff_t) sizeof(uint64_t)) return NO;
+    memcpy(value, reader->bytes, sizeof(uint64_t));
+    *value = CFSwapInt64LittleToHost(*value);
+    reader->bytes += sizeof(uint64_t);
+    return YES;
+}
+
+static inline BOOL readDouble(FCModelBinaryReader *reader, double *value)
+{
+    uint64_t bits;
+    if (! readUInt64(reader, &bits)) return NO;
+    memcpy(value, &bits, sizeof(bits));
+    return YES;
+}
+
+static inline NSString *readString(FCModelBinaryReader *reader)
+{
+    NSUInteger length;
+    if (! readCount(reader, 1, &length)) return nil;
+    NSString *string = [[NSString alloc] initWithBytes:reader->bytes length:length encoding:NSUTF8StringEncoding];
+    reader->bytes += length;
+    return string;
+}
+
+static id readValue(FCModelBinaryReader *reader);
+
+// Reads count values with valueReader into a temporary strong buffer, then makes an immutable array or dictionary from them
+static NSArray *readArray(FCModelBinaryReader *reader, NSUInteger count, id (^valueReader)(void))
+{
+    __strong id *objects = (__strong id *) calloc(MAX(count, 1), sizeof(id));
+    NSUInteger readCount = 0;
+    while (readCount < count && (objects[readCount] = valueReader())) readCount++;
+    NSArray *array = readCount == count ? [NSArray arrayWithObjects:objects count:count] : nil;
+    for (NSUInteger i = 0; i < readCount; i++) objects[i] = nil;
+    free(objects);
+    return array;
+}
+
+static id readValue(FCModelBinaryReader *reader)
+{
+    if (reader->bytes >= reader->end || reader->depth >= FCModelBinaryCodecMaximumDepth) return nil;
+    uint8_t tag = *reader->bytes++;
+    NSUInteger count;
+
+    switch (tag) {
+        case FCModelBinaryTagTrue:  return @YES;
+        case FCModelBinaryTagFalse: return @NO;
+        case FCModelBinaryTagInteger: {
+            uint64_t zigzag;
+            if (! readVarint(reader, &zigzag)) return nil;
+            return @((int64_t) (zigzag >> 1) ^ -(int64_t) (zigzag & 1));
+        }
+        case FCModelBinaryTagUnsigned: {
+            uint64_t value;
+            return readUInt64(reader, &value) ? @(value) : nil;
+        }
+        case FCModelBinaryTagDouble: {
+            double value;
+            return readDouble(reader, &value) ? @(value) : nil;
+        }
+        case FCModelBinaryTagDate: {
+            double value;
+            return readDouble(reader, &value) ? [NSDate dateWithTimeIntervalSinceReferenceDate:value] : nil;
+        }
+        case FCModelBinaryTagString: return readString(reader);
+        case FCModelBinaryTagData: {
+            if (! readCount(reader, 1, &count)) return nil;
+            NSData *data = [NSData dataWithBytes:reader->bytes length:count];
+            reader->bytes += count;
+            return data;
+        }
+        case FCModelBinaryTagIntegerArray: {
+            if (! readCount(reader, 1, &count)) return nil;
+            return readArray(reader, count, ^id{
+                uint64_t zigzag;
+                return readVarint(reader, &zigzag) ? @((int64_t) (zigzag >> 1) ^ -(int64_t) (zigzag & 1)) : nil;
+            });
+        }
+        case FCModelBinaryTagDoubleArray: {
+            if (! readCount(reader, sizeof(double), &count)) return nil;
+            return readArray(reader, count, ^id{
+                double value;
+                return readDouble(reader, &value) ? @(value) : nil;
+            });
+        }
+        case FCModelBinaryTagArray: {
+            if (! readCount(reader, 1, &count)) return nil;
+            reader->depth++;
+            NSArray *array = readArray(reader, count, ^id{ return readValue(reader); });
+            reader->depth--;
+            return array;
+        }
+        case FCModelBinaryTagStringMap:
+        case FCModelBinaryTagDictionary: {
+            if (! readCount(reader, 2, &count)) return nil;
+            reader->depth++;
+            BOOL stringMap = (tag == FCModelBinaryTagStringMap);
+            NSArray *keysAndValues = readArray(reader, count * 2, ^id{ return stringMap ? readString(reader) : readValue(reader); });
+            reader->depth--;
+            if (! keysAndValues) return nil;
+
+            NSMutableDictionary *dictionary = [NSMutableDictionary dictionaryWithCapacity:count];
+            for (NSUInteger i = 0; i < count; i++) {
+                id key = keysAndValues[i * 2];
+                if (! [key conformsToProtocol:@protocol(NSCopying)]) return nil;
+                dictionary[key] = keysAndValues[i * 2 + 1];
+            }
+            return [dictionary copy];
+        }
+        default: return nil;
+    }
+}
+
+@implementation FCModelBinaryCodec
+
++ (instancetype)sharedCodec
+{
+    static FCModelBinaryCodec *codec;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{ codec = [self new]; });
+    return codec;
+}
+
+- (NSData *)dataFromValue:(id)value error:(NSError **)error
+{
+    FCModelBinaryWriter writer = { NULL, 0, 0 };
+    writerReserve(&writer, 64);
+    writeBytes(&writer, FCModelBinaryCodecMagic, sizeof(FCModelBinaryCodecMagic));
+    writeByte(&writer, FCModelBinaryCodecVersion);
+    if (! writeValue(&writer, value, error)) {
+        free(writer.bytes);
+        return nil;
+    }
+    return [NSData dataWithBytesNoCopy:writer.bytes length:writer.length freeWhenDone:YES];
+}
+
+- (id)valueFromData:(NSData *)data
+{
+    const uint8_t *bytes = data.bytes;
+    NSUInteger headerLength = sizeof(FCModelBinaryCodecMagic) + 1;
+    if (data.length < headerLength || memcmp(bytes, FCModelBinaryCodecMagic, sizeof(FCModelBinaryCodecMagic)) != 0) {
+        return [FCModelPropertyListCodec.sharedCodec valueFromData:data];
+    }
+    if (bytes[sizeof(FCModelBinaryCodecMagic)] != FCModelBinaryCodecVersion) return nil;
+
+    FCModelBinaryReader reader = { bytes + headerLength, bytes + data.length, 0 };
+    id value = readValue(&reader);
+    return reader.bytes == reader.end ? value : nil;
+}
+
+@end
@@ -18,15 +18,49 @@
 //  - inDatabase calls can be nested without deadlocking. (See execOnSelfSync: in implementation.)
 //  - Leaving any open FMResultSets after an inDatabase block raises an exception rather than logging a warning.
 //  - The FMDatabase object is exposed as a readonly property for advanced, careful use if necessary.
+//
+// Concurrent readers:
+//
+//  By default, every read and write is serialized on one connection. If initialized with maximumConcurrentReaders > 0,
+//   the database is switched to WAL journal mode and readDatabase: blocks are instead run on the calling thread with one of
+//   up to that many read-only connections, so reads no longer wait behind writes or each other. writeDatabase: stays serialized
+//   on the read-write connection, and any readDatabase: issued from inside a write block still uses the read-write connection
+//   so it sees that block's uncommitted changes.
+//
+//  inDatabase: always uses the serialized read-write connection.
+//
+// External changes:
+//
+//  After startMonitoringForExternalChanges, writes to the database or its -wal file by other processes or connections call
+//   [FCModel dataWasUpdatedExternally]. Files are watched with inotify on Linux and dispatch vnode sources elsewhere, along with
+//   their directory so a -wal file created or recreated after monitoring starts is watched too. Each burst of file events is
+//   confirmed with one PRAGMA data_version check, so this queue's own writes never trigger it and an external transaction
+//   triggers it once.
 
 @interface FCModelDatabaseQueue : NSOperationQueue
 
 - (instancetype)initWithDatabasePath:(NSString *)filename;
+- (instancetype)initWithDatabasePath:(NSString *)filename maximumConcurrentReaders:(NSUInteger)readerCount;
 - (void)startMonitoringForExternalChanges;
 - (void)readDatabase:(void (^)(FMDatabase *db))block;
 - (void)writeDatabase:(void (^)(FMDatabase *db))block;
+- (void)inDatabase:(void (^)(FMDatabase *db))block;
 - (void)close;
 
+// Returns a prepared statement cached for the given connection, preparing it from sqlBuilder's SQL on first use, or NULL if it
+//  can't be prepared. Each connection keeps its most recently used statements, up to a limit, and finalizes the rest unless
+//  they're being stepped. Only use it inside the database block that db was passed to, step it before asking for another, and
+//  sqlite3_reset it when done, even if an exception is raised.
+- (sqlite3_stmt *)cachedStatementForKey:(id <NSCopying>)key inDatabase:(FMDatabase *)db sqlBuilder:(NSString *(^)(void))sqlBuilder;
+
+// Runs a block on a private read-only connection that no other block uses, one block at a time, e.g. to prepare a statement
+//  with an authorizer set without replacing one the app set on the other connections. It can't see their temporary tables.
+- (void)inAnalysisDatabase:(void (^)(FMDatabase *db))block;
+
 @property (nonatomic, readonly) FMDatabase *database;
+@property (nonatomic, readonly) NSUInteger maximumConcurrentReaders;
+
+// Called on each read-only connection after it's opened, e.g. to register the same custom functions as the main connection.
+@property (nonatomic, copy) void (^readerInitializer)(FMDatabase *db);
 
 @end
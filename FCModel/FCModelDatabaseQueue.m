@@ -8,28 +8,79 @@
 #import "FCModelDatabaseQueue.h"
 #import "FCModel.h"
 
-#define kSQLiteFileChangeCounterOffset 24
+#if defined(__linux__)
+#include <sys/inotify.h>
+#endif
+
+#define kExternalChangeCheckDelay (50 * NSEC_PER_MSEC) // file events within this long of each other share one data_version check
+#define kMaximumCachedStatementsPerConnection 128
+
+// One connection's prepared statements, with keys in least to most recently used order
+@interface FCModelStatementCache : NSObject
+@property (nonatomic, readonly) NSMutableDictionary *statements; // key -> NSValue of sqlite3_stmt *
+@property (nonatomic, readonly) NSMutableOrderedSet *recentKeys;
+@end
+
+@implementation FCModelStatementCache
+- (instancetype)init
+{
+    if ( (self = [super init]) ) {
+        _statements = [NSMutableDictionary dictionary];
+        _recentKeys = [NSMutableOrderedSet orderedSet];
+    }
+    return self;
+}
+@end
 
 @interface FCModelDatabaseQueue () {
-    int changeCounterReadFileDescriptor;
-    int dispatchEventFileDescriptor;
-    dispatch_source_t dispatchFileWriteSource;
+    dispatch_source_t databaseFileEventSource; // on Linux, the inotify watch of the database's directory
+    dispatch_source_t walFileEventSource;       // elsewhere, replaced on dispatchFileWriteQueue as the -wal file comes and goes
+    dispatch_source_t directoryEventSource;     // elsewhere, watches for the -wal file being created
     dispatch_queue_t dispatchFileWriteQueue;
+    BOOL externalChangeCheckScheduled; // only used on dispatchFileWriteQueue
+    int64_t lastDataVersion;           // only used on this queue
+    BOOL monitoringForExternalChanges; // only used on this queue
+
+    dispatch_semaphore_t readerAvailability;
+    dispatch_semaphore_t readerPoolLock;
+    NSMutableArray *idleReaders;
+    NSMutableArray *allReaders;
+
+    dispatch_semaphore_t statementCacheLock;
+    NSMutableDictionary *statementCachesByConnection; // NSValue of FMDatabase -> FCModelStatementCache
+
+    dispatch_semaphore_t analysisDatabaseLock;
+    FMDatabase *analysisDatabase; // opened on first use of inAnalysisDatabase:
 }
 @property (nonatomic) FMDatabase *openDatabase;
 @property (nonatomic) NSString *path;
-@property (nonatomic) BOOL inExpectedWrite;
+@property (nonatomic) NSUInteger maximumConcurrentReaders;
+@property (nonatomic) NSString *readerThreadDictionaryKey;
 @end
 
 @implementation FCModelDatabaseQueue
 
-- (instancetype)initWithDatabasePath:(NSString *)path
+- (instancetype)initWithDatabasePath:(NSString *)path { return [self initWithDatabasePath:path maximumConcurrentReaders:0]; }
+
+- (instancetype)initWithDatabasePath:(NSString *)path maximumConcurrentReaders:(NSUInteger)readerCount
 {
     if ( (self = [super init]) ) {
         self.name = NSStringFromClass(self.class);
         self.maxConcurrentOperationCount = 1;
         self.path = path;
+        self.maximumConcurrentReaders = readerCount;
         dispatchFileWriteQueue = dispatch_queue_create(NULL, NULL);
+        statementCacheLock = dispatch_semaphore_create(1);
+        statementCachesByConnection = [NSMutableDictionary dictionary];
+        analysisDatabaseLock = dispatch_semaphore_create(1);
+
+        if (readerCount) {
+            self.readerThreadDictionaryKey = [NSString stringWithFormat:@"FCModelDatabaseQueueReader-%p", self];
+            readerAvailability = dispatch_semaphore_create((long) readerCount);
+            readerPoolLock = dispatch_semaphore_create(1);
+            idleReaders = [NSMutableArray arrayWithCapacity:readerCount];
+            allReaders = [NSMutableArray arrayWithCapacity:readerCount];
+        }
     }
     return self;
 }
@@ -37,30 +88,256 @@
 - (FMDatabase *)database
 {
     if (! self.openDatabase) [self execOnSelfSync:^{
-        self.openDatabase = [[FMDatabase alloc] initWithPath:_path];
-        if (! [_openDatabase open]) {
+        if (_openDatabase) return;
+        FMDatabase *db = [[FMDatabase alloc] initWithPath:_path];
+        if (! [db open]) {
             [[NSException exceptionWithName:NSGenericException reason:[NSString stringWithFormat:@"Cannot open or create database at path: %@", _path] userInfo:nil] raise];
         }
+
+        if (_maximumConcurrentReaders) {
+            // Readers can only run alongside the writer in WAL mode. The journal mode is persistent, so readers don't need to set it.
+            FMResultSet *rs = [db executeQuery:@"PRAGMA journal_mode = WAL"];
+            NSString *journalMode = [rs next] ? [rs stringForColumnIndex:0] : nil;
+            [rs close];
+            if (! [journalMode.lowercaseString isEqualToString:@"wal"]) {
+                NSLog(@"[FCModel] Warning: cannot enable WAL mode (journal_mode is %@), so readers will be serialized with writes", journalMode);
+            }
+        }
+
+        self.openDatabase = db;
     }];
     return self.openDatabase;
 }
 
+#pragma mark - Reader pool
+
+- (FMDatabase *)checkOutReader
+{
+    dispatch_semaphore_wait(readerAvailability, DISPATCH_TIME_FOREVER);
+    dispatch_semaphore_wait(readerPoolLock, DISPATCH_TIME_FOREVER);
+    FMDatabase *reader = idleReaders.lastObject;
+    if (reader) [idleReaders removeLastObject];
+    dispatch_semaphore_signal(readerPoolLock);
+    if (reader) return reader;
+
+    @try {
+        reader = [self openReader];
+    } @catch (NSException *e) {
+        dispatch_semaphore_signal(readerAvailability);
+        @throw;
+    }
+
+    dispatch_semaphore_wait(readerPoolLock, DISPATCH_TIME_FOREVER);
+    [allReaders addObject:reader];
+    dispatch_semaphore_signal(readerPoolLock);
+    return reader;
+}
+
+// Connection settings are per-connection, so this is the only place readers are configured, once each.
+- (FMDatabase *)openReader
+{
+    [self database]; // the writer must exist first so the file is created and in WAL mode
+
+    FMDatabase *reader = [[FMDatabase alloc] initWithPath:_path];
+    if (! [reader openWithFlags:SQLITE_OPEN_READONLY]) {
+        [[NSException exceptionWithName:NSGenericException reason:[NSString stringWithFormat:@"Cannot open read-only connection to database at path: %@", _path] userInfo:nil] raise];
+    }
+    [[reader executeQuery:@"PRAGMA busy_timeout = 10000"] close];
+    if (_readerInitializer) _readerInitializer(reader);
+    return reader;
+}
+
+- (void)checkInReader:(FMDatabase *)reader
+{
+    dispatch_semaphore_wait(readerPoolLock, DISPATCH_TIME_FOREVER);
+    if ([allReaders containsObject:reader]) [idleReaders addObject:reader];
+    dispatch_semaphore_signal(readerPoolLock);
+    dispatch_semaphore_signal(readerAvailability);
+}
+
+- (void)readFromReader:(FMDatabase *)reader block:(void (^)(FMDatabase *db))block
+{
+    BOOL hadOpenResultSetsBefore = reader.hasOpenResultSets;
+    block(reader);
+    if (reader.hasOpenResultSets != hadOpenResultSetsBefore) [[NSException exceptionWithName:NSGenericException reason:@"FCModelDatabaseQueue has an open FMResultSet after inDatabase:" userInfo:nil] raise];
+}
+
+- (void)inAnalysisDatabase:(void (^)(FMDatabase *db))block
+{
+    dispatch_semaphore_wait(analysisDatabaseLock, DISPATCH_TIME_FOREVER);
+    @try {
+        if (! analysisDatabase) analysisDatabase = [self openReader];
+        [self readFromReader:analysisDatabase block:block];
+    } @finally {
+        dispatch_semaphore_signal(analysisDatabaseLock);
+    }
+}
+
+- (void)closeAnalysisDatabase
+{
+    dispatch_semaphore_wait(analysisDatabaseLock, DISPATCH_TIME_FOREVER);
+    [analysisDatabase close];
+    analysisDatabase = nil;
+    dispatch_semaphore_signal(analysisDatabaseLock);
+}
+
+- (void)closeReaders
+{
+    if (! _maximumConcurrentReaders) return;
+
+    // Take every permit so no reader is in use, close them all, then give the permits back
+    for (NSUInteger i = 0; i < _maximumConcurrentReaders; i++) dispatch_semaphore_wait(readerAvailability, DISPATCH_TIME_FOREVER);
+
+    dispatch_semaphore_wait(readerPoolLock, DISPATCH_TIME_FOREVER);
+    for (FMDatabase *reader in allReaders) {
+        [self finalizeCachedStatementsInDatabase:reader];
+        [reader close];
+    }
+    [allReaders removeAllObjects];
+    [idleReaders removeAllObjects];
+    dispatch_semaphore_signal(readerPoolLock);
+
+    for (NSUInteger i = 0; i < _maximumConcurrentReaders; i++) dispatch_semaphore_signal(readerAvailability);
+}
+
+// File events only say that something wrote to the database or its -wal file, which includes this process's own writes and
+//  uncommitted pages. Each burst of them is coalesced into one check of PRAGMA data_version on the read-write connection, which
+//  only changes when another connection commits, so each external transaction causes one dataWasUpdatedExternally.
 - (void)startMonitoringForExternalChanges
 {
     if (! self.openDatabase) [[NSException exceptionWithName:NSGenericException reason:@"Database must be open" userInfo:nil] raise];
     
-    const char *fsp = _path.fileSystemRepresentation;
-    changeCounterReadFileDescriptor = open(fsp, O_RDONLY);
-    dispatchEventFileDescriptor = open(fsp, O_EVTONLY);
-    dispatchFileWriteSource = dispatch_source_create(DISPATCH_SOURCE_TYPE_VNODE, dispatchEventFileDescriptor, DISPATCH_VNODE_WRITE, dispatchFileWriteQueue);
+    [self execOnSelfSync:^{
+        [self dataVersionChanged];
+        monitoringForExternalChanges = YES;
+    }];
 
     __weak typeof(self) weakSelf = self;
-    dispatch_source_set_event_handler(dispatchFileWriteSource, ^{
+    void (^fileChanged)(void) = ^{ [weakSelf scheduleExternalChangeCheck]; };
+
+#if defined(__linux__)
+    // inotify can't watch a -wal file that doesn't exist yet, so the directory is watched and its events filtered by name
+    NSString *directory = _path.stringByDeletingLastPathComponent.length ? _path.stringByDeletingLastPathComponent : @".";
+    int inotifyFileDescriptor = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotifyFileDescriptor < 0 || inotify_add_watch(inotifyFileDescriptor, directory.fileSystemRepresentation, IN_MODIFY | IN_CREATE | IN_MOVED_TO) < 0) {
+        NSLog(@"[FCModel] Warning: cannot monitor %@ for external changes: %s", _path, strerror(errno));
+        if (inotifyFileDescriptor >= 0) close(inotifyFileDescriptor);
+        return;
+    }
+
+    NSString *databaseName = _path.lastPathComponent;
+    NSString *walName = [databaseName stringByAppendingString:@"-wal"];
+    databaseFileEventSource = dispatch_source_create(DISPATCH_SOURCE_TYPE_READ, (uintptr_t) inotifyFileDescriptor, 0, dispatchFileWriteQueue);
+    dispatch_source_set_event_handler(databaseFileEventSource, ^{
+        char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+        BOOL databaseChanged = NO;
+        ssize_t length;
+        while ( (length = read(inotifyFileDescriptor, buffer, sizeof(buffer))) > 0) {
+            for (char *eventBytes = buffer; eventBytes < buffer + length; ) {
+                struct inotify_event *event = (struct inotify_event *) eventBytes;
+                if (event->len) {
+                    NSString *name = [NSString stringWithUTF8String:event->name];
+                    if ([name isEqualToString:databaseName] || [name isEqualToString:walName]) databaseChanged = YES;
+                }
+                eventBytes += sizeof(struct inotify_event) + event->len;
+            }
+        }
+        if (databaseChanged) fileChanged();
+    });
+    dispatch_source_set_cancel_handler(databaseFileEventSource, ^{ close(inotifyFileDescriptor); });
+    dispatch_resume(databaseFileEventSource);
+#else
+    // The -wal file may not exist yet, and SQLite deletes it when the last connection closes, so its directory is also watched
+    //  for new entries and the -wal file's source is recreated whenever it's missing
+    NSString *directory = _path.stringByDeletingLastPathComponent.length ? _path.stringByDeletingLastPathComponent : @".";
+    dispatch_sync(dispatchFileWriteQueue, ^{
+        databaseFileEventSource = [self fileEventSourceForPath:_path mask:(DISPATCH_VNODE_WRITE | DISPATCH_VNODE_EXTEND) handler:^(unsigned long events) { fileChanged(); }];
+        directoryEventSource = [self fileEventSourceForPath:directory mask:DISPATCH_VNODE_WRITE handler:^(unsigned long events) {
+            if ([weakSelf watchWALFileIfNeededWithHandler:fileChanged]) fileChanged();
+        }];
+        [self watchWALFileIfNeededWithHandler:fileChanged];
+    });
+#endif
+}
+
+#if ! defined(__linux__)
+// NULL if the file doesn't exist. The handler is passed the source's DISPATCH_VNODE_* events.
+- (dispatch_source_t)fileEventSourceForPath:(NSString *)path mask:(unsigned long)mask handler:(void (^)(unsigned long events))handler
+{
+    int fileDescriptor = open(path.fileSystemRepresentation, O_EVTONLY);
+    if (fileDescriptor < 0) return NULL;
+
+    dispatch_source_t source = dispatch_source_create(DISPATCH_SOURCE_TYPE_VNODE, (uintptr_t) fileDescriptor, mask, dispatchFileWriteQueue);
+    __weak dispatch_source_t weakSource = source;
+    dispatch_source_set_event_handler(source, ^{
+        dispatch_source_t strongSource = weakSource;
+        if (strongSource) handler(dispatch_source_get_data(strongSource));
+    });
+    dispatch_source_set_cancel_handler(source, ^{ close(fileDescriptor); });
+    dispatch_resume(source);
+    return source;
+}
+
+// Called on dispatchFileWriteQueue. Starts watching the -wal file if it exists and isn't already watched, and returns whether
+//  it did. A deleted or renamed -wal file's source is cancelled, since it would never fire again.
+- (BOOL)watchWALFileIfNeededWithHandler:(void (^)(void))fileChanged
+{
+    if (walFileEventSource) return NO;
+
+    __weak typeof(self) weakSelf = self;
+    unsigned long mask = DISPATCH_VNODE_WRITE | DISPATCH_VNODE_EXTEND | DISPATCH_VNODE_DELETE | DISPATCH_VNODE_RENAME;
+    walFileEventSource = [self fileEventSourceForPath:[_path stringByAppendingString:@"-wal"] mask:mask handler:^(unsigned long events) {
+        __strong typeof(self) strongSelf = weakSelf;
+        if (strongSelf && (events & (DISPATCH_VNODE_DELETE | DISPATCH_VNODE_RENAME)) && strongSelf->walFileEventSource) {
+            dispatch_source_cancel(strongSelf->walFileEventSource);
+            strongSelf->walFileEventSource = NULL;
+            [strongSelf watchWALFileIfNeededWithHandler:fileChanged];
+        }
+        fileChanged();
+    }];
+    return walFileEventSource != NULL;
+}
+#endif
+
+// Called on dispatchFileWriteQueue
+- (void)scheduleExternalChangeCheck
+{
+    if (externalChangeCheckScheduled) return;
+    externalChangeCheckScheduled = YES;
+
+    __weak typeof(self) weakSelf = self;
+    dispatch_after(dispatch_time(DISPATCH_TIME_NOW, kExternalChangeCheckDelay), dispatchFileWriteQueue, ^{
         __strong typeof(self) strongSelf = weakSelf;
-        if (strongSelf && ! strongSelf.inExpectedWrite) [FCModel dataWasUpdatedExternally];
+        if (! strongSelf) return;
+        strongSelf->externalChangeCheckScheduled = NO;
+        [strongSelf addOperationWithBlock:^{
+            if ([strongSelf dataVersionChanged]) [strongSelf notifyExternalChange];
+        }];
     });
+}
 
-    dispatch_resume(dispatchFileWriteSource);
+// Called on this queue. dataWasUpdatedExternally reloads instances with more database blocks and may post notifications right
+//  where it's called, to observers that may wait on something held by a thread that's waiting on this queue, so it's called
+//  from another queue instead.
+- (void)notifyExternalChange
+{
+    dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{ [FCModel dataWasUpdatedExternally]; });
+}
+
+// Must be called on this queue. Returns whether another connection has committed since the last call.
+- (BOOL)dataVersionChanged
+{
+    FMDatabase *db = self.openDatabase;
+    if (! db) return NO;
+
+    sqlite3_stmt *statement = [self cachedStatementForKey:@"FCModelDatabaseQueue.dataVersion" inDatabase:db sqlBuilder:^NSString *{ return @"PRAGMA data_version"; }];
+    if (! statement) return NO;
+    int64_t dataVersion = sqlite3_step(statement) == SQLITE_ROW ? sqlite3_column_int64(statement, 0) : lastDataVersion;
+    sqlite3_reset(statement);
+
+    if (dataVersion == lastDataVersion) return NO;
+    lastDataVersion = dataVersion;
+    return YES;
 }
 
 - (void)execOnSelfSync:(void (^)())block
@@ -75,56 +352,107 @@
 
 - (void)close
 {
-    [self execOnSelfSync:^{
-        dispatch_source_cancel(dispatchFileWriteSource);
-        dispatchFileWriteSource = NULL;
+    [self closeReaders];
+    [self closeAnalysisDatabase];
 
-        close(dispatchEventFileDescriptor);
-        dispatchEventFileDescriptor = 0;
+    [self execOnSelfSync:^{
+        // On dispatchFileWriteQueue, so an event handler can't be recreating the -wal file's source at the same time
+        dispatch_sync(dispatchFileWriteQueue, ^{
+            if (databaseFileEventSource) dispatch_source_cancel(databaseFileEventSource);
+            if (walFileEventSource) dispatch_source_cancel(walFileEventSource);
+            if (directoryEventSource) dispatch_source_cancel(directoryEventSource);
+            databaseFileEventSource = NULL;
+            walFileEventSource = NULL;
+            directoryEventSource = NULL;
+        });
 
-        close(changeCounterReadFileDescriptor);
-        changeCounterReadFileDescriptor = 0;
+        monitoringForExternalChanges = NO;
 
+        if (self.openDatabase) [self finalizeCachedStatementsInDatabase:self.openDatabase];
         [self.openDatabase close];
         self.openDatabase = nil;
     }];
 }
 
+#pragma mark - Statement cache
+
+// Each connection's cache is only touched by whoever is using that connection, so only the outer lookup needs the lock.
+- (FCModelStatementCache *)statementCacheForDatabase:(FMDatabase *)db create:(BOOL)create
+{
+    NSValue *connectionKey = [NSValue valueWithNonretainedObject:db];
+    dispatch_semaphore_wait(statementCacheLock, DISPATCH_TIME_FOREVER);
+    FCModelStatementCache *cache = statementCachesByConnection[connectionKey];
+    if (! cache && create) cache = statementCachesByConnection[connectionKey] = [FCModelStatementCache new];
+    dispatch_semaphore_signal(statementCacheLock);
+    return cache;
+}
+
+- (sqlite3_stmt *)cachedStatementForKey:(id <NSCopying>)key inDatabase:(FMDatabase *)db sqlBuilder:(NSString *(^)(void))sqlBuilder
+{
+    FCModelStatementCache *cache = [self statementCacheForDatabase:db create:YES];
+    sqlite3_stmt *statement = [cache.statements[key] pointerValue];
+    if (statement) {
+        [cache.recentKeys removeObject:key];
+        [cache.recentKeys addObject:key];
+        return statement;
+    }
+
+    if (SQLITE_OK != sqlite3_prepare_v2(db.sqliteHandle, sqlBuilder().UTF8String, -1, &statement, NULL)) {
+        sqlite3_finalize(statement);
+        return NULL;
+    }
+
+    // Queries can come from arbitrary SQL, so the least recently used statements are finalized to stay within the limit.
+    //  Any that are still being stepped, e.g. by an enclosing block, are skipped.
+    NSUInteger keyIndex = 0;
+    while (cache.statements.count >= kMaximumCachedStatementsPerConnection && keyIndex < cache.recentKeys.count) {
+        id oldKey = cache.recentKeys[keyIndex];
+        sqlite3_stmt *oldStatement = [cache.statements[oldKey] pointerValue];
+        if (sqlite3_stmt_busy(oldStatement)) {
+            keyIndex++;
+            continue;
+        }
+        sqlite3_finalize(oldStatement);
+        [cache.statements removeObjectForKey:oldKey];
+        [cache.recentKeys removeObjectAtIndex:keyIndex];
+    }
+
+    cache.statements[key] = [NSValue valueWithPointer:statement];
+    [cache.recentKeys addObject:key];
+    return statement;
+}
+
+- (void)finalizeCachedStatementsInDatabase:(FMDatabase *)db
+{
+    FCModelStatementCache *cache = [self statementCacheForDatabase:db create:NO];
+    for (NSValue *statement in cache.statements.objectEnumerator) sqlite3_finalize(statement.pointerValue);
+
+    dispatch_semaphore_wait(statementCacheLock, DISPATCH_TIME_FOREVER);
+    [statementCachesByConnection removeObjectForKey:[NSValue valueWithNonretainedObject:db]];
+    dispatch_semaphore_signal(statementCacheLock);
+}
+
 - (void)dealloc
 {
+    [analysisDatabase close];
+    if (_openDatabase) [self finalizeCachedStatementsInDatabase:_openDatabase];
     [_openDatabase close];
     self.openDatabase = nil;
 }
 
+// Reads add no work around the block. Writes compare sqlite3_total_changes, an in-process counter, and only if the block changed
+//  something check data_version, to catch another process's commit that landed during the write before the file monitor does.
 - (void (^)())databaseBlockWithBlock:(void (^)(FMDatabase *db))block readOnly:(BOOL)readOnly {
     FMDatabase *db = self.database;
     return ^{
         BOOL hadOpenResultSetsBefore = db.hasOpenResultSets;
-        if (! readOnly) _inExpectedWrite = YES;
-
-        // Read change counter from SQLite file header to detect changes made by other processes during this write
-        uint32_t changeCounterBeforeBlock = 0;
-        if (changeCounterReadFileDescriptor > 0) {
-            lseek(changeCounterReadFileDescriptor, kSQLiteFileChangeCounterOffset, SEEK_SET);
-            read(changeCounterReadFileDescriptor, &changeCounterBeforeBlock, sizeof(uint32_t));
-            changeCounterBeforeBlock = CFSwapInt32BigToHost(changeCounterBeforeBlock);
-        }
-        
-        block(db);
+        int totalChangesBefore = readOnly ? 0 : sqlite3_total_changes(db.sqliteHandle);
 
-        dispatch_sync(dispatchFileWriteQueue, ^{
-            _inExpectedWrite = NO;
-            
-            // if more than 1 change during this expected write, either there's 2 queries in it (unexpected) or another process changed it
-            uint32_t changeCounterAfterBlock = 0;
-            if (changeCounterReadFileDescriptor > 0) {
-                lseek(changeCounterReadFileDescriptor, kSQLiteFileChangeCounterOffset, SEEK_SET);
-                read(changeCounterReadFileDescriptor, &changeCounterAfterBlock, sizeof(uint32_t));
-                changeCounterAfterBlock = CFSwapInt32BigToHost(changeCounterAfterBlock);
-            }
+        block(db);
 
-            if (changeCounterAfterBlock - changeCounterBeforeBlock > 1) [FCModel dataWasUpdatedExternally];
-        });
+        if (! readOnly && monitoringForExternalChanges && sqlite3_total_changes(db.sqliteHandle) != totalChangesBefore && [self dataVersionChanged]) {
+            [self notifyExternalChange];
+        }
 
         if (db.hasOpenResultSets != hadOpenResultSetsBefore) [[NSException exceptionWithName:NSGenericException reason:@"FCModelDatabaseQueue has an open FMResultSet after inDatabase:" userInfo:nil] raise];
     };
@@ -132,9 +460,31 @@
 
 - (void)readDatabase:(void (^)(FMDatabase *db))block
 {
-    [self execOnSelfSync:[self databaseBlockWithBlock:block readOnly:YES]];
+    if (! _maximumConcurrentReaders || NSOperationQueue.currentQueue == self) {
+        [self execOnSelfSync:[self databaseBlockWithBlock:block readOnly:YES]];
+        return;
+    }
+
+    // Nested reads on the same thread reuse that thread's reader, so they can't deadlock on an exhausted pool
+    NSMutableDictionary *threadDictionary = NSThread.currentThread.threadDictionary;
+    FMDatabase *reader = threadDictionary[_readerThreadDictionaryKey];
+    if (reader) {
+        [self readFromReader:reader block:block];
+        return;
+    }
+
+    reader = [self checkOutReader];
+    threadDictionary[_readerThreadDictionaryKey] = reader;
+    @try {
+        [self readFromReader:reader block:block];
+    } @finally {
+        [threadDictionary removeObjectForKey:_readerThreadDictionaryKey];
+        [self checkInReader:reader];
+    }
 }
 
+- (void)inDatabase:(void (^)(FMDatabase *db))block { [self writeDatabase:block]; }
+
 - (void)writeDatabase:(void (^)(FMDatabase *db))block
 {
     [self execOnSelfSync:[self databaseBlockWithBlock:block readOnly:NO]];
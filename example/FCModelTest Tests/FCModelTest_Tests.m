@@ -7,20 +7,35 @@
 //
 
 #import <XCTest/XCTest.h>
+#import <objc/runtime.h>
+#import <stdatomic.h>
+#import <sqlite3.h>
 #import "FCModel.h"
+#import "FCModelCachedObject.h"
 #import "SimpleModel.h"
 #import "SimplerModel.h"
+#import "TrackedModel.h"
 
-@interface FCModelTest_Tests : XCTestCase
+@interface FCModelTest_Tests : XCTestCase {
+    NSUInteger observedChangeCount;
+}
 
 @end
 
+static int countingAuthorizer(void *context, int action, const char *a, const char *b, const char *c, const char *d)
+{
+    (*(int *) context)++;
+    return SQLITE_OK;
+}
+
 @implementation FCModelTest_Tests
 
 - (void)setUp
 {
     [super setUp];
     [NSFileManager.defaultManager removeItemAtPath:[self dbPath] error:NULL];
+    [NSFileManager.defaultManager removeItemAtPath:[[self dbPath] stringByAppendingString:@"-wal"] error:NULL];
+    [NSFileManager.defaultManager removeItemAtPath:[[self dbPath] stringByAppendingString:@"-shm"] error:NULL];
     [self openDatabase];
 }
 
@@ -503,12 +518,1375 @@
     [NSNotificationCenter.defaultCenter removeObserver:observer];
 }
 
+- (void)testConcurrentReaders
+{
+    [FCModel closeDatabase];
+    [self openDatabaseWithMaximumConcurrentReaders:8];
+
+    [SimpleModel inDatabaseSync:^(FMDatabase *db) {
+        [db beginTransaction];
+        for (int i = 0; i < 2000; i++) {
+            [db executeUpdate:@"INSERT INTO SimpleModel (uniqueID, name, mixedcase) VALUES (?, ?, ?)", [NSString stringWithFormat:@"r%d", i], @"reader", @(i)];
+        }
+        [db commit];
+    }];
+
+    int queriesPerThread = 200;
+    for (NSNumber *threadCountNumber in @[ @1, @2, @4, @8 ]) {
+        int threadCount = threadCountNumber.intValue;
+        __block atomic_int wrongResults = 0;
+        dispatch_group_t group = dispatch_group_create();
+        for (int t = 0; t < threadCount; t++) {
+            dispatch_group_async(group, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+                for (int q = 0; q < queriesPerThread; q++) {
+                    NSNumber *count = [SimpleModel firstValueFromQuery:@"SELECT COUNT(*) FROM $T WHERE name = ? AND mixedcase >= ?", @"reader", @(q)];
+                    if (count.intValue != 2000 - q) atomic_fetch_add_explicit(&wrongResults, 1, memory_order_relaxed);
+                }
+            });
+        }
+        dispatch_group_wait(group, DISPATCH_TIME_FOREVER);
+        XCTAssert(wrongResults == 0, @"%d readers got %d wrong results", threadCount, wrongResults);
+    }
+
+    // Reads from inside a write must see its uncommitted changes
+    [SimpleModel inDatabaseSync:^(FMDatabase *db) {
+        [db beginTransaction];
+        [db executeUpdate:@"DELETE FROM SimpleModel"];
+        XCTAssert([SimpleModel numberOfInstances] == 0);
+        [db rollback];
+    }];
+    XCTAssert([SimpleModel numberOfInstances] == 2000);
+}
+
+- (void)testConcurrentReadersPerformance
+{
+    [FCModel closeDatabase];
+    [self openDatabaseWithMaximumConcurrentReaders:8];
+
+    [SimpleModel inDatabaseSync:^(FMDatabase *db) {
+        [db beginTransaction];
+        for (int i = 0; i < 2000; i++) {
+            [db executeUpdate:@"INSERT INTO SimpleModel (uniqueID, name, mixedcase) VALUES (?, ?, ?)", [NSString stringWithFormat:@"r%d", i], @"reader", @(i)];
+        }
+        [db commit];
+    }];
+
+    [self measureBlock:^{
+        dispatch_apply(8, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t t) {
+            for (int q = 0; q < 200; q++) [SimpleModel firstValueFromQuery:@"SELECT COUNT(*) FROM $T WHERE name = ? AND mixedcase >= ?", @"reader", @(q)];
+        });
+    }];
+}
+
+- (void)testTransactions
+{
+    __block int insertNotifications = 0;
+    id observer = [NSNotificationCenter.defaultCenter addObserverForName:FCModelInsertNotification object:SimplerModel.class queue:nil usingBlock:^(NSNotification *n) {
+        insertNotifications++;
+    }];
+
+    NSMutableArray *instances = [NSMutableArray array];
+    BOOL committed = [FCModel performTransaction:^BOOL{
+        for (int i = 0; i < 1000; i++) {
+            SimplerModel *instance = [SimplerModel new];
+            instance.title = @"bulk";
+            [instance save];
+            [instances addObject:instance];
+        }
+        XCTAssert(insertNotifications == 0, @"Received %d insert notifications before commit", insertNotifications);
+        return YES;
+    }];
+    XCTAssertTrue(committed);
+    XCTAssert(insertNotifications == 1000, @"Received %d insert notifications after commit", insertNotifications);
+    XCTAssert([SimplerModel numberOfInstancesWhere:@"title = ?", @"bulk"] == 1000);
+
+    // Rolling back the outer transaction discards everything, including a committed inner transaction
+    insertNotifications = 0;
+    SimplerModel *rolledBack = [SimplerModel new];
+    rolledBack.title = @"rolledBack";
+    SimplerModel *innerRolledBack = [SimplerModel new];
+    innerRolledBack.title = @"rolledBack";
+    SimplerModel *deleted = instances[0];
+    committed = [FCModel performTransaction:^BOOL{
+        [rolledBack save];
+        [deleted delete];
+        [FCModel performTransaction:^BOOL{
+            [innerRolledBack save];
+            return YES;
+        }];
+        return NO;
+    }];
+    XCTAssertFalse(committed);
+    XCTAssert(insertNotifications == 0, @"Received %d insert notifications after rollback", insertNotifications);
+    XCTAssertFalse(rolledBack.existsInDatabase);
+    XCTAssertFalse(innerRolledBack.existsInDatabase);
+    XCTAssertTrue(rolledBack.hasUnsavedChanges);
+    XCTAssertTrue(deleted.existsInDatabase && ! deleted.isDeleted);
+    XCTAssertTrue([SimplerModel instanceWithPrimaryKey:@(deleted.id)] == deleted);
+    XCTAssert([SimplerModel numberOfInstancesWhere:@"title = ?", @"rolledBack"] == 0);
+    XCTAssert([SimplerModel numberOfInstancesWhere:@"title = ?", @"bulk"] == 1000);
+
+    // Rolling back an inner transaction keeps the outer one's changes
+    SimplerModel *kept = [SimplerModel new];
+    kept.title = @"kept";
+    SimplerModel *discarded = [SimplerModel new];
+    discarded.title = @"discarded";
+    committed = [FCModel performTransaction:^BOOL{
+        [kept save];
+        BOOL innerCommitted = [FCModel performTransaction:^BOOL{
+            [discarded save];
+            return NO;
+        }];
+        XCTAssertFalse(innerCommitted);
+        return YES;
+    }];
+    XCTAssertTrue(committed);
+    XCTAssertTrue(kept.existsInDatabase);
+    XCTAssertFalse(discarded.existsInDatabase);
+    XCTAssert(insertNotifications == 1, @"Received %d insert notifications after partial rollback", insertNotifications);
+
+    [NSNotificationCenter.defaultCenter removeObserver:observer];
+}
+
+- (void)testSaveAll
+{
+    NSMutableArray *instances = [NSMutableArray array];
+    for (int i = 0; i < 100; i++) {
+        SimplerModel *instance = [SimplerModel new];
+        instance.title = @"unsaved";
+        [instances addObject:instance];
+    }
+    SimpleModel *otherClassInstance = [SimpleModel new];
+    otherClassInstance.name = @"unsaved";
+
+    __block int insertNotifications = 0;
+    __block NSUInteger insertedInstanceCount = 0;
+    id observer = [NSNotificationCenter.defaultCenter addObserverForName:FCModelInsertNotification object:SimplerModel.class queue:nil usingBlock:^(NSNotification *n) {
+        insertNotifications++;
+        insertedInstanceCount += [n.userInfo[FCModelInstanceSetKey] count];
+    }];
+
+    [SimplerModel saveAll];
+    XCTAssert(insertNotifications == 1, @"Received %d insert notifications", insertNotifications);
+    XCTAssert(insertedInstanceCount == 100, @"Insert notification contained %lu instances", (unsigned long) insertedInstanceCount);
+    for (SimplerModel *instance in instances) XCTAssertTrue(instance.existsInDatabase);
+    XCTAssertFalse(otherClassInstance.existsInDatabase);
+
+    insertNotifications = 0;
+    [SimplerModel saveAll];
+    XCTAssert(insertNotifications == 0, @"Saving without changes sent %d insert notifications", insertNotifications);
+
+    [FCModel saveAll];
+    XCTAssertTrue(otherClassInstance.existsInDatabase);
+
+    [NSNotificationCenter.defaultCenter removeObserver:observer];
+}
+
+
+- (void)testSaveStatementCache
+{
+    SimpleModel *entity = [SimpleModel instanceWithPrimaryKey:@"statements"];
+    entity.name = @"first";
+    XCTAssert([entity save] == FCModelSaveSucceeded);
+
+    // Different changed-column sets must each get their own statement
+    entity.name = @"second";
+    XCTAssert([entity save] == FCModelSaveSucceeded);
+    entity.lowercase = @"changed";
+    entity.name = @"third";
+    XCTAssert([entity save] == FCModelSaveSucceeded);
+    XCTAssert([[SimpleModel firstValueFromQuery:@"SELECT name FROM $T WHERE $PK = ?", @"statements"] isEqualToString:@"third"]);
+    XCTAssert([[SimpleModel firstValueFromQuery:@"SELECT lowercase FROM $T WHERE $PK = ?", @"statements"] isEqualToString:@"changed"]);
+
+    XCTAssert([entity delete] == FCModelSaveSucceeded);
+    XCTAssert([SimpleModel numberOfInstances] == 0);
+
+    // Closing finalizes the cached statements, and the new connection prepares its own
+    entity = nil;
+    [FCModel closeDatabase];
+    [self openDatabase];
+    entity = [SimpleModel instanceWithPrimaryKey:@"statements"];
+    entity.name = @"reopened";
+    XCTAssert([entity save] == FCModelSaveSucceeded);
+    XCTAssert([[SimpleModel firstValueFromQuery:@"SELECT name FROM $T WHERE $PK = ?", @"statements"] isEqualToString:@"reopened"]);
+
+    // Repeated saves of the same changed columns reuse one prepared statement
+    entity.name = @"reused 0";
+    XCTAssert([entity save] == FCModelSaveSucceeded);
+    int statementCount = [self preparedStatementCount];
+    for (int i = 1; i <= 100; i++) {
+        entity.name = [NSString stringWithFormat:@"reused %d", i];
+        XCTAssert([entity save] == FCModelSaveSucceeded);
+    }
+    XCTAssert([self preparedStatementCount] == statementCount, @"%d statements prepared by repeated saves", [self preparedStatementCount] - statementCount);
+
+    entity.lowercase = @"another column set";
+    XCTAssert([entity save] == FCModelSaveSucceeded);
+    XCTAssert([self preparedStatementCount] == statementCount + 1);
+    XCTAssert([[SimpleModel firstValueFromQuery:@"SELECT name FROM $T WHERE $PK = ?", @"statements"] isEqualToString:@"reused 100"]);
+}
+
+- (void)testSetterChangeTracking
+{
+    TrackedModel *model = [TrackedModel new];
+    model.title = @"first";
+    model.tags = @[ @"a", @"b" ];
+    XCTAssert(model.hasUnsavedChanges);
+    XCTAssert([model save] == FCModelSaveSucceeded);
+    XCTAssert(! model.hasUnsavedChanges);
+    XCTAssert(model.changedFieldNames.count == 0);
+
+    // Each typed setter is tracked, including a custom setter name
+    model.count = 5;
+    model.rating = 4.5;
+    model.isFlagged = YES;
+    NSSet *changedFieldNames = [NSSet setWithArray:model.changedFieldNames];
+    XCTAssert([changedFieldNames isEqualToSet:([NSSet setWithObjects:@"count", @"rating", @"flagged", nil])], @"Changed fields: %@", changedFieldNames);
+
+    XCTAssert([model save] == FCModelSaveSucceeded);
+    XCTAssert([[TrackedModel firstValueFromQuery:@"SELECT count FROM $T WHERE id = ?", @(model.id)] integerValue] == 5);
+    XCTAssert([[TrackedModel firstValueFromQuery:@"SELECT flagged FROM $T WHERE id = ?", @(model.id)] boolValue]);
+    XCTAssert(! model.hasUnsavedChanges);
+
+    // Reloads don't count as changes
+    [TrackedModel executeUpdateQuery:@"UPDATE $T SET title = 'external' WHERE id = ?", @(model.id)];
+    XCTAssert([model.title isEqualToString:@"external"]);
+    XCTAssert(! model.hasUnsavedChanges);
+
+    // KVC goes through the setter, and reverting clears the change
+    [model setValue:@"kvc" forKey:@"title"];
+    XCTAssert([model.changedFieldNames isEqualToArray:@[ @"title" ]]);
+    [model revertUnsavedChanges];
+    XCTAssert([model.title isEqualToString:@"external"]);
+    XCTAssert(! model.hasUnsavedChanges);
+
+    // A rolled-back save shows up as unsaved again
+    [FCModel performTransaction:^BOOL{
+        model.count = 6;
+        [model save];
+        return NO;
+    }];
+    XCTAssert([model.changedFieldNames isEqualToArray:@[ @"count" ]]);
+    XCTAssert([model save] == FCModelSaveSucceeded);
+    XCTAssert([[TrackedModel firstValueFromQuery:@"SELECT count FROM $T WHERE id = ?", @(model.id)] integerValue] == 6);
+}
+
+- (void)testRowDecoding
+{
+    NSDate *date = [NSDate dateWithTimeIntervalSince1970:1400000000];
+    [SimpleModel inDatabaseSync:^(FMDatabase *db) {
+        [db executeUpdate:@"INSERT INTO SimpleModel (uniqueID, name, date, mixedcase, nullableNumberDefaultNull) VALUES (?, ?, ?, ?, NULL)", @"decoded", @"name", @(date.timeIntervalSince1970), @(42)];
+        [db executeUpdate:@"INSERT INTO TrackedModel (id, title, count, rating, flagged, tags) VALUES (?, ?, ?, ?, ?, ?)",
+            @(7), @"tracked", @(3), @(2.5), @(1), [NSPropertyListSerialization dataWithPropertyList:@[ @"x" ] format:NSPropertyListBinaryFormat_v1_0 options:0 error:NULL]
+        ];
+    }];
+
+    SimpleModel *simple = [SimpleModel firstInstanceWhere:@"uniqueID = ?", @"decoded"];
+    XCTAssert([simple.name isEqualToString:@"name"]);
+    XCTAssert([simple.date isEqualToDate:date]);
+    XCTAssert(simple.mixedcase == 42);
+    XCTAssert(simple.nullableNumberDefaultNull == nil);
+    XCTAssert(! simple.hasUnsavedChanges);
+
+    TrackedModel *tracked = [TrackedModel firstInstanceWhere:@"id = 7"];
+    XCTAssert([tracked.title isEqualToString:@"tracked"]);
+    XCTAssert(tracked.count == 3);
+    XCTAssert(tracked.rating == 2.5);
+    XCTAssert(tracked.isFlagged);
+    XCTAssert([tracked.tags isEqualToArray:@[ @"x" ]]);
+    XCTAssert(! tracked.hasUnsavedChanges);
+
+    // Result sets that don't select every column get defaults for the rest
+    simple = nil;
+    [SimpleModel inDatabaseSync:^(FMDatabase *db) {
+        [db executeUpdate:@"INSERT INTO SimpleModel (uniqueID, mixedcase) VALUES ('partial', 1)"];
+        FMResultSet *rs = [db executeQuery:@"SELECT uniqueID, mixedcase FROM SimpleModel WHERE uniqueID = 'partial'"];
+        SimpleModel *partial = [SimpleModel firstInstanceFromResultSet:rs];
+        [rs close];
+        XCTAssert(partial.mixedcase == 1);
+        XCTAssert([partial.nullableNumberDefault1 isEqual:@1]);
+    }];
+}
+
+// Loading rows that aren't resident yet, so each one is decoded into a new instance
+- (void)testRowDecodingPerformance
+{
+    int rowCount = 20000;
+    [SimpleModel inDatabaseSync:^(FMDatabase *db) {
+        [db beginTransaction];
+        for (int i = 0; i < rowCount; i++) {
+            [db executeUpdate:@"INSERT INTO SimpleModel (uniqueID, name, date, mixedcase) VALUES (?, ?, ?, ?)", [NSString stringWithFormat:@"load%d", i], @"load", @(1400000000), @(i)];
+        }
+        [db commit];
+    }];
+
+    [self measureBlock:^{
+        @autoreleasepool {
+            NSArray *loaded = [SimpleModel instancesWhere:@"name = 'load'"];
+            XCTAssert(loaded.count == rowCount);
+        }
+    }];
+}
+
+- (void)testWarmIdentityMapQueries
+{
+    int rowCount = 5000;
+    [SimpleModel inDatabaseSync:^(FMDatabase *db) {
+        [db beginTransaction];
+        for (int i = 0; i < rowCount; i++) {
+            [db executeUpdate:@"INSERT INTO SimpleModel (uniqueID, name, mixedcase) VALUES (?, ?, ?)", [NSString stringWithFormat:@"warm%d", i], @"warm", @(i)];
+        }
+        [db commit];
+    }];
+
+    NSArray *resident = [SimpleModel instancesWhere:@"name = ?", @"warm"];
+    XCTAssert(resident.count == rowCount);
+    NSArray *results = [SimpleModel instancesWhere:@"name = ?", @"warm"];
+    XCTAssert(results.count == rowCount && results[0] == resident[0]);
+
+    // Queries keep returning a resident instance that missed an external change as it is. Its reload updates it and posts the
+    //  notifications for the change.
+    SimpleModel *first = [SimpleModel instanceWithPrimaryKey:@"warm0"];
+    __block NSSet *updatedInstances = nil;
+    __block NSSet *updatedFields = nil;
+    id observer = [NSNotificationCenter.defaultCenter addObserverForName:FCModelUpdateNotification object:SimpleModel.class queue:nil usingBlock:^(NSNotification *n) {
+        updatedInstances = n.userInfo[FCModelInstanceSetKey];
+        updatedFields = n.userInfo[FCModelChangedFieldsKey];
+    }];
+    FMDatabase *otherConnection = [FMDatabase databaseWithPath:[self dbPath]];
+    [otherConnection open];
+    [otherConnection executeUpdate:@"UPDATE SimpleModel SET name = 'changed' WHERE uniqueID = 'warm0'"];
+    [otherConnection close];
+    dispatch_sync(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{ [SimpleModel dataWasUpdatedExternally]; });
+    XCTAssert([SimpleModel firstInstanceWhere:@"uniqueID = 'warm0'"] == first);
+    XCTAssert([first.name isEqualToString:@"warm"]);
+
+    NSDate *deadline = [NSDate dateWithTimeIntervalSinceNow:2.0];
+    while (! updatedInstances && [deadline timeIntervalSinceNow] > 0) [NSRunLoop.currentRunLoop runUntilDate:[NSDate dateWithTimeIntervalSinceNow:0.05]];
+    [NSNotificationCenter.defaultCenter removeObserver:observer];
+    XCTAssert([updatedInstances isEqualToSet:[NSSet setWithObject:first]], @"%@", updatedInstances);
+    XCTAssert([updatedFields isEqualToSet:[NSSet setWithObject:@"name"]], @"%@", updatedFields);
+    XCTAssert([first.name isEqualToString:@"changed"]);
+    XCTAssert(! first.hasUnsavedChanges);
+}
+
+// The same query as testRowDecodingPerformance's, but every row's instance is already resident
+- (void)testWarmIdentityMapQueriesPerformance
+{
+    int rowCount = 20000;
+    [SimpleModel inDatabaseSync:^(FMDatabase *db) {
+        [db beginTransaction];
+        for (int i = 0; i < rowCount; i++) {
+            [db executeUpdate:@"INSERT INTO SimpleModel (uniqueID, name, date, mixedcase) VALUES (?, ?, ?, ?)", [NSString stringWithFormat:@"load%d", i], @"load", @(1400000000), @(i)];
+        }
+        [db commit];
+    }];
+    NSArray *resident = [SimpleModel instancesWhere:@"name = 'load'"];
+    XCTAssert(resident.count == rowCount);
+
+    [self measureBlock:^{
+        @autoreleasepool {
+            NSArray *loaded = [SimpleModel instancesWhere:@"name = 'load'"];
+            XCTAssert(loaded.count == rowCount);
+        }
+    }];
+}
+
+- (void)testParallelIdentityMapLookups
+{
+    [FCModel closeDatabase];
+    [self openDatabaseWithMaximumConcurrentReaders:8];
+
+    int rowCount = 2000;
+    [SimplerModel inDatabaseSync:^(FMDatabase *db) {
+        [db beginTransaction];
+        for (int i = 1; i <= rowCount; i++) [db executeUpdate:@"INSERT INTO SimplerModel (id, title) VALUES (?, ?)", @(i), @"parallel"];
+        [db commit];
+    }];
+
+    NSArray *resident = [SimplerModel instancesWhere:@"title = ? ORDER BY id", @"parallel"];
+    XCTAssert(resident.count == rowCount);
+    XCTAssert([SimplerModel instanceWithPrimaryKey:@(1)] == resident[0]);
+    XCTAssert([SimplerModel instanceWithPrimaryKey:@"1"] == resident[0]);
+    XCTAssert([SimplerModel instanceWithPrimaryKey:@(1.0)] == resident[0]);
+
+    int queriesPerThread = 20;
+    for (NSNumber *threadCountNumber in @[ @1, @2, @4, @8 ]) {
+        int threadCount = threadCountNumber.intValue;
+        __block atomic_int mismatches = 0;
+        dispatch_group_t group = dispatch_group_create();
+        for (int t = 0; t < threadCount; t++) {
+            dispatch_group_async(group, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+                for (int q = 0; q < queriesPerThread; q++) {
+                    @autoreleasepool {
+                        NSArray *results = [SimplerModel instancesWhere:@"title = ? ORDER BY id", @"parallel"];
+                        if (results.count != resident.count) { atomic_fetch_add_explicit(&mismatches, 1, memory_order_relaxed); continue; }
+                        for (NSUInteger i = 0; i < results.count; i++) {
+                            if (results[i] != resident[i]) { atomic_fetch_add_explicit(&mismatches, 1, memory_order_relaxed); break; }
+                        }
+                    }
+                }
+            });
+        }
+        dispatch_group_wait(group, DISPATCH_TIME_FOREVER);
+        XCTAssert(mismatches == 0, @"%d threads got %d non-unique results", threadCount, mismatches);
+    }
+}
+
+- (void)testParallelIdentityMapLookupsPerformance
+{
+    [FCModel closeDatabase];
+    [self openDatabaseWithMaximumConcurrentReaders:8];
+
+    [SimplerModel inDatabaseSync:^(FMDatabase *db) {
+        [db beginTransaction];
+        for (int i = 1; i <= 2000; i++) [db executeUpdate:@"INSERT INTO SimplerModel (id, title) VALUES (?, ?)", @(i), @"parallel"];
+        [db commit];
+    }];
+    NSArray *resident = [SimplerModel instancesWhere:@"title = ? ORDER BY id", @"parallel"];
+    XCTAssert(resident.count == 2000);
+
+    [self measureBlock:^{
+        dispatch_apply(8, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t t) {
+            for (int q = 0; q < 20; q++) @autoreleasepool { [SimplerModel instancesWhere:@"title = ? ORDER BY id", @"parallel"]; }
+        });
+    }];
+}
+
+- (void)testTargetedReloads
+{
+    SimplerModel *changed = [SimplerModel new];
+    changed.title = @"before";
+    [changed save];
+    SimplerModel *unchanged = [SimplerModel new];
+    unchanged.title = @"before";
+    [unchanged save];
+    SimpleModel *textKeyed = [SimpleModel instanceWithPrimaryKey:@"targeted"];
+    textKeyed.name = @"before";
+    [textKeyed save];
+
+    NSMutableSet *updatedInstances = [NSMutableSet set];
+    __block NSSet *changedFields = nil;
+    __block int willReloadNotifications = 0;
+    NSNotificationCenter *nc = NSNotificationCenter.defaultCenter;
+    NSArray *observers = @[
+        [nc addObserverForName:FCModelUpdateNotification object:nil queue:nil usingBlock:^(NSNotification *n) {
+            [updatedInstances unionSet:n.userInfo[FCModelInstanceSetKey]];
+        }],
+        [nc addObserverForName:FCModelAnyChangeNotification object:nil queue:nil usingBlock:^(NSNotification *n) {
+            changedFields = n.userInfo[FCModelChangedFieldsKey];
+        }],
+        [nc addObserverForName:FCModelWillReloadNotification object:nil queue:nil usingBlock:^(NSNotification *n) { willReloadNotifications++; }],
+    ];
+
+    // Only the changed row's instance reloads, and only its changed field is reported
+    [SimplerModel executeUpdateQuery:@"UPDATE $T SET title = 'after' WHERE id = ?", @(changed.id)];
+    XCTAssert([changed.title isEqualToString:@"after"]);
+    XCTAssert([updatedInstances isEqualToSet:[NSSet setWithObject:changed]], @"Reloaded %@", updatedInstances);
+    XCTAssert([changedFields isEqualToSet:[NSSet setWithObject:@"title"]], @"Changed fields %@", changedFields);
+
+    // Writes in inDatabaseSync: are picked up too, mapping rowids to non-integer primary keys
+    [updatedInstances removeAllObjects];
+    [FCModel inDatabaseSync:^(FMDatabase *db) {
+        [db executeUpdate:@"UPDATE SimpleModel SET name = 'after' WHERE uniqueID = 'targeted'"];
+    }];
+    XCTAssert([textKeyed.name isEqualToString:@"after"]);
+    XCTAssert([updatedInstances isEqualToSet:[NSSet setWithObject:textKeyed]], @"Reloaded %@", updatedInstances);
+
+    // Rolled-back writes don't reload anything
+    [updatedInstances removeAllObjects];
+    [SimplerModel inDatabaseSync:^(FMDatabase *db) {
+        [db beginTransaction];
+        [db executeUpdate:@"UPDATE SimplerModel SET title = 'rolledBack'"];
+        [db rollback];
+    }];
+    XCTAssert(updatedInstances.count == 0);
+    XCTAssert([unchanged.title isEqualToString:@"before"]);
+
+    // So are writes rolled back to an inner transaction's savepoint, which SQLite's rollback hook doesn't report
+    [FCModel performTransaction:^BOOL{
+        [FCModel performTransaction:^BOOL{
+            [SimplerModel executeUpdateQuery:@"UPDATE $T SET title = 'rolledBack' WHERE id = ?", @(unchanged.id)];
+            return NO;
+        }];
+        return YES;
+    }];
+    XCTAssert(updatedInstances.count == 0, @"Reloaded %@", updatedInstances);
+    XCTAssert([unchanged.title isEqualToString:@"before"]);
+
+    // Deletes reach the deleted row's instance
+    [SimplerModel executeUpdateQuery:@"DELETE FROM $T WHERE id = ?", @(changed.id)];
+    XCTAssert(changed.isDeleted);
+    XCTAssert(! unchanged.isDeleted);
+    XCTAssert(willReloadNotifications == 0);
+
+    // Writes SQLite doesn't report to the update hook still reload the whole class
+    [SimplerModel executeUpdateQuery:@"DELETE FROM $T"];
+    XCTAssert(unchanged.isDeleted);
+
+    for (id observer in observers) [nc removeObserver:observer];
+}
+
+- (void)testSetBasedReload
+{
+    int rowCount = 5000;
+    [SimplerModel inDatabaseSync:^(FMDatabase *db) {
+        [db beginTransaction];
+        for (int i = 1; i <= rowCount; i++) [db executeUpdate:@"INSERT INTO SimplerModel (id, title) VALUES (?, ?)", @(i), @"resident"];
+        [db commit];
+    }];
+    NSArray *resident = [SimplerModel instancesWhere:@"title = ?", @"resident"];
+    XCTAssert(resident.count == rowCount);
+    SimplerModel *deletedModel = [SimplerModel instanceWithPrimaryKey:@(rowCount)];
+
+    __block int updateNotifications = 0, deleteNotifications = 0, anyChangeNotifications = 0;
+    NSNotificationCenter *nc = NSNotificationCenter.defaultCenter;
+    NSArray *observers = @[
+        [nc addObserverForName:FCModelUpdateNotification object:SimplerModel.class queue:nil usingBlock:^(NSNotification *n) { updateNotifications++; }],
+        [nc addObserverForName:FCModelDeleteNotification object:SimplerModel.class queue:nil usingBlock:^(NSNotification *n) { deleteNotifications++; }],
+        [nc addObserverForName:FCModelAnyChangeNotification object:SimplerModel.class queue:nil usingBlock:^(NSNotification *n) { anyChangeNotifications++; }],
+    ];
+
+    FMDatabase *otherConnection = [FMDatabase databaseWithPath:[self dbPath]];
+    [otherConnection open];
+    [otherConnection executeUpdate:@"UPDATE SimplerModel SET title = 'changed' WHERE id <= 10"];
+    [otherConnection executeUpdate:@"DELETE FROM SimplerModel WHERE id = ?", @(rowCount)];
+    [otherConnection close];
+
+    [SimplerModel dataWasUpdatedExternally];
+
+    // Only the changed instances are notified, plus one notification for the class
+    XCTAssert(updateNotifications == 10, @"Received %d update notifications", updateNotifications);
+    XCTAssert(deleteNotifications == 1, @"Received %d delete notifications", deleteNotifications);
+    XCTAssert(anyChangeNotifications == 12, @"Received %d anyChange notifications", anyChangeNotifications);
+    XCTAssert([((SimplerModel *) [SimplerModel instanceWithPrimaryKey:@(1)]).title isEqualToString:@"changed"]);
+    XCTAssert([((SimplerModel *) [SimplerModel instanceWithPrimaryKey:@(11)]).title isEqualToString:@"resident"]);
+    XCTAssert(deletedModel.isDeleted);
+
+    for (id observer in observers) [nc removeObserver:observer];
+}
+
+// Reloading many loaded instances after an external change to a few of them
+- (void)testSetBasedReloadPerformance
+{
+    int rowCount = 5000;
+    [SimplerModel inDatabaseSync:^(FMDatabase *db) {
+        [db beginTransaction];
+        for (int i = 1; i <= rowCount; i++) [db executeUpdate:@"INSERT INTO SimplerModel (id, title) VALUES (?, ?)", @(i), @"resident"];
+        [db commit];
+    }];
+    NSArray *resident = [SimplerModel instancesWhere:@"title = ?", @"resident"];
+    XCTAssert(resident.count == rowCount);
+
+    __block int iteration = 0;
+    [self measureMetrics:self.class.defaultPerformanceMetrics automaticallyStartMeasuring:NO forBlock:^{
+        FMDatabase *otherConnection = [FMDatabase databaseWithPath:[self dbPath]];
+        [otherConnection open];
+        [otherConnection executeUpdate:@"UPDATE SimplerModel SET title = ? WHERE id <= 10", [NSString stringWithFormat:@"changed %d", iteration++]];
+        [otherConnection close];
+
+        [self startMeasuring];
+        [SimplerModel dataWasUpdatedExternally];
+        [self stopMeasuring];
+    }];
+}
+
+- (void)testLiveResultArrayChanges
+{
+    for (int i = 0; i < 3; i++) {
+        SimpleModel *model = [SimpleModel instanceWithPrimaryKey:[NSString stringWithFormat:@"live%d", i]];
+        model.name = @"live";
+        model.mixedcase = i;
+        [model save];
+    }
+    SimpleModel *other = [SimpleModel instanceWithPrimaryKey:@"other"];
+    other.name = @"other";
+    [other save];
+
+    FCModelLiveResultArray *live = [FCModelLiveResultArray arrayWithModelClass:SimpleModel.class queryAfterWHERE:@"name = ?" arguments:@[ @"live" ] ignoreFieldsForInvalidation:nil];
+    FCModelLiveResultArrayChanges *changes = nil;
+    NSArray *objects = [live allObjectsWithChanges:&changes];
+    XCTAssert(objects.count == 3);
+    XCTAssert([changes.insertedIndexes isEqualToIndexSet:[NSIndexSet indexSetWithIndexesInRange:NSMakeRange(0, 3)]]);
+
+    // An unrelated change leaves the result alone
+    other.lowercase = @"changed";
+    [other save];
+    XCTAssert([[live allObjectsWithChanges:&changes] isEqualToArray:objects]);
+    XCTAssert(! changes.hasChanges);
+
+    // A matching row is appended, and a row that stops matching is spliced out
+    other.name = @"live";
+    [other save];
+    SimpleModel *first = objects[0];
+    first.name = @"gone";
+    [first save];
+    NSArray *newObjects = [live allObjectsWithChanges:&changes];
+    XCTAssert(newObjects.count == 3);
+    XCTAssert(newObjects.lastObject == other);
+    XCTAssert([changes.deletedIndexes isEqualToIndexSet:[NSIndexSet indexSetWithIndex:0]], @"%@", changes);
+    XCTAssert([changes.insertedIndexes isEqualToIndexSet:[NSIndexSet indexSetWithIndex:2]], @"%@", changes);
+
+    // Updates that keep a row matching are reported in place
+    SimpleModel *second = newObjects[0];
+    second.lowercase = @"updated";
+    [second save];
+    XCTAssert([live allObjectsWithChanges:&changes].count == 3);
+    XCTAssert([changes.updatedIndexes isEqualToIndexSet:[NSIndexSet indexSetWithIndex:0]], @"%@", changes);
+    XCTAssert(! changes.insertedIndexes.count && ! changes.deletedIndexes.count);
+
+    // Ordered queries compare primary keys, reporting moves as a deletion and an insertion
+    FCModelLiveResultArray *ordered = [FCModelLiveResultArray arrayWithModelClass:SimpleModel.class queryAfterWHERE:@"name = ? ORDER BY mixedcase" arguments:@[ @"live" ] ignoreFieldsForInvalidation:nil];
+    objects = [ordered allObjectsWithChanges:NULL];
+    SimpleModel *firstOrdered = objects[0];
+    firstOrdered.mixedcase = 100;
+    [firstOrdered save];
+    newObjects = [ordered allObjectsWithChanges:&changes];
+    XCTAssert(newObjects.lastObject == firstOrdered);
+    XCTAssert([changes.deletedIndexes isEqualToIndexSet:[NSIndexSet indexSetWithIndex:0]], @"%@", changes);
+    XCTAssert([changes.insertedIndexes isEqualToIndexSet:[NSIndexSet indexSetWithIndex:newObjects.count - 1]], @"%@", changes);
+
+    // Deletes
+    [other delete];
+    XCTAssert(! [[live allObjects] containsObject:other]);
+    XCTAssert(! [[ordered allObjects] containsObject:other]);
+}
+
+- (void)testCacheEviction
+{
+    [FCModelCachedObject clearCache];
+    [FCModelCachedObject setMaximumEntryCount:3 estimatedByteCount:0 forModelClass:SimpleModel.class];
+    FCModelCacheStatistics before = [FCModelCachedObject cacheStatisticsForModelClass:SimpleModel.class];
+
+    __block int generatorCalls = 0;
+    id (^generator)(void) = ^id{ generatorCalls++; return @"cached value"; };
+    for (int i = 0; i < 3; i++) [SimpleModel cachedObjectWithIdentifier:@(i) generator:generator];
+    XCTAssert(generatorCalls == 3);
+
+    // The first eviction sweeps every entry's referenced bit clear, then evicts the oldest
+    [SimpleModel cachedObjectWithIdentifier:@3 generator:generator];
+    XCTAssert(generatorCalls == 4);
+
+    // Reading 1 again sets its bit, so the next eviction skips it and takes 2
+    [SimpleModel cachedObjectWithIdentifier:@1 generator:generator];
+    [SimpleModel cachedObjectWithIdentifier:@4 generator:generator];
+    XCTAssert(generatorCalls == 5);
+
+    FCModelCacheStatistics statistics = [FCModelCachedObject cacheStatisticsForModelClass:SimpleModel.class];
+    XCTAssert(statistics.entryCount == 3);
+    XCTAssert(statistics.evictions - before.evictions == 2);
+    XCTAssert(statistics.hits - before.hits == 1);
+    XCTAssert(statistics.misses - before.misses == 5);
+    XCTAssert(statistics.estimatedByteCount > 0);
+
+    [SimpleModel cachedObjectWithIdentifier:@1 generator:generator];
+    XCTAssert(generatorCalls == 5);
+    [SimpleModel cachedObjectWithIdentifier:@2 generator:generator];
+    XCTAssert(generatorCalls == 6, @"evicted entry should regenerate");
+
+    // Writes invalidate current results
+    SimpleModel *entity = [SimpleModel instanceWithPrimaryKey:@"eviction"];
+    entity.name = @"eviction";
+    [entity save];
+    statistics = [FCModelCachedObject cacheStatisticsForModelClass:SimpleModel.class];
+    XCTAssert(statistics.invalidations - before.invalidations == 3);
+
+    // Byte limits
+    [FCModelCachedObject setMaximumEntryCount:0 estimatedByteCount:1 forModelClass:SimpleModel.class];
+    XCTAssert([FCModelCachedObject cacheStatisticsForModelClass:SimpleModel.class].estimatedByteCount == 0);
+
+    [FCModelCachedObject setMaximumEntryCount:0 estimatedByteCount:0 forModelClass:SimpleModel.class];
+    [FCModelCachedObject clearCache];
+    XCTAssert([FCModelCachedObject cacheStatistics].entryCount == 0);
+}
+
+- (void)testCacheSingleFlight
+{
+    __block atomic_int generatorCalls = 0;
+    id (^generator)(void) = ^id{
+        atomic_fetch_add_explicit(&generatorCalls, 1, memory_order_relaxed);
+        [NSThread sleepForTimeInterval:0.05];
+        return [NSString stringWithFormat:@"generation %d", generatorCalls];
+    };
+
+    // Concurrent misses share one generation
+    NSMutableArray *values = [NSMutableArray array];
+    NSObject *valuesLock = [NSObject new];
+    dispatch_apply(16, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t i) {
+        id value = [FCModelCachedObject objectWithModelClass:SimpleModel.class cacheIdentifier:@"singleFlight" ignoreFieldsForInvalidation:nil generator:generator].value;
+        @synchronized (valuesLock) { [values addObject:value]; }
+    });
+    XCTAssert(generatorCalls == 1);
+    XCTAssert(values.count == 16 && [NSSet setWithArray:values].count == 1);
+
+    // Stale-while-revalidate serves the previous value until the refresh finishes
+    FCModelCachedObject *cachedObject = [FCModelCachedObject objectWithModelClass:SimpleModel.class cacheIdentifier:@"singleFlight" ignoreFieldsForInvalidation:nil generator:generator];
+    cachedObject.servesStaleValueWhileRegenerating = YES;
+    SimpleModel *entity = [SimpleModel instanceWithPrimaryKey:@"singleFlight"];
+    entity.name = @"singleFlight";
+    [entity save];
+
+    XCTAssert([cachedObject.value isEqualToString:@"generation 1"]);
+    NSDate *deadline = [NSDate dateWithTimeIntervalSinceNow:2];
+    while (generatorCalls < 2 || [cachedObject.value isEqualToString:@"generation 1"]) {
+        if ([deadline timeIntervalSinceNow] < 0) break;
+        [NSThread sleepForTimeInterval:0.01];
+    }
+    XCTAssert(generatorCalls == 2);
+    XCTAssert([cachedObject.value isEqualToString:@"generation 2"]);
+}
+
+- (void)testParallelCacheHits
+{
+    for (int i = 0; i < 8; i++) {
+        SimpleModel *model = [SimpleModel instanceWithPrimaryKey:[NSString stringWithFormat:@"hits%d", i]];
+        model.name = @"hits";
+        model.mixedcase = i * 10;
+        [model save];
+    }
+
+    NSMutableArray *queries = [NSMutableArray array];
+    NSMutableArray *results = [NSMutableArray array];
+    for (int i = 0; i < 64; i++) {
+        NSString *query = [NSString stringWithFormat:@"name = ? AND mixedcase > %d", i];
+        [queries addObject:query];
+        [results addObject:[SimpleModel cachedInstancesWhere:query arguments:@[ @"hits" ]]];
+    }
+    FCModelCacheStatistics before = [FCModelCachedObject cacheStatisticsForModelClass:SimpleModel.class];
+
+    // Concurrent lookups all hit, and each gets the one cached result for its query
+    int lookupsPerThread = 2000;
+    uint64_t lookupCount = 0;
+    for (NSNumber *threadCountNumber in @[ @1, @2, @4, @8 ]) {
+        int threadCount = threadCountNumber.intValue;
+        __block atomic_int mismatches = 0;
+        dispatch_group_t group = dispatch_group_create();
+        for (int t = 0; t < threadCount; t++) {
+            dispatch_group_async(group, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+                for (int i = 0; i < lookupsPerThread; i++) {
+                    @autoreleasepool {
+                        NSUInteger queryIndex = (NSUInteger) (i + t) % queries.count;
+                        if ([SimpleModel cachedInstancesWhere:queries[queryIndex] arguments:@[ @"hits" ]] != results[queryIndex]) {
+                            atomic_fetch_add_explicit(&mismatches, 1, memory_order_relaxed);
+                        }
+                    }
+                }
+            });
+        }
+        dispatch_group_wait(group, DISPATCH_TIME_FOREVER);
+        lookupCount += (uint64_t) (threadCount * lookupsPerThread);
+        XCTAssert(mismatches == 0, @"%d threads got %d different results", threadCount, (int) mismatches);
+    }
+
+    FCModelCacheStatistics after = [FCModelCachedObject cacheStatisticsForModelClass:SimpleModel.class];
+    XCTAssert(after.misses == before.misses, @"every lookup should hit");
+    XCTAssert(after.hits - before.hits == lookupCount, @"%llu hits for %llu lookups", after.hits - before.hits, lookupCount);
+    XCTAssert(after.entryCount == before.entryCount);
+    XCTAssert([results[0] count] == 7 && [results[63] count] == 1);
+}
+
+- (void)testQueryFieldInvalidation
+{
+    for (int i = 0; i < 3; i++) {
+        SimpleModel *model = [SimpleModel instanceWithPrimaryKey:[NSString stringWithFormat:@"fields%d", i]];
+        model.name = @"fields";
+        model.mixedcase = i;
+        [model save];
+    }
+
+    // ignoreFieldsForInvalidation is honored by cachedInstancesWhere, whose live result is shared with this array
+    NSArray *cached = [SimpleModel cachedInstancesWhere:@"name = ? ORDER BY mixedcase" arguments:@[ @"fields" ] ignoreFieldsForInvalidation:[NSSet setWithObject:@"textDefaultUnspecified"]];
+    FCModelLiveResultArray *live = [FCModelLiveResultArray arrayWithModelClass:SimpleModel.class queryAfterWHERE:@"name = ? ORDER BY mixedcase" arguments:@[ @"fields" ] ignoreFieldsForInvalidation:nil];
+    FCModelLiveResultArrayChanges *changes = nil;
+    XCTAssert([[live allObjectsWithChanges:&changes] isEqualToArray:cached]);
+
+    SimpleModel *first = cached[0];
+    first.textDefaultUnspecified = @"ignored";
+    [first save];
+    XCTAssert([[live allObjectsWithChanges:&changes] isEqualToArray:cached]);
+    XCTAssert(! changes.hasChanges, @"%@", changes);
+
+    // Changes to fields the query doesn't read are reported as updates, and can't add or remove rows
+    first.lowercase = @"tapped";
+    [first save];
+    XCTAssert([[live allObjectsWithChanges:&changes] isEqualToArray:cached]);
+    XCTAssert([changes.updatedIndexes isEqualToIndexSet:[NSIndexSet indexSetWithIndex:0]], @"%@", changes);
+    XCTAssert(! changes.insertedIndexes.count && ! changes.deletedIndexes.count);
+
+    // Changes to fields it reads are re-checked
+    SimpleModel *last = cached[2];
+    last.mixedcase = -1;
+    [last save];
+    NSArray *objects = [live allObjectsWithChanges:&changes];
+    XCTAssert(objects[0] == last && objects.count == 3, @"%@", objects);
+    XCTAssert([changes.deletedIndexes isEqualToIndexSet:[NSIndexSet indexSetWithIndex:2]] && [changes.insertedIndexes isEqualToIndexSet:[NSIndexSet indexSetWithIndex:0]], @"%@", changes);
+
+    // Finding the fields leaves an authorizer the app set on its connection in place
+    int authorizations = 0;
+    int *authorizationCount = &authorizations;
+    [SimpleModel inDatabaseSync:^(FMDatabase *db) { sqlite3_set_authorizer(db.sqliteHandle, countingAuthorizer, authorizationCount); }];
+    XCTAssert([SimpleModel cachedInstancesWhere:@"mixedcase >= ?" arguments:@[ @0 ]].count == 2);
+    authorizations = 0;
+    [SimpleModel inDatabaseSync:^(FMDatabase *db) {
+        [[db executeQuery:@"SELECT COUNT(*) FROM SimpleModel WHERE name = 'authorized'"] close];
+        sqlite3_set_authorizer(db.sqliteHandle, NULL, NULL);
+    }];
+    XCTAssert(authorizations > 0);
+}
+
+- (void)testEnumerateInstances
+{
+    int rowCount = 2500;
+    [SimplerModel inDatabaseSync:^(FMDatabase *db) {
+        [db beginTransaction];
+        for (int i = 1; i <= rowCount; i++) [db executeUpdate:@"INSERT INTO SimplerModel (id, title) VALUES (?, ?)", @(i), (i % 5 ? @"streamed" : @"skipped")];
+        [db commit];
+    }];
+
+    __block int count = 0;
+    __block int64_t lastID = 0;
+    __block BOOL ordered = YES;
+    [SimplerModel enumerateInstancesWhere:@"title = ?" arguments:@[ @"streamed" ] batchSize:300 usingBlock:^(SimplerModel *instance, BOOL *stop) {
+        if (instance.id <= lastID) ordered = NO;
+        lastID = instance.id;
+        count++;
+    }];
+    XCTAssert(count == rowCount * 4 / 5);
+    XCTAssert(ordered);
+
+    // Resident instances are reused
+    SimplerModel *resident = [SimplerModel instanceWithPrimaryKey:@(1)];
+    __block SimplerModel *enumerated = nil;
+    count = 0;
+    [SimplerModel enumerateInstancesWhere:nil arguments:nil batchSize:0 usingBlock:^(SimplerModel *instance, BOOL *stop) {
+        if (count++ == 0) enumerated = instance;
+        if (count == 10) *stop = YES;
+    }];
+    XCTAssert(count == 10);
+    XCTAssert(enumerated == resident);
+
+    // Each distinct query gets a cached statement, but a connection only keeps so many
+    for (int i = 0; i < 300; i++) {
+        [SimplerModel enumerateInstancesWhere:[NSString stringWithFormat:@"id > %d", i] arguments:nil batchSize:10 usingBlock:^(SimplerModel *instance, BOOL *stop) { *stop = YES; }];
+    }
+    XCTAssert([self preparedStatementCount] <= 128, @"%d statements still prepared", [self preparedStatementCount]);
+}
+
+- (void)testKeysetPagination
+{
+    int rowCount = 1000;
+    [SimpleModel inDatabaseSync:^(FMDatabase *db) {
+        [db beginTransaction];
+        for (int i = 0; i < rowCount; i++) {
+            [db executeUpdate:@"INSERT INTO SimpleModel (uniqueID, name, mixedcase, nullableNumberDefaultNull) VALUES (?, ?, ?, ?)",
+                [NSString stringWithFormat:@"page%04d", i], @"paged", @(i % 7), (i % 10 ? @(i % 3) : NSNull.null)
+            ];
+        }
+        [db commit];
+    }];
+
+    // Sort values repeat (and include NULLs), so rows with equal values are told apart by primary key. Each page must match
+    //  the same page read with OFFSET, and only the last page is short.
+    int pageSize = 64;
+    for (NSString *order in @[ @"mixedcase", @"mixedcase DESC", @"nullableNumberDefaultNull", @"nullableNumberDefaultNull DESC" ]) {
+        NSString *fullOrder = [NSString stringWithFormat:@"%@, uniqueID%@", order, ([order hasSuffix:@"DESC"] ? @" DESC" : @"")];
+        NSMutableArray *paged = [NSMutableArray array];
+        NSArray *page = nil;
+        int pageIndex = 0;
+        do {
+            page = [SimpleModel instancesWhere:@"name = ?" arguments:@[ @"paged" ] orderedBy:order after:paged.lastObject limit:pageSize];
+            NSArray *offsetPage = [SimpleModel instancesWhere:[NSString stringWithFormat:@"name = ? ORDER BY %@ LIMIT %d OFFSET %d", fullOrder, pageSize, pageIndex * pageSize], @"paged"];
+            XCTAssert([page isEqualToArray:offsetPage], @"page %d ordered by %@ differs from OFFSET", pageIndex, order);
+            [paged addObjectsFromArray:page];
+            pageIndex++;
+        } while (page.count == pageSize);
+
+        XCTAssert(paged.count == rowCount, @"%lu rows ordered by %@", (unsigned long) paged.count, order);
+        XCTAssert(page.count == rowCount % pageSize, @"last page ordered by %@ has %lu rows", order, (unsigned long) page.count);
+        XCTAssert([NSSet setWithArray:paged].count == rowCount, @"rows repeated ordered by %@", order);
+        XCTAssert([SimpleModel instancesWhere:@"name = ?" arguments:@[ @"paged" ] orderedBy:order after:paged.lastObject limit:pageSize].count == 0);
+    }
+
+    // A page starting inside a run of equal sort values continues with the rest of that run
+    SimpleModel *tied = [SimpleModel instanceWithPrimaryKey:@"page0007"]; // mixedcase 0, like every seventh row
+    NSArray *afterTied = [SimpleModel instancesWhere:nil arguments:nil orderedBy:@"mixedcase" after:tied limit:2];
+    XCTAssert(afterTied.count == 2);
+    XCTAssert([[afterTied[0] uniqueID] isEqualToString:@"page0014"] && [[afterTied[1] uniqueID] isEqualToString:@"page0021"], @"%@", afterTied);
+
+    XCTAssertThrows([SimpleModel instancesWhere:nil arguments:nil orderedBy:@"notAField" after:nil limit:1]);
+}
+
+- (void)testRowViews
+{
+    NSDate *date = [NSDate dateWithTimeIntervalSince1970:1400000000];
+    for (int i = 0; i < 3; i++) {
+        SimpleModel *model = [SimpleModel instanceWithPrimaryKey:[NSString stringWithFormat:@"view%d", i]];
+        model.name = @"viewed";
+        model.mixedcase = 2 - i;
+        model.date = date;
+        model.lowercase = @"not read";
+        [model save];
+    }
+
+    NSArray *rowViews = [SimpleModel rowViewsWithFieldNames:@[ @"name", @"date" ] where:@"name = ? ORDER BY mixedcase" arguments:@[ @"viewed" ]];
+    XCTAssert(rowViews.count == 3);
+
+    FCModelRowView *rowView = rowViews[0];
+    XCTAssert(rowView.modelClass == SimpleModel.class);
+    XCTAssert([rowView.primaryKey isEqual:@"view2"]);
+    XCTAssert([rowView[@"name"] isEqualToString:@"viewed"]);
+    XCTAssert([rowView[@"date"] isKindOfClass:NSDate.class] && [rowView[@"date"] isEqualToDate:date]);
+    XCTAssert([[rowView valueForKey:@"date"] isEqualToDate:date]);
+    XCTAssert(rowView[@"lowercase"] == nil);
+    XCTAssert(rowView.instance == [SimpleModel instanceWithPrimaryKey:@"view2"]);
+
+    XCTAssert([SimpleModel rowViewsWithFieldNames:@[ @"name" ] where:nil arguments:nil].count == 3);
+    XCTAssertThrows([SimpleModel rowViewsWithFieldNames:@[ @"notAField" ] where:nil arguments:nil]);
+
+    // Views decode with the class method, including BLOBs read through the field's codec
+    XCTAssert([[SimpleModel unserializedRepresentationOfDatabaseValue:@(1400000000) forPropertyNamed:@"date"] isEqualToDate:date]);
+    TrackedModel *tagged = [TrackedModel instanceWithPrimaryKey:@(9)];
+    tagged.tags = @[ @"a", @"b" ];
+    [tagged save];
+    FCModelRowView *tagsView = [TrackedModel rowViewsWithFieldNames:@[ @"tags" ] where:@"id = 9" arguments:nil].firstObject;
+    XCTAssert([tagsView[@"tags"] isEqual:(@[ @"a", @"b" ])]);
+}
+
+- (void)testLazyPlistDecoding
+{
+    NSData *(^bplist)(id) = ^(id plist) { return [NSPropertyListSerialization dataWithPropertyList:plist format:NSPropertyListBinaryFormat_v1_0 options:0 error:NULL]; };
+    [TrackedModel inDatabaseSync:^(FMDatabase *db) {
+        [db executeUpdate:@"INSERT INTO TrackedModel (id, title, tags) VALUES (?, ?, ?)", @(8), @"lazy", bplist(@[ @"x", @"y" ])];
+    }];
+
+    // The BLOB isn't decoded when the row is read, or when checking for changes
+    TrackedModel *model = [TrackedModel firstInstanceWhere:@"id = 8"];
+    Ivar tagsIvar = class_getInstanceVariable(TrackedModel.class, "_tags");
+    XCTAssert(object_getIvar(model, tagsIvar) == nil);
+    XCTAssert(! model.hasUnsavedChanges);
+    [FCModel performTransaction:^BOOL{
+        model.count = 1;
+        [model save];
+        return NO;
+    }];
+    XCTAssert([model.changedFieldNames isEqualToArray:@[ @"count" ]]);
+    XCTAssert(object_getIvar(model, tagsIvar) == nil);
+
+    // First access decodes it once, without posting KVO notifications
+    [model addObserver:self forKeyPath:@"tags" options:0 context:NULL];
+    observedChangeCount = 0;
+    NSArray *tags = model.tags;
+    XCTAssert([tags isEqualToArray:(@[ @"x", @"y" ])]);
+    XCTAssert(object_getIvar(model, tagsIvar) == tags);
+    XCTAssert(model.tags == tags);
+    XCTAssert(observedChangeCount == 0, @"%lu KVO notifications", (unsigned long) observedChangeCount);
+    [model removeObserver:self forKeyPath:@"tags"];
+    XCTAssert([model.changedFieldNames isEqualToArray:@[ @"count" ]]);
+
+    // Assigned values are saved, and reloaded values are decoded lazily again
+    model.tags = @[ @"z" ];
+    XCTAssert([model save] == FCModelSaveSucceeded);
+    XCTAssert([[TrackedModel firstValueFromQuery:@"SELECT tags FROM $T WHERE id = 8"] isEqual:bplist(@[ @"z" ])]);
+    [TrackedModel executeUpdateQuery:@"UPDATE $T SET tags = ? WHERE id = 8", bplist(@[ @"external" ])];
+    XCTAssert(object_getIvar(model, tagsIvar) == nil);
+    XCTAssert([model.tags isEqualToArray:@[ @"external" ]]);
+    XCTAssert(! model.hasUnsavedChanges);
+
+    // Concurrent first accesses all see the same decoded value
+    [TrackedModel executeUpdateQuery:@"UPDATE $T SET tags = ? WHERE id = 8", bplist(@[ @"shared" ])];
+    XCTAssert(object_getIvar(model, tagsIvar) == nil);
+    NSMutableArray *readTags = [NSMutableArray array];
+    dispatch_apply(16, dispatch_get_global_queue(QOS_CLASS_DEFAULT, 0), ^(size_t i) {
+        NSArray *value = model.tags;
+        @synchronized (readTags) { [readTags addObject:value]; }
+    });
+    XCTAssert(readTags.count == 16);
+    for (NSArray *value in readTags) XCTAssert(value == model.tags);
+    XCTAssert([model.tags isEqualToArray:@[ @"shared" ]]);
+}
+
+- (void)testBinaryCodec
+{
+    FCModelBinaryCodec *codec = FCModelBinaryCodec.sharedCodec;
+    NSDate *date = [NSDate dateWithTimeIntervalSinceReferenceDate:123456.5];
+    NSArray *values = @[
+        @[],
+        @{},
+        @[ @1, @-2, @(INT64_MAX), @(INT64_MIN) ],
+        @[ @1.5, @-0.25 ],
+        @{ @"name" : @"value", @"\u00e9t\u00e9" : @"\u2603" },
+        @[ @YES, @NO, @(UINT64_MAX), @3, @4.5, @"text", [@"data" dataUsingEncoding:NSUTF8StringEncoding], date, @[ @[ @1 ] ], @{ @"nested" : @{ @"count" : @7 } } ],
+    ];
+    for (id value in values) {
+        NSData *data = [codec dataFromValue:value error:NULL];
+        XCTAssert(data && [[codec valueFromData:data] isEqual:value], @"Didn't round-trip: %@", value);
+    }
+
+    // Booleans and integers keep their types, and collections come back immutable
+    NSArray *decoded = [codec valueFromData:[codec dataFromValue:@[ @YES, @1, @[ @2 ] ] error:NULL]];
+    XCTAssert((__bridge CFBooleanRef) decoded[0] == kCFBooleanTrue);
+    XCTAssert(! CFNumberIsFloatType((__bridge CFNumberRef) decoded[1]));
+    XCTAssert(! [decoded isKindOfClass:NSMutableArray.class] && ! [decoded[2] isKindOfClass:NSMutableArray.class]);
+
+    // Existing plist BLOBs are still read, and bad data or values are rejected
+    NSData *bplist = [NSPropertyListSerialization dataWithPropertyList:@{ @"old" : @[ @1 ] } format:NSPropertyListBinaryFormat_v1_0 options:0 error:NULL];
+    XCTAssert([[codec valueFromData:bplist] isEqual:(@{ @"old" : @[ @1 ] })]);
+    NSMutableData *truncated = [[codec dataFromValue:@[ @"a", @"b" ] error:NULL] mutableCopy];
+    truncated.length -= 1;
+    XCTAssert([codec valueFromData:truncated] == nil);
+    NSError *error = nil;
+    XCTAssert([codec dataFromValue:@[ NSNull.null ] error:&error] == nil && error);
+    NSString *unpairedSurrogate = [NSString stringWithCharacters:(unichar[]) { 'a', 0xD800 } length:2];
+    error = nil;
+    XCTAssert([codec dataFromValue:@[ unpairedSurrogate ] error:&error] == nil && error);
+    error = nil;
+    XCTAssert([codec dataFromValue:@{ @"key" : unpairedSurrogate } error:&error] == nil && error);
+    XCTAssert([TrackedModel codecForFieldName:@"tags"] == FCModelPropertyListCodec.sharedCodec);
+
+    // A model field using the codec is saved in its format and read back, and a plist BLOB already in it is only rewritten
+    //  once the field is changed and saved
+    NSData *(^storedAttributes)(void) = ^{ return (NSData *) [SimplerModel firstValueFromQuery:@"SELECT attributes FROM $T WHERE id = 5"]; };
+    SimplerModel *model = [SimplerModel instanceWithPrimaryKey:@(5)];
+    model.attributes = @{ @"color" : @"red", @"sizes" : @[ @1, @2 ] };
+    XCTAssert([model save] == FCModelSaveSucceeded);
+    XCTAssert([[storedAttributes() subdataWithRange:NSMakeRange(0, 3)] isEqual:[@"FCM" dataUsingEncoding:NSUTF8StringEncoding]]);
+    XCTAssert([[codec valueFromData:storedAttributes()] isEqual:model.attributes]);
+
+    [SimplerModel executeUpdateQuery:@"UPDATE $T SET attributes = ? WHERE id = 5", bplist];
+    XCTAssert([model.attributes isEqual:(@{ @"old" : @[ @1 ] })]);
+    model.title = @"retitled";
+    XCTAssert([model save] == FCModelSaveSucceeded);
+    XCTAssert([storedAttributes() isEqual:bplist]);
+    model.attributes = @{ @"new" : @YES };
+    XCTAssert([model save] == FCModelSaveSucceeded);
+    XCTAssert([[codec valueFromData:storedAttributes()] isEqual:(@{ @"new" : @YES })] && ! [storedAttributes() isEqual:bplist]);
+
+    model.attributes = @{ @"bad" : unpairedSurrogate };
+    XCTAssertThrows([model save]);
+    [model revertUnsavedChanges];
+}
+
+// Round trips of an integer array and a string map, so the codecs can be compared
+- (void)measureRoundTripsWithCodec:(id <FCModelCodec>)codec
+{
+    NSMutableArray *numbers = [NSMutableArray array];
+    NSMutableDictionary *strings = [NSMutableDictionary dictionary];
+    for (int i = 0; i < 1000; i++) {
+        [numbers addObject:@(i * 37)];
+        strings[[NSString stringWithFormat:@"key%d", i]] = [NSString stringWithFormat:@"value %d", i];
+    }
+
+    [self measureBlock:^{
+        for (id value in @[ numbers, strings ]) {
+            for (int i = 0; i < 100; i++) @autoreleasepool { [codec valueFromData:[codec dataFromValue:value error:NULL]]; }
+        }
+    }];
+}
+
+- (void)testBinaryCodecPerformance { [self measureRoundTripsWithCodec:FCModelBinaryCodec.sharedCodec]; }
+- (void)testPropertyListCodecPerformance { [self measureRoundTripsWithCodec:FCModelPropertyListCodec.sharedCodec]; }
+
+- (void)testExternalChangeMonitor
+{
+    SimplerModel *resident = [SimplerModel new];
+    resident.title = @"before";
+    [resident save];
+
+    __block int willReloadNotifications = 0;
+    id observer = [NSNotificationCenter.defaultCenter addObserverForName:FCModelWillReloadNotification object:SimplerModel.class queue:nil usingBlock:^(NSNotification *n) {
+        willReloadNotifications++;
+    }];
+
+    // This process's own writes touch the files but aren't external changes
+    for (int i = 0; i < 10; i++) {
+        resident.title = [NSString stringWithFormat:@"local %d", i];
+        [resident save];
+    }
+    [NSRunLoop.currentRunLoop runUntilDate:[NSDate dateWithTimeIntervalSinceNow:0.3]];
+    XCTAssert(willReloadNotifications == 0);
+
+    // One external transaction causes one reload, however many pages it writes
+    FMDatabase *externalWriter = [FMDatabase databaseWithPath:[self dbPath]];
+    XCTAssert([externalWriter open]);
+    [externalWriter beginTransaction];
+    for (int i = 0; i < 1000; i++) [externalWriter executeUpdate:@"INSERT INTO SimplerModel (title) VALUES (?)", @"external"];
+    [externalWriter executeUpdate:@"UPDATE SimplerModel SET title = 'changed externally' WHERE id = ?", @(resident.id)];
+    [externalWriter commit];
+    [externalWriter close];
+
+    for (int i = 0; i < 20 && ! willReloadNotifications; i++) [NSRunLoop.currentRunLoop runUntilDate:[NSDate dateWithTimeIntervalSinceNow:0.1]];
+    [NSRunLoop.currentRunLoop runUntilDate:[NSDate dateWithTimeIntervalSinceNow:0.3]];
+    XCTAssert(willReloadNotifications == 1, @"%d reloads", willReloadNotifications);
+    XCTAssert([resident.title isEqualToString:@"changed externally"]);
+    XCTAssert([SimplerModel numberOfInstancesWhere:@"title = 'external'" arguments:nil] == 1000);
+
+    [NSNotificationCenter.defaultCenter removeObserver:observer];
+}
+
+- (void)testExternalCommitNoticedByWrite
+{
+    SimplerModel *model = [SimplerModel new];
+    model.title = @"local";
+    [model save];
+
+    // A write notices an external commit made since the last check
+    [FCModel inDatabaseSync:^(FMDatabase *db) {
+        FMDatabase *externalWriter = [FMDatabase databaseWithPath:[self dbPath]];
+        [externalWriter open];
+        [externalWriter executeUpdate:@"UPDATE SimplerModel SET title = 'external' WHERE id = ?", @(model.id)];
+        [externalWriter close];
+        [db executeUpdate:@"INSERT INTO SimplerModel (title) VALUES ('local')"];
+    }];
+    [NSRunLoop.currentRunLoop runUntilDate:[NSDate dateWithTimeIntervalSinceNow:0.1]];
+    XCTAssert([model.title isEqualToString:@"external"]);
+}
+
+// Each query is one read block on the serialized connection, so this is mostly the cost of entering and leaving one
+- (void)testQueryBlockOverheadPerformance
+{
+    SimplerModel *model = [SimplerModel new];
+    model.title = @"overhead";
+    [model save];
+
+    [self measureBlock:^{
+        for (int i = 0; i < 20000; i++) @autoreleasepool {
+            [SimplerModel firstValueFromQuery:@"SELECT title FROM $T WHERE id = ?", @(model.id)];
+        }
+    }];
+}
+
+- (void)testNotificationDeliveryQueue
+{
+    dispatch_queue_t deliveryQueue = dispatch_queue_create("FCModelTest.notifications", DISPATCH_QUEUE_SERIAL);
+    [FCModel closeDatabase];
+    [FCModel setNotificationDeliveryQueue:deliveryQueue];
+    [self openDatabase];
+
+    NSNotificationCenter *nc = NSNotificationCenter.defaultCenter;
+    dispatch_semaphore_t delivered = dispatch_semaphore_create(0);
+    __block BOOL deliveredOnMainThread = YES;
+    id observer = [nc addObserverForName:FCModelInsertNotification object:SimplerModel.class queue:nil usingBlock:^(NSNotification *n) {
+        deliveredOnMainThread = NSThread.isMainThread;
+        dispatch_semaphore_signal(delivered);
+    }];
+
+    // Delivered without the main thread running its run loop, and cached results are invalidated there too
+    XCTAssert([SimplerModel cachedInstancesWhere:@"title = ?" arguments:@[ @"queued" ]].count == 0);
+    SimplerModel *model = [SimplerModel new];
+    model.title = @"queued";
+    [model save];
+    XCTAssert(dispatch_semaphore_wait(delivered, dispatch_time(DISPATCH_TIME_NOW, NSEC_PER_SEC)) == 0);
+    XCTAssert(! deliveredOnMainThread);
+    XCTAssert([SimplerModel cachedInstancesWhere:@"title = ?" arguments:@[ @"queued" ]].count == 1);
+    [nc removeObserver:observer];
+
+    // With no queue, they're delivered synchronously on the thread that made the change
+    model = nil;
+    [FCModel closeDatabase];
+    [FCModel setNotificationDeliveryQueue:nil];
+    [self openDatabase];
+
+    __block NSThread *savingThread = nil;
+    __block NSThread *deliveryThread = nil;
+    observer = [nc addObserverForName:FCModelInsertNotification object:SimplerModel.class queue:nil usingBlock:^(NSNotification *n) {
+        deliveryThread = NSThread.currentThread;
+    }];
+    dispatch_group_t group = dispatch_group_create();
+    dispatch_group_async(group, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+        savingThread = NSThread.currentThread;
+        SimplerModel *synchronous = [SimplerModel new];
+        synchronous.title = @"synchronous";
+        [synchronous save];
+        XCTAssert(deliveryThread == savingThread);
+    });
+    dispatch_group_wait(group, DISPATCH_TIME_FOREVER);
+    XCTAssert(deliveryThread && deliveryThread == savingThread);
+    [nc removeObserver:observer];
+
+    // ...except for changes made on the database queue, which are delivered from another thread once the block is done
+    __block BOOL blockFinished = NO;
+    __block BOOL deliveredAfterBlock = NO;
+    observer = [nc addObserverForName:FCModelInsertNotification object:SimplerModel.class queue:nil usingBlock:^(NSNotification *n) {
+        // The query waits for the database queue if the block is still running on it
+        deliveredAfterBlock = [SimplerModel numberOfInstancesWhere:@"title = ?", @"inBlock"] == 1 && blockFinished;
+        dispatch_semaphore_signal(delivered);
+    }];
+    [FCModel inDatabaseSync:^(FMDatabase *db) {
+        SimplerModel *inBlock = [SimplerModel new];
+        inBlock.title = @"inBlock";
+        [inBlock save];
+        blockFinished = YES;
+    }];
+    XCTAssert(dispatch_semaphore_wait(delivered, dispatch_time(DISPATCH_TIME_NOW, NSEC_PER_SEC)) == 0);
+    XCTAssert(deliveredAfterBlock);
+    [nc removeObserver:observer];
+
+    // Several changes there arrive in the order they were made, and cached results are invalidated before the block returns
+    NSMutableArray *insertedTitles = [NSMutableArray array];
+    observer = [nc addObserverForName:FCModelInsertNotification object:SimplerModel.class queue:nil usingBlock:^(NSNotification *n) {
+        SimplerModel *inserted = [n.userInfo[FCModelInstanceSetKey] anyObject];
+        [insertedTitles addObject:inserted.title];
+        if (insertedTitles.count == 5) dispatch_semaphore_signal(delivered);
+    }];
+    XCTAssert([SimplerModel cachedInstancesWhere:@"title LIKE 'ordered %'" arguments:nil].count == 0);
+    [FCModel inDatabaseSync:^(FMDatabase *db) {
+        for (int i = 0; i < 5; i++) {
+            SimplerModel *ordered = [SimplerModel new];
+            ordered.title = [NSString stringWithFormat:@"ordered %d", i];
+            [ordered save];
+        }
+    }];
+    XCTAssert([SimplerModel cachedInstancesWhere:@"title LIKE 'ordered %'" arguments:nil].count == 5);
+    XCTAssert(dispatch_semaphore_wait(delivered, dispatch_time(DISPATCH_TIME_NOW, NSEC_PER_SEC)) == 0);
+    XCTAssert([insertedTitles isEqualToArray:(@[ @"ordered 0", @"ordered 1", @"ordered 2", @"ordered 3", @"ordered 4" ])]);
+    [nc removeObserver:observer];
+
+    // The queue can't change while the database is open
+    XCTAssertThrows([FCModel setNotificationDeliveryQueue:dispatch_get_main_queue()]);
+
+    [FCModel closeDatabase];
+    [FCModel setNotificationDeliveryQueue:dispatch_get_main_queue()];
+    [self openDatabase];
+}
+
+- (void)testNotificationCoalescing
+{
+    [FCModel setNotificationCoalescingInterval:0.2 maximumCount:0];
+
+    NSNotificationCenter *nc = NSNotificationCenter.defaultCenter;
+    NSMutableArray *insertedSets = [NSMutableArray array];
+    id observer = [nc addObserverForName:FCModelInsertNotification object:SimplerModel.class queue:nil usingBlock:^(NSNotification *n) {
+        [insertedSets addObject:n.userInfo[FCModelInstanceSetKey]];
+    }];
+
+    // Saves from several threads inside one window arrive as a single notification
+    dispatch_group_t group = dispatch_group_create();
+    for (int i = 0; i < 8; i++) {
+        dispatch_group_async(group, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+            SimplerModel *model = [SimplerModel new];
+            model.title = [NSString stringWithFormat:@"coalesced %d", i];
+            [model save];
+        });
+    }
+    dispatch_group_wait(group, DISPATCH_TIME_FOREVER);
+    XCTAssert(insertedSets.count == 0);
+
+    NSDate *deadline = [NSDate dateWithTimeIntervalSinceNow:2.0];
+    while (insertedSets.count == 0 && [deadline timeIntervalSinceNow] > 0) [NSRunLoop.currentRunLoop runUntilDate:[NSDate dateWithTimeIntervalSinceNow:0.05]];
+    [NSRunLoop.currentRunLoop runUntilDate:[NSDate dateWithTimeIntervalSinceNow:0.3]];
+    XCTAssert(insertedSets.count == 1);
+    XCTAssert([insertedSets.firstObject count] == 8);
+
+    // Reaching the maximum count of saves ends the window without waiting for it, and never between one save's notifications
+    [insertedSets removeAllObjects];
+    NSMutableArray *changedSets = [NSMutableArray array];
+    id changeObserver = [nc addObserverForName:FCModelAnyChangeNotification object:SimplerModel.class queue:nil usingBlock:^(NSNotification *n) {
+        [changedSets addObject:n.userInfo[FCModelInstanceSetKey]];
+    }];
+    [FCModel setNotificationCoalescingInterval:60 maximumCount:2];
+    NSMutableArray *limited = [NSMutableArray array];
+    for (int i = 0; i < 3; i++) {
+        SimplerModel *model = [SimplerModel new];
+        model.title = [NSString stringWithFormat:@"limited %d", i];
+        [model save];
+        [limited addObject:model];
+    }
+    [NSRunLoop.currentRunLoop runUntilDate:[NSDate dateWithTimeIntervalSinceNow:0.1]];
+    XCTAssert(insertedSets.count == 1);
+    XCTAssert([insertedSets.firstObject isEqualToSet:[NSSet setWithArray:[limited subarrayWithRange:NSMakeRange(0, 2)]]]);
+    XCTAssert(changedSets.count == 1 && [changedSets.firstObject isEqualToSet:insertedSets.firstObject]);
+
+    // Turning it off delivers whatever's pending
+    [FCModel setNotificationCoalescingInterval:0 maximumCount:0];
+    XCTAssert(insertedSets.count == 2 && changedSets.count == 2);
+    XCTAssert([insertedSets.lastObject isEqualToSet:[NSSet setWithObject:limited[2]]]);
+    XCTAssert([changedSets.lastObject isEqualToSet:[NSSet setWithObject:limited[2]]]);
+
+    [nc removeObserver:changeObserver];
+    [nc removeObserver:observer];
+}
+
+- (void)testChangeSubscriptions
+{
+    SimplerModel *watched = [SimplerModel new];
+    watched.title = @"watched";
+    [watched save];
+    SimplerModel *other = [SimplerModel new];
+    other.title = @"other";
+    [other save];
+
+    NSMutableArray *allChanges = [NSMutableArray array];
+    NSMutableArray *rowChanges = [NSMutableArray array];
+    NSMutableArray *titleChanges = [NSMutableArray array];
+    NSMutableArray *everyClassChanges = [NSMutableArray array];
+    id allSubscription = [SimplerModel subscribeToChangesWithPrimaryKey:nil fieldNames:nil block:^(NSArray *changes) { [allChanges addObjectsFromArray:changes]; }];
+    id rowSubscription = [SimplerModel subscribeToChangesWithPrimaryKey:watched.primaryKey fieldNames:nil block:^(NSArray *changes) { [rowChanges addObjectsFromArray:changes]; }];
+    id titleSubscription = [SimplerModel subscribeToChangesWithPrimaryKey:nil fieldNames:@[ @"title" ] block:^(NSArray *changes) { [titleChanges addObjectsFromArray:changes]; }];
+    id everyClassSubscription = [FCModel subscribeToChangesWithPrimaryKey:nil fieldNames:nil block:^(NSArray *changes) { [everyClassChanges addObjectsFromArray:changes]; }];
+
+    other.title = @"other changed";
+    [other save];
+    XCTAssert(allChanges.count == 1 && rowChanges.count == 0 && titleChanges.count == 1 && everyClassChanges.count == 1);
+    FCModelChange *change = allChanges.firstObject;
+    XCTAssert(change.modelClass == SimplerModel.class);
+    XCTAssert(change.operation == FCModelChangeUpdate);
+    XCTAssertEqualObjects(change.primaryKey, other.primaryKey);
+    XCTAssert(change.changedFieldMask == [SimplerModel changeMaskForFieldNames:@[ @"title" ]]);
+
+    // Primary keys of another type are converted to the column's, as they are for instanceWithPrimaryKey:
+    NSMutableArray *convertedKeyChanges = [NSMutableArray array];
+    id stringKeySubscription = [SimplerModel subscribeToChangesWithPrimaryKey:[NSString stringWithFormat:@"%lld", (long long) other.id] fieldNames:nil block:^(NSArray *changes) { [convertedKeyChanges addObjectsFromArray:changes]; }];
+    id doubleKeySubscription = [SimplerModel subscribeToChangesWithPrimaryKey:@((double) other.id) fieldNames:nil block:^(NSArray *changes) { [convertedKeyChanges addObjectsFromArray:changes]; }];
+    other.title = @"other changed again";
+    [other save];
+    XCTAssert(convertedKeyChanges.count == 2, @"%@", convertedKeyChanges);
+    [SimplerModel removeChangeSubscription:stringKeySubscription];
+    [SimplerModel removeChangeSubscription:doubleKeySubscription];
+
+    [watched delete];
+    XCTAssert(rowChanges.count == 1);
+    XCTAssert(((FCModelChange *) rowChanges.firstObject).operation == FCModelChangeDelete);
+
+    // Batches deliver their records together, in order
+    __block NSUInteger deliveries = 0;
+    id batchSubscription = [SimplerModel subscribeToChangesWithPrimaryKey:nil fieldNames:nil block:^(NSArray *changes) {
+        deliveries++;
+        XCTAssert(changes.count == 3);
+        XCTAssert(((FCModelChange *) changes[0]).operation == FCModelChangeInsert);
+        XCTAssert(((FCModelChange *) changes[2]).operation == FCModelChangeDelete);
+    }];
+    [FCModel performWithBatchedNotifications:^{
+        SimplerModel *batched = [SimplerModel new];
+        batched.title = @"batched";
+        [batched save];
+        batched.title = @"batched again";
+        [batched save];
+        [batched delete];
+    }];
+    XCTAssert(deliveries == 1);
+    [SimplerModel removeChangeSubscription:batchSubscription];
+
+    // Changes that can't be traced to rows reach every subscription, including single-row ones
+    [rowChanges removeAllObjects];
+    [SimplerModel dataWasUpdatedExternally];
+    XCTAssert(rowChanges.count == 1);
+    XCTAssert(((FCModelChange *) rowChanges.firstObject).operation == FCModelChangeUnidentifiedRows);
+
+    for (id subscription in @[ allSubscription, rowSubscription, titleSubscription ]) [SimplerModel removeChangeSubscription:subscription];
+    [FCModel removeChangeSubscription:everyClassSubscription];
+    [allChanges removeAllObjects];
+    SimplerModel *unwatched = [SimplerModel new];
+    [unwatched save];
+    XCTAssert(allChanges.count == 0);
+}
 
 #pragma mark - Helper methods
 
-- (void)openDatabase
+- (void)openDatabase { [self openDatabaseWithMaximumConcurrentReaders:0]; }
+
+- (void)openDatabaseWithMaximumConcurrentReaders:(NSUInteger)readerCount
 {
-    [FCModel openDatabaseAtPath:[self dbPath] withSchemaBuilder:^(FMDatabase *db, int *schemaVersion) {
+    [FCModel openDatabaseAtPath:[self dbPath] withDatabaseInitializer:nil schemaBuilder:^(FMDatabase *db, int *schemaVersion) {
         [db setCrashOnErrors:YES];
         [db beginTransaction];
         
@@ -539,16 +1917,42 @@
 
             if (! [db executeUpdate:
                 @"CREATE TABLE SimplerModel ("
-                @"    id    INTEGER PRIMARY KEY,"
-                @"    title TEXT"
+                @"    id         INTEGER PRIMARY KEY,"
+                @"    title      TEXT,"
+                @"    attributes BLOB"
                 @");"
             ]) failedAt(2);
 
+            if (! [db executeUpdate:
+                @"CREATE TABLE TrackedModel ("
+                @"    id      INTEGER PRIMARY KEY,"
+                @"    title   TEXT,"
+                @"    count   INTEGER NOT NULL DEFAULT 0,"
+                @"    rating  REAL NOT NULL DEFAULT 0,"
+                @"    flagged INTEGER NOT NULL DEFAULT 0,"
+                @"    tags    BLOB"
+                @");"
+            ]) failedAt(3);
 
             *schemaVersion = 1;
         }
         [db commit];
+    } maximumConcurrentReaders:readerCount];
+}
+
+// Statements still open on the read-write connection, which are the cached ones since FMDB finalizes its own
+- (int)preparedStatementCount
+{
+    __block int count = 0;
+    [FCModel inDatabaseSync:^(FMDatabase *db) {
+        for (sqlite3_stmt *statement = sqlite3_next_stmt(db.sqliteHandle, NULL); statement; statement = sqlite3_next_stmt(db.sqliteHandle, statement)) count++;
     }];
+    return count;
+}
+
+- (void)observeValueForKeyPath:(NSString *)keyPath ofObject:(id)object change:(NSDictionary *)change context:(void *)context
+{
+    observedChangeCount++;
 }
 
 - (NSString *)dbPath
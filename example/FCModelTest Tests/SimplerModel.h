@@ -12,5 +12,6 @@
 
 @property (nonatomic) int64_t id;
 @property (nonatomic, copy) NSString *title;
+@property (nonatomic, copy) NSDictionary *attributes; // FCModelBinaryCodec
 
 @end
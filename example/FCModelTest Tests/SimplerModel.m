@@ -10,4 +10,9 @@
 
 @implementation SimplerModel
 
++ (id <FCModelCodec>)codecForFieldName:(NSString *)fieldName
+{
+    return [fieldName isEqualToString:@"attributes"] ? FCModelBinaryCodec.sharedCodec : [super codecForFieldName:fieldName];
+}
+
 @end
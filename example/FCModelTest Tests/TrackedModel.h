@@ -0,0 +1,19 @@
+//
+//  TrackedModel.h
+//  FCModelTest
+//
+//  Copyright (c) 2014 Marco Arment. All rights reserved.
+//
+
+#import "FCModel.h"
+
+@interface TrackedModel : FCModel
+
+@property (nonatomic) int64_t id;
+@property (nonatomic, copy) NSString *title;
+@property (nonatomic) NSInteger count;
+@property (nonatomic) double rating;
+@property (nonatomic, getter=isFlagged, setter=setIsFlagged:) BOOL flagged;
+@property (nonatomic, copy) NSArray *tags;
+
+@end
@@ -0,0 +1,14 @@
+//
+//  TrackedModel.m
+//  FCModelTest
+//
+//  Copyright (c) 2014 Marco Arment. All rights reserved.
+//
+
+#import "TrackedModel.h"
+
+@implementation TrackedModel
+
++ (BOOL)tracksChangesWithSetters { return YES; }
+
+@end